@@ -2,283 +2,1631 @@
 #include "ChunkIO.hpp"
 #include "ErrorHandling.hpp"
 #include "celsus.hpp"
+#include "MemoryMappedFile.hpp"
+#include "crc32c.hpp"
+#include <algorithm>
+#include <functional>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef CHUNK_SUPPORTS_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#include <lz4frame.h>
+#pragma comment(lib, "liblz4_static.lib")
+#endif
+#ifdef CHUNK_SUPPORTS_ZSTD
+#include <zstd.h>
+#pragma comment(lib, "libzstd_static.lib")
+#endif
+
+namespace
+{
+  // The output file is a HANDLE on Windows, and a file descriptor elsewhere. Both are kept in an
+  // intptr_t, with -1 for no file, which is also what INVALID_HANDLE_VALUE is
+  const intptr_t kNoFile = -1;
+
+  intptr_t open_output(const char* filename, const bool create)
+  {
+#ifdef _WIN32
+    // opened for reading too, as checksumming chunks that are already written means reading them back
+    return (intptr_t)CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+#else
+    return ::open(filename, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+#endif
+  }
+
+  // Always at an explicit offset, as patching means going back and forth
+  bool write_at(const intptr_t file, const void* data, const uint32_t len, const uint32_t pos)
+  {
+#ifdef _WIN32
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = pos;
+    DWORD written = 0;
+    return WriteFile((HANDLE)file, data, len, &written, &overlapped) && written == len;
+#else
+    const uint8_t* src = (const uint8_t*)data;
+    for (uint32_t done = 0; done < len; ) {
+      const ssize_t written = pwrite((int)file, src + done, len - done, (off_t)pos + done);
+      if (written <= 0) {
+        return false;
+      }
+      done += (uint32_t)written;
+    }
+    return true;
+#endif
+  }
+
+  // Returns the number of bytes read, which is 0 on failure
+  uint32_t read_at(const intptr_t file, void* data, const uint32_t len, const uint32_t pos)
+  {
+#ifdef _WIN32
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = pos;
+    DWORD bytes_read = 0;
+    return ReadFile((HANDLE)file, data, len, &bytes_read, &overlapped) ? bytes_read : 0;
+#else
+    const ssize_t bytes_read = pread((int)file, data, len, (off_t)pos);
+    return bytes_read > 0 ? (uint32_t)bytes_read : 0;
+#endif
+  }
+
+  bool flush_file(const intptr_t file)
+  {
+#ifdef _WIN32
+    return !!FlushFileBuffers((HANDLE)file);
+#else
+    return fsync((int)file) == 0;
+#endif
+  }
+
+  bool truncate_file(const intptr_t file, const uint32_t len)
+  {
+#ifdef _WIN32
+    return SetFilePointer((HANDLE)file, len, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER && SetEndOfFile((HANDLE)file);
+#else
+    return ftruncate((int)file, (off_t)len) == 0;
+#endif
+  }
+
+  void close_file(const intptr_t file)
+  {
+#ifdef _WIN32
+    CloseHandle((HANDLE)file);
+#else
+    ::close((int)file);
+#endif
+  }
+
+  // Worker threads shared by every ChunkIo, started the first time there's something for them to
+  // do, and kept for the life of the process, so (de)compressing a batch of blocks doesn't pay for
+  // creating threads. A batch is queued for the workers, and the thread that queued it works on it
+  // too, so a batch always finishes, even when no worker is free, or none could be started
+  class WorkerPool
+  {
+  public:
+    // Calls fn with 0 to count-1, and returns once they're all done. fn also gets the slot of the
+    // thread it runs on, which is below max_slots(), and only used by one thread of the batch
+    static void run(const int count, const std::function<void(int, int)>& fn);
+    // One slot for every processor, as that's how many threads can work on a batch at once
+    static int max_slots();
+
+  private:
+    struct Batch
+    {
+      const std::function<void(int, int)>* fn;
+      int count;
+      int next;           // next item to hand out
+      int finished;
+      int slots;          // threads that have joined in
+      Batch* next_batch;
+    };
+
+    static void start();
+    static void work_on(Batch* batch);
+    static Batch* find_work();
+    static void lock();
+    static void unlock();
+    static void wait(const bool done);
+    static void wake(const bool done);
+#ifdef _WIN32
+    static DWORD WINAPI worker_thread(void* param);
+#else
+    static void* worker_thread(void* param);
+#endif
+
+    // everything is guarded by the lock, which along with the condition variables is statically
+    // initialized, so the pool works from static constructors too
+    static int workers_;        // -1 until the workers are started
+    static Batch* batches_;
+#ifdef _WIN32
+    static SRWLOCK lock_;
+    static CONDITION_VARIABLE work_;
+    static CONDITION_VARIABLE done_;
+#else
+    static pthread_mutex_t lock_;
+    static pthread_cond_t work_;
+    static pthread_cond_t done_;
+#endif
+  };
+
+  int WorkerPool::workers_ = -1;
+  WorkerPool::Batch* WorkerPool::batches_ = NULL;
+#ifdef _WIN32
+  SRWLOCK WorkerPool::lock_ = SRWLOCK_INIT;
+  CONDITION_VARIABLE WorkerPool::work_ = CONDITION_VARIABLE_INIT;
+  CONDITION_VARIABLE WorkerPool::done_ = CONDITION_VARIABLE_INIT;
+
+  int WorkerPool::max_slots()
+  {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return max(1, (int)info.dwNumberOfProcessors);
+  }
+
+  void WorkerPool::lock() { AcquireSRWLockExclusive(&lock_); }
+  void WorkerPool::unlock() { ReleaseSRWLockExclusive(&lock_); }
+  void WorkerPool::wait(const bool done) { SleepConditionVariableSRW(done ? &done_ : &work_, &lock_, INFINITE, 0); }
+  void WorkerPool::wake(const bool done) { WakeAllConditionVariable(done ? &done_ : &work_); }
+
+  DWORD WINAPI WorkerPool::worker_thread(void*)
+  {
+    lock();
+    for (;;) {
+      work_on(find_work());
+    }
+  }
+
+  // Called with the lock held
+  void WorkerPool::start()
+  {
+    workers_ = 0;
+    for (int i = 1; i < max_slots(); ++i) {
+      HANDLE thread = CreateThread(NULL, 0, worker_thread, NULL, 0, NULL);
+      if (thread != NULL) {
+        CloseHandle(thread);
+        ++workers_;
+      }
+    }
+  }
+#else
+  pthread_mutex_t WorkerPool::lock_ = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t WorkerPool::work_ = PTHREAD_COND_INITIALIZER;
+  pthread_cond_t WorkerPool::done_ = PTHREAD_COND_INITIALIZER;
+
+  int WorkerPool::max_slots()
+  {
+    return max(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+  }
+
+  void WorkerPool::lock() { pthread_mutex_lock(&lock_); }
+  void WorkerPool::unlock() { pthread_mutex_unlock(&lock_); }
+  void WorkerPool::wait(const bool done) { pthread_cond_wait(done ? &done_ : &work_, &lock_); }
+  void WorkerPool::wake(const bool done) { pthread_cond_broadcast(done ? &done_ : &work_); }
+
+  void* WorkerPool::worker_thread(void*)
+  {
+    lock();
+    for (;;) {
+      work_on(find_work());
+    }
+  }
+
+  // Called with the lock held
+  void WorkerPool::start()
+  {
+    workers_ = 0;
+    for (int i = 1; i < max_slots(); ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, worker_thread, NULL) == 0) {
+        pthread_detach(thread);
+        ++workers_;
+      }
+    }
+  }
+#endif
+
+  // Called with the lock held, and waits until there's a batch with items left
+  WorkerPool::Batch* WorkerPool::find_work()
+  {
+    for (;;) {
+      for (Batch* batch = batches_; batch != NULL; batch = batch->next_batch) {
+        if (batch->next < batch->count) {
+          return batch;
+        }
+      }
+      wait(false);
+    }
+  }
+
+  // Called with the lock held, which is let go while the items run. A thread only leaves a batch
+  // when there's nothing left to hand out, so it never joins the same batch twice
+  void WorkerPool::work_on(Batch* batch)
+  {
+    const int slot = batch->slots++;
+    while (batch->next < batch->count) {
+      const int i = batch->next++;
+      unlock();
+      (*batch->fn)(i, slot);
+      lock();
+      if (++batch->finished == batch->count) {
+        wake(true);
+      }
+    }
+  }
+
+  void WorkerPool::run(const int count, const std::function<void(int, int)>& fn)
+  {
+    if (count <= 0) {
+      return;
+    }
+    Batch batch = { &fn, count, 0, 0, 0, NULL };
+    lock();
+    if (workers_ < 0) {
+      start();
+    }
+    if (workers_ > 0 && count > 1) {
+      batch.next_batch = batches_;
+      batches_ = &batch;
+      wake(false);
+    }
+
+    work_on(&batch);
+    while (batch.finished < batch.count) {
+      wait(true);
+    }
+
+    // the batch lives on this stack, so it has to go before returning
+    for (Batch** it = &batches_; *it != NULL; it = &(*it)->next_batch) {
+      if (*it == &batch) {
+        *it = batch.next_batch;
+        break;
+      }
+    }
+    unlock();
+  }
+
+  // Returns where the checksums and directory at the end of the file start, without checking them
+  uint64_t trailer_start(const uint8_t* data, const uint32_t file_len)
+  {
+    uint64_t end = file_len;
+    if (end >= sizeof(ChunkIo::MainHeader) + sizeof(ChunkIo::DirectoryFooter)) {
+      const ChunkIo::DirectoryFooter* footer = (const ChunkIo::DirectoryFooter*)(data + end - sizeof(ChunkIo::DirectoryFooter));
+      if (footer->id == ChunkIo::DirectoryFooter::kFooterId) {
+        const uint64_t len = (uint64_t)footer->entry_count * sizeof(ChunkIo::DirectoryEntry) + sizeof(ChunkIo::DirectoryFooter);
+        end = len <= end ? end - len : 0;
+      }
+    }
+    if (end >= sizeof(ChunkIo::MainHeader) + sizeof(ChunkIo::ChecksumFooter)) {
+      const ChunkIo::ChecksumFooter* footer = (const ChunkIo::ChecksumFooter*)(data + end - sizeof(ChunkIo::ChecksumFooter));
+      if (footer->id == ChunkIo::ChecksumFooter::kFooterId) {
+        const uint64_t len = (uint64_t)footer->chunk_count * sizeof(ChunkIo::ChunkChecksum) +
+          (uint64_t)footer->block_count * sizeof(uint32_t) + sizeof(ChunkIo::ChecksumFooter);
+        end = len <= end ? end - len : 0;
+      }
+    }
+    return end;
+  }
+
+  // The number of entries before a footer. Uncompressed files have no block crcs
+  uint32_t footer_count(const ChunkIo::ChecksumFooter* footer) { return footer->block_count == 0 ? footer->chunk_count : ~0u; }
+  uint32_t footer_count(const ChunkIo::DirectoryFooter* footer) { return footer->entry_count; }
+
+  // Returns the end of the trailer that starts at pos, found by walking its entries up to the footer
+  // that counts them, or 0 if there's no such footer. T is the entry type, F the footer type
+  template<typename T, typename F>
+  uint64_t walk_trailer(const uint8_t* data, const uint32_t file_len, const uint64_t pos, const uint32_t payload_len)
+  {
+    uint32_t prev_offset = 0;
+    for (uint32_t i = 0; pos + (uint64_t)i * sizeof(T) + sizeof(F) <= file_len; ++i) {
+      const uint8_t* cur = data + pos + (uint64_t)i * sizeof(T);
+      const F* footer = (const F*)cur;
+      if (footer->id == F::kFooterId && footer_count(footer) == i) {
+        return pos + (uint64_t)i * sizeof(T) + sizeof(F);
+      }
+      // both kinds of entries are sorted by an offset into the payload
+      const T* entry = (const T*)cur;
+      if (pos + (uint64_t)(i + 1) * sizeof(T) > file_len || entry->offset >= payload_len || (i > 0 && entry->offset <= prev_offset)) {
+        return 0;
+      }
+      prev_offset = entry->offset;
+    }
+    return 0;
+  }
+
+  // Returns the length of an uncompressed file up to the end of its trailer. That's normally the
+  // whole file, but an appender writes after the old trailer, which stays right after the payload
+  // until the header is updated, so an interrupted append leaves a file that still reads as before
+  uint32_t uncompressed_file_len(const uint8_t* data, const uint32_t file_len)
+  {
+    const uint64_t payload_end = sizeof(ChunkIo::MainHeader) + (uint64_t)((const ChunkIo::MainHeader*)data)->uncompressesd_size;
+    if (payload_end >= file_len || trailer_start(data, file_len) == payload_end) {
+      return file_len;
+    }
+
+    const uint32_t payload_len = (uint32_t)(payload_end - sizeof(ChunkIo::MainHeader));
+    uint64_t pos = walk_trailer<ChunkIo::ChunkChecksum, ChunkIo::ChecksumFooter>(data, file_len, payload_end, payload_len);
+    const uint64_t end = walk_trailer<ChunkIo::DirectoryEntry, ChunkIo::DirectoryFooter>(data, file_len, pos ? pos : payload_end, payload_len);
+    return end ? (uint32_t)end : file_len;
+  }
+}
 
 ChunkIo::ChunkIo() 
   : reader_data_(NULL)
+  , reader_input_(NULL)
+  , reader_buf_(NULL)
+  , reader_buf_len_(0)
+  , window_(NULL)
+  , reader_file_(NULL)
   , reader_data_len_(0)
+  , window_ofs_(0)
+  , window_len_(0)
+  , reader_file_data_(NULL)
+  , reader_blocks_(NULL)
+  , reader_block_table_(NULL)
+  , reader_directory_(NULL)
+  , reader_directory_len_(0)
+  , reader_checksums_(NULL)
+  , reader_checksums_len_(0)
+  , reader_block_crcs_(NULL)
+  , reader_block_crcs_len_(0)
   , cur_data_pos_(0)
   , last_header_pos_(0)
   , writer_buf_(NULL)
   , writer_buf_len_(0)
   , bytes_used_(0)
+  , flushed_bytes_(0)
+  , outer_header_pos_(0)
+  , out_buf_(NULL)
+  , out_buf_len_(0)
+  , out_bytes_used_(0)
+  , out_flushed_(0)
+  , writer_file_(kNoFile)
+  , failed_(false)
+  , level_(kDefaultCompressionLevel)
+#ifdef CHUNK_SUPPORTS_ZSTD
+  , block_codec_(MainHeader::CompressedZstd)
+#else
+  , block_codec_(MainHeader::CompressedZLib)
+#endif
+  , block_size_(kDefaultBlockSize)
+  , write_directory_(false)
+  , write_checksums_(false)
+  , dictionary_(NULL)
+  , stream_state_(kStreamNone)
+  , stream_in_(NULL)
+  , stream_in_len_(0)
+  , stream_start_(NULL)
+  , stream_start_len_(0)
+  , lz4_cctx_(NULL)
+  , lz4_dctx_(NULL)
+  , zstd_cctx_(NULL)
+  , zstd_dctx_(NULL)
 {
 }
 
 ChunkIo::~ChunkIo() 
 {
-  SAFE_ADELETE(reader_data_);
-  reader_data_len_ = 0;
+  reset_reader();
 
   SAFE_ADELETE(writer_buf_);
   writer_buf_len_ = 0;
+  SAFE_ADELETE(out_buf_);
+  close_output();
+
+#ifdef CHUNK_SUPPORTS_ZSTD
+  for (size_t i = 0; i < block_cctxs_.size(); ++i) {
+    ZSTD_freeCCtx(block_cctxs_[i]);
+  }
+  for (size_t i = 0; i < block_dctxs_.size(); ++i) {
+    ZSTD_freeDCtx(block_dctxs_[i]);
+  }
+#endif
+}
+
+void ChunkIo::reset_reader()
+{
+  end_stream();
+  SAFE_ADELETE(reader_input_);
+  SAFE_ADELETE(reader_buf_);
+  SAFE_DELETE(reader_file_);
+  reader_buf_len_ = 0;
+  reader_data_ = NULL;
+  window_ = NULL;
+  reader_data_len_ = 0;
+  window_ofs_ = 0;
+  window_len_ = 0;
+  reader_file_data_ = NULL;
+  reader_blocks_ = NULL;
+  reader_block_table_ = NULL;
+  reader_directory_ = NULL;
+  reader_directory_len_ = 0;
+  reader_checksums_ = NULL;
+  reader_checksums_len_ = 0;
+  reader_block_crcs_ = NULL;
+  reader_block_crcs_len_ = 0;
+  chunk_verified_.clear();
+  cur_data_pos_ = 0;
+  last_header_pos_ = 0;
 }
 
 bool ChunkIo::init_reader(uint8_t* data, const uint32_t data_len)
 {
+  reset_reader();
   if (data == NULL || data_len == 0) {
     return false;
   }
-  reader_data_ = data;
-  reader_data_len_ = data_len;
-  cur_data_pos_ = 0;
-  last_header_pos_ = 0;
-  if (!handle_compression()) {
+  reader_input_ = data;
+  if (!handle_compression(data, data_len)) {
+    return false;
+  }
+  return true;
+}
+
+bool ChunkIo::init_mapped_reader(const char* filename)
+{
+  reset_reader();
+  reader_file_ = new MemoryMappedFile();
+  void* data = NULL;
+  uint64_t data_len = 0;
+  if (!reader_file_->open(filename, &data, &data_len, 0)) {
+    LOG_WARNING_LN("Unable to map file: %s", filename);
+    SAFE_DELETE(reader_file_);
+    return false;
+  }
+
+  if (data_len > 0xffffffff) {
+    LOG_WARNING_LN("File too large: %s", filename);
+    SAFE_DELETE(reader_file_);
+    return false;
+  }
+
+  // compressed files are decompressed straight from the mapping as they are read, so keep it around
+  if (!handle_compression((const uint8_t*)data, (uint32_t)data_len)) {
     return false;
   }
   return true;
 }
 
-bool ChunkIo::handle_compression()
+bool ChunkIo::handle_compression(const uint8_t* data, const uint32_t file_len)
 {
-  MainHeader* main_header = (MainHeader*)reader_data_;
-  if (main_header->id != MainHeader::kHeaderId) {
+  const MainHeader* main_header = (const MainHeader*)data;
+  if (file_len < sizeof(MainHeader) || main_header->id != MainHeader::kHeaderId) {
     LOG_WARNING_LN("Invalid header");
     return false;
   }
   reader_data_len_ = main_header->uncompressesd_size;
 
+  // everything but the directory and checksums
+  uint32_t data_len = main_header->version == MainHeader::Uncompressed ? uncompressed_file_len(data, file_len) : file_len;
+  if (!read_directory(data, &data_len) || !read_checksums(data, &data_len)) {
+    return false;
+  }
+  const uint32_t compressed_len = data_len - sizeof(MainHeader);
+
   switch (main_header->version) {
     case MainHeader::Uncompressed:
-      reader_data_ += sizeof(MainHeader);
-      break;
+      if (reader_data_len_ > compressed_len) {
+        LOG_WARNING_LN("Truncated data");
+        return false;
+      }
+      // the whole payload is available, so the window covers all of it
+      reader_data_ = data + sizeof(MainHeader);
+      window_len_ = reader_data_len_;
+      return fill_chunk();
 
     case MainHeader::CompressedBZLib:
-      {
-#ifdef CHUNK_SUPPORTS_BZLIB
-        uint8_t* uncompressed_data = new uint8_t[main_header->uncompressesd_size];
-        uint32_t dest_len = main_header->uncompressesd_size;
-        const int32_t res = BZ2_bzBuffToBuffDecompress(
-          (char*)uncompressed_data, &dest_len, (char*)(reader_data_ + sizeof(MainHeader)), reader_data_len_ - sizeof(MainHeader), 0, 0);
-        if (res != BZ_OK) {
-          LOG_WARNING_LN("Error decompressing data");
-          return false;
-        }
-        delete [] reader_data_;
-        reader_data_ = uncompressed_data;
-#else
-        throw std::string("bzlib not supported");
-#endif
+    case MainHeader::CompressedZLib:
+    case MainHeader::CompressedLZ4:
+    case MainHeader::CompressedZstd:
+      if (!begin_stream(main_header->version, false)) {
+        return false;
       }
       break;
 
-    case MainHeader::CompressedZLib:
+    case MainHeader::CompressedBlocks:
       {
-#ifdef CHUNK_SUPPORTS_ZLIB
-        uint8_t* uncompressed_data = new uint8_t[main_header->uncompressesd_size];
-        uLongf dest_len = main_header->uncompressesd_size;
-        const int32_t res = uncompress(
-          (Bytef*)uncompressed_data, &dest_len, (Bytef*)(reader_data_ + sizeof(MainHeader)), reader_data_len_ - sizeof(MainHeader));
-        if (res != BZ_OK) {
-          LOG_WARNING_LN("Error decompressing data");
+        const BlockHeader* blocks = (const BlockHeader*)(data + sizeof(MainHeader));
+        if (compressed_len < sizeof(BlockHeader) || blocks->block_size == 0 || block_bound(blocks->codec, blocks->block_size) == 0) {
+          LOG_WARNING_LN("Invalid block header");
           return false;
         }
-        delete [] reader_data_;
-        reader_data_ = uncompressed_data;
-#else
-        throw std::string("zlib not supported");
-#endif
 
+        // check the whole table up front, so reading a block never has to
+        const uint32_t block_size = blocks->block_size;
+        const BlockEntry* table = (const BlockEntry*)(data + blocks->table_offset);
+        bool valid = blocks->block_count == ((uint64_t)reader_data_len_ + block_size - 1) / block_size &&
+          (uint64_t)blocks->table_offset + (uint64_t)blocks->block_count * sizeof(BlockEntry) <= data_len;
+        valid = valid && (reader_block_crcs_ == NULL || reader_block_crcs_len_ == blocks->block_count);
+        for (uint32_t i = 0; valid && i < blocks->block_count; ++i) {
+          valid = (uint64_t)table[i].offset + table[i].size <= data_len && table[i].size <= block_size;
+        }
+        if (!valid) {
+          LOG_WARNING_LN("Invalid block table");
+          return false;
+        }
+        reader_file_data_ = data;
+        reader_blocks_ = blocks;
+        reader_block_table_ = table;
+
+        // make the window big enough to decompress a batch of blocks in one go
+        const uint32_t batch_blocks = (uint32_t)min((uint64_t)kBlocksPerBatch, (uint64_t)blocks->block_count);
+        move_window(0, max(1u, batch_blocks) * block_size);
+        return fill_chunk();
       }
-      break;
+
+    default:
+      LOG_WARNING_LN("Unknown version: %d", main_header->version);
+      return false;
   }
-  return true;
-}
 
-bool ChunkIo::is_eof() 
-{
-  return cur_data_pos_ >= reader_data_len_;
-}
+  stream_in_ = stream_start_ = data + sizeof(MainHeader);
+  stream_in_len_ = stream_start_len_ = compressed_len;
 
-bool ChunkIo::is_end_of_chunk() 
-{
-  return cur_data_pos_ - last_header_pos_ >= cur_header().size_;
+  // start out with a window big enough for the whole payload if it's small, and grow it
+  // later if we run into a chunk that doesn't fit
+  const uint32_t window_len = kDefaultWindowLen;
+  move_window(0, max(1u, min(window_len, reader_data_len_)));
+  return fill_chunk();
 }
 
-ChunkHeader ChunkIo::cur_header() 
+bool ChunkIo::read_directory(const uint8_t* data, uint32_t* data_len)
 {
-  return *reinterpret_cast<ChunkHeader*>(&reader_data_[last_header_pos_]);
-}
+  if (*data_len < sizeof(MainHeader) + sizeof(DirectoryFooter)) {
+    return true;
+  }
+  const DirectoryFooter* footer = (const DirectoryFooter*)(data + *data_len - sizeof(DirectoryFooter));
+  if (footer->id != DirectoryFooter::kFooterId) {
+    // no directory
+    return true;
+  }
 
-uint8_t* ChunkIo::data_ptr() 
-{
-  if (is_eof()) {
-    return NULL;
+  const uint64_t directory_len = (uint64_t)footer->entry_count * sizeof(DirectoryEntry) + sizeof(DirectoryFooter);
+  if (directory_len > *data_len - sizeof(MainHeader)) {
+    LOG_WARNING_LN("Invalid directory");
+    return false;
   }
-  return reinterpret_cast<uint8_t*>(&reader_data_[cur_data_pos_ + sizeof(ChunkHeader)]);
+
+  // check the entries up front, so seek doesn't have to
+  const DirectoryEntry* entries = (const DirectoryEntry*)((const uint8_t*)footer - footer->entry_count * sizeof(DirectoryEntry));
+  for (uint32_t i = 0; i < footer->entry_count; ++i) {
+    if ((uint64_t)entries[i].offset + sizeof(ChunkHeader) + entries[i].size > reader_data_len_ ||
+      (i > 0 && entries[i].offset <= entries[i-1].offset)) {
+      LOG_WARNING_LN("Invalid directory");
+      return false;
+    }
+  }
+
+  reader_directory_ = entries;
+  reader_directory_len_ = footer->entry_count;
+  *data_len -= (uint32_t)directory_len;
+  return true;
 }
 
-bool ChunkIo::next() 
+bool ChunkIo::read_checksums(const uint8_t* data, uint32_t* data_len)
 {
-  if (is_eof()) {
+  if (*data_len < sizeof(MainHeader) + sizeof(ChecksumFooter)) {
+    return true;
+  }
+  const ChecksumFooter* footer = (const ChecksumFooter*)(data + *data_len - sizeof(ChecksumFooter));
+  if (footer->id != ChecksumFooter::kFooterId) {
+    // no checksums
+    return true;
+  }
+
+  const uint64_t checksums_len = (uint64_t)footer->chunk_count * sizeof(ChunkChecksum) +
+    (uint64_t)footer->block_count * sizeof(uint32_t) + sizeof(ChecksumFooter);
+  if (checksums_len > *data_len - sizeof(MainHeader) ||
+    (footer->block_count > 0 && ((const MainHeader*)data)->version != MainHeader::CompressedBlocks)) {
+    LOG_WARNING_LN("Invalid checksums");
     return false;
   }
-  last_header_pos_ += cur_header().size_ + sizeof(ChunkHeader);
-  cur_data_pos_ = last_header_pos_;
+
+  // the chunks have to be in order, so the one holding any position can be looked up
+  const uint32_t* block_crcs = (const uint32_t*)((const uint8_t*)footer - footer->block_count * sizeof(uint32_t));
+  const ChunkChecksum* chunks = (const ChunkChecksum*)((const uint8_t*)block_crcs - footer->chunk_count * sizeof(ChunkChecksum));
+  for (uint32_t i = 0; i < footer->chunk_count; ++i) {
+    if ((uint64_t)chunks[i].offset + sizeof(ChunkHeader) > reader_data_len_ ||
+      (i > 0 && chunks[i].offset <= chunks[i-1].offset)) {
+      LOG_WARNING_LN("Invalid checksums");
+      return false;
+    }
+  }
+
+  reader_checksums_ = chunks;
+  reader_checksums_len_ = footer->chunk_count;
+  reader_block_crcs_ = footer->block_count > 0 ? block_crcs : NULL;
+  reader_block_crcs_len_ = footer->block_count;
+  chunk_verified_.assign(footer->chunk_count, 0);
+  *data_len -= (uint32_t)checksums_len;
   return true;
 }
 
-uint32_t ChunkIo::read_uint() 
+bool ChunkIo::fill_chunk()
 {
-  return read_generic<uint32_t>();
-}
+  for (;;) {
+    if (is_eof()) {
+      return true;
+    }
 
-int32_t ChunkIo::read_int() 
-{
-  return read_generic<int32_t>();
-}
+    if (reader_directory_ != NULL) {
+      const uint32_t next = next_listed_chunk();
+      if (next != last_header_pos_) {
+        last_header_pos_ = cur_data_pos_ = next;
+        continue;
+      }
+    }
 
-std::string ChunkIo::read_string() 
-{
-  const uint32_t string_len = read_int();
-  return std::string(reinterpret_cast<char*>(read_data(string_len)), string_len);
-}
+    // get the header first, to find out how much data the chunk holds
+    const uint32_t header_end = last_header_pos_ + sizeof(ChunkHeader);
+    if (header_end > reader_data_len_ || !fill_window(header_end)) {
+      LOG_WARNING_LN("Truncated data");
+      return false;
+    }
 
-char* ChunkIo::read_cstring() 
-{
-  const uint32_t string_len = read_int();
-  return reinterpret_cast<char*>(read_data(string_len));
+    const uint32_t chunk_end = header_end + cur_header().size_;
+    if (chunk_end < header_end || chunk_end > reader_data_len_ || !fill_window(chunk_end)) {
+      LOG_WARNING_LN("Truncated data");
+      return false;
+    }
+
+    return verify_chunk();
+  }
 }
 
-uint8_t* ChunkIo::read_data(const uint32_t len) 
+// Returns the offset of the first chunk in the directory at or after the current one, which skips
+// removed chunks, and anything an appender left between the chunks
+uint32_t ChunkIo::next_listed_chunk() const
 {
-  uint8_t* ptr = data_ptr();
-  cur_data_pos_ += len;
-  return ptr;
+  uint32_t lo = 0;
+  uint32_t hi = reader_directory_len_;
+  while (lo < hi) {
+    const uint32_t mid = (lo + hi) / 2;
+    if (reader_directory_[mid].offset < last_header_pos_) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo == reader_directory_len_ ? reader_data_len_ : reader_directory_[lo].offset;
 }
 
+bool ChunkIo::verify_chunk()
+{
+  // blocks are checked as they're decompressed, which covers everything in them
+  if (reader_checksums_ == NULL || reader_block_crcs_ != NULL) {
+    return true;
+  }
 
+  // find the top level chunk holding the current one
+  uint32_t lo = 0;
+  uint32_t hi = reader_checksums_len_;
+  while (lo < hi) {
+    const uint32_t mid = (lo + hi) / 2;
+    if (reader_checksums_[mid].offset <= last_header_pos_) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || chunk_verified_[lo - 1]) {
+    return true;
+  }
+  const ChunkChecksum& checksum = reader_checksums_[lo - 1];
 
-bool ChunkIo::init_writer(const MainHeader::Version version)
-{
-  writer_buf_ = new uint8_t[kDefaultBufLen];
-  writer_buf_len_ = kDefaultBufLen;
-  bytes_used_ = 0;
-  version_ = version;
+  // after seeking to a nested chunk, the window might not hold its parent, which is then
+  // checked when it's read itself. And a chunk past the end of the one found has no checksum
+  const uint64_t window_end = (uint64_t)window_ofs_ + window_len_;
+  if (checksum.offset < window_ofs_ || checksum.offset + sizeof(ChunkHeader) > window_end) {
+    return true;
+  }
+  const uint8_t* chunk = &reader_data_[checksum.offset - window_ofs_];
+  const uint64_t chunk_len = sizeof(ChunkHeader) + (uint64_t)((const ChunkHeader*)chunk)->size_;
+  if (checksum.offset + chunk_len > window_end || checksum.offset + chunk_len <= last_header_pos_) {
+    return true;
+  }
 
-  MainHeader header;
-  header.id = MainHeader::kHeaderId;
-  header.version = version_;
-  if (!write_generic(header)) {
+  if (crc32c(chunk, (size_t)chunk_len) != checksum.crc) {
+    LOG_WARNING_LN("Checksum mismatch");
     return false;
   }
+  chunk_verified_[lo - 1] = 1;
   return true;
 }
 
-
-bool ChunkIo::expand_buffer_if_needed(const uint32_t data_size)
+bool ChunkIo::fill_window(const uint32_t end)
 {
-  if (bytes_used_ + data_size <= writer_buf_len_) {
+  if (last_header_pos_ >= window_ofs_ && end <= window_ofs_ + window_len_) {
     return true;
   }
-  const uint32_t new_size = 2 * max(writer_buf_len_, data_size);
-  uint8_t* new_buf = new uint8_t[new_size];
-  if (new_buf == NULL) {
+
+  if (reader_blocks_) {
+    return fill_blocks(end);
+  }
+
+  // the stream can only be decompressed from the start, so to go back, start over
+  if (last_header_pos_ < window_ofs_) {
+    if (!begin_stream(stream_version_, false)) {
+      return false;
+    }
+    stream_in_ = stream_start_;
+    stream_in_len_ = stream_start_len_;
+    move_window(0, 0);
+  }
+
+  // after a seek, the current chunk can be further along than anything decompressed so far
+  while (window_ofs_ + window_len_ < last_header_pos_) {
+    move_window(window_ofs_ + window_len_, 0);
+    uint32_t produced = 0;
+    if (!decompress_stream(window_, min(reader_buf_len_, last_header_pos_ - window_ofs_), &produced) || produced == 0) {
+      LOG_WARNING_LN("Error decompressing data");
+      return false;
+    }
+    window_len_ = produced;
+  }
+
+  // anything before the current chunk can go, and the window has to hold everything up to end
+  const uint32_t needed = end - last_header_pos_;
+  move_window(last_header_pos_, needed > reader_buf_len_ ? max(needed, 2 * reader_buf_len_) : needed);
+
+  // fill it up, so we don't have to come back here for every small chunk
+  const uint32_t fill_len = min(reader_buf_len_, reader_data_len_ - window_ofs_) - window_len_;
+  uint32_t produced = 0;
+  if (!decompress_stream(window_ + window_len_, fill_len, &produced)) {
+    LOG_WARNING_LN("Error decompressing data");
     return false;
   }
-  memcpy(new_buf, writer_buf_, bytes_used_);
-  delete [] writer_buf_;
-  writer_buf_ = new_buf;
-  writer_buf_len_ = new_size;
-  return true;
+  window_len_ += produced;
+  return end <= window_ofs_ + window_len_;
 }
 
-bool ChunkIo::write_raw_data(const uint8_t* data, const uint32_t len) 
+bool ChunkIo::fill_blocks(const uint32_t end)
 {
-  if (!expand_buffer_if_needed(len)) {
+  // start the window at the block holding the current chunk, keeping anything we already have,
+  // and make room for all the blocks up to end
+  const uint32_t block_size = reader_blocks_->block_size;
+  const uint32_t new_ofs = last_header_pos_ / block_size * block_size;
+  move_window(new_ofs, (uint32_t)(((uint64_t)end - new_ofs + block_size - 1) / block_size * block_size));
+
+  // and decompress as many blocks as fit, all at once
+  const uint32_t first_block = (window_ofs_ + window_len_) / block_size;
+  const uint32_t last_block = min((uint32_t)(((uint64_t)window_ofs_ + reader_buf_len_) / block_size), reader_blocks_->block_count);
+#ifdef CHUNK_SUPPORTS_ZSTD
+  block_dctxs_.resize(WorkerPool::max_slots(), NULL);
+#endif
+  std::vector<uint8_t> failed(last_block - first_block);
+  WorkerPool::run(last_block - first_block, [&](int i, int slot) {
+    const uint32_t block_ofs = (first_block + i) * block_size;
+    const uint32_t block_len = min(block_size, reader_data_len_ - block_ofs);
+    failed[i] = !decompress_block(reader_block_table_[first_block + i], window_ + block_ofs - window_ofs_, block_len, slot);
+  });
+  if (std::find(failed.begin(), failed.end(), 1) != failed.end()) {
+    LOG_WARNING_LN("Error decompressing data");
     return false;
   }
 
-  memcpy(&writer_buf_[bytes_used_], data, len);
-  bytes_used_ += len;
-
-  return true;
+  window_len_ = (uint32_t)min((uint64_t)last_block * block_size, (uint64_t)reader_data_len_) - window_ofs_;
+  return end <= window_ofs_ + window_len_;
 }
 
-
-// Strings are written as [len, data]
-bool ChunkIo::write_string(const std::string& str)
+void ChunkIo::move_window(const uint32_t ofs, const uint32_t len)
 {
-  const size_t len = str.length();
-  if (!write_generic<int32_t>(len)) {
-    return false;
+  // keep whatever the window already holds from ofs on
+  const uint32_t keep = ofs >= window_ofs_ && ofs < window_ofs_ + window_len_ ? window_ofs_ + window_len_ - ofs : 0;
+
+  uint8_t* buf = reader_buf_;
+  if (len > reader_buf_len_) {
+    buf = new uint8_t[len + 2 * kMaxArrayAlignment];
   }
 
-  if (!write_raw_data((const uint8_t*)&str.c_str()[0], len)) {
-    return false;
+  // place the data so that anything aligned in the file is aligned in memory too
+  const uintptr_t base = ((uintptr_t)buf + kMaxArrayAlignment - 1) & ~(uintptr_t)(kMaxArrayAlignment - 1);
+  uint8_t* window = (uint8_t*)base + (sizeof(MainHeader) + ofs) % kMaxArrayAlignment;
+  if (keep > 0) {
+    memmove(window, window_ + ofs - window_ofs_, keep);
   }
-  return true;
-}
 
+  if (buf != reader_buf_) {
+    delete [] reader_buf_;
+    reader_buf_ = buf;
+    reader_buf_len_ = len;
+  }
+  reader_data_ = window_ = window;
+  window_ofs_ = ofs;
+  window_len_ = keep;
+}
 
-void ChunkIo::get_buffer(uint8_t*& buf, uint32_t& len)
+bool ChunkIo::has_directory() const
 {
-  buf = writer_buf_;
-  len = bytes_used_;
+  return reader_directory_ != NULL;
 }
 
-void ChunkIo::enter_scope(const ChunkHeader::Id id)
+uint32_t ChunkIo::directory_size() const
 {
-  // Save header pos, and write header with dummy info
-  const long cur_pos = bytes_used_;
-  header_pos_stack_.push(cur_pos);
-  ChunkHeader header(id);
-  write_generic(header);
+  return reader_directory_len_;
 }
 
-void ChunkIo::leave_scope(const ChunkHeader::Id id)
+const ChunkIo::DirectoryEntry& ChunkIo::directory_entry(const int entry) const
 {
-  // Save current pos, jump back to header start, write the correct block length, and jump back
-  const long end_of_data = bytes_used_;
+  return reader_directory_[entry];
+}
+
+int ChunkIo::find(const ChunkHeader::Id id, const uint32_t nth) const
+{
+  uint32_t found = 0;
+  for (uint32_t i = 0; i < reader_directory_len_; ++i) {
+    if (reader_directory_[i].id == id && found++ == nth) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int ChunkIo::first_child(const int entry) const
+{
+  const uint32_t child = entry + 1;
+  if (child < reader_directory_len_ && reader_directory_[child].depth == reader_directory_[entry].depth + 1) {
+    return child;
+  }
+  return -1;
+}
+
+int ChunkIo::next_sibling(const int entry) const
+{
+  // the entries are sorted by offset, so look for the first one past the end of this chunk
+  const uint64_t end = (uint64_t)reader_directory_[entry].offset + sizeof(ChunkHeader) + reader_directory_[entry].size;
+  uint32_t lo = entry + 1;
+  uint32_t hi = reader_directory_len_;
+  while (lo < hi) {
+    const uint32_t mid = (lo + hi) / 2;
+    if (reader_directory_[mid].offset < end) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  // if it's further up the hierarchy, there are no more siblings
+  if (lo < reader_directory_len_ && reader_directory_[lo].depth == reader_directory_[entry].depth) {
+    return lo;
+  }
+  return -1;
+}
+
+bool ChunkIo::seek(const int entry)
+{
+  if (entry < 0 || (uint32_t)entry >= reader_directory_len_) {
+    return false;
+  }
+  last_header_pos_ = cur_data_pos_ = reader_directory_[entry].offset;
+  if (!fill_chunk() || cur_header().id_ != reader_directory_[entry].id) {
+    LOG_WARNING_LN("Directory doesn't match the data");
+    last_header_pos_ = cur_data_pos_ = reader_data_len_;
+    return false;
+  }
+  return true;
+}
+
+bool ChunkIo::is_eof() 
+{
+  return cur_data_pos_ >= reader_data_len_;
+}
+
+bool ChunkIo::is_end_of_chunk() 
+{
+  return cur_data_pos_ - last_header_pos_ >= cur_header().size_;
+}
+
+uint32_t ChunkIo::bytes_left()
+{
+  if (is_eof()) {
+    return 0;
+  }
+  const uint32_t used = cur_data_pos_ - last_header_pos_;
+  const uint32_t size = cur_header().size_;
+  return used < size ? size - used : 0;
+}
+
+ChunkHeader ChunkIo::cur_header() 
+{
+  return *reinterpret_cast<const ChunkHeader*>(&reader_data_[last_header_pos_ - window_ofs_]);
+}
+
+const uint8_t* ChunkIo::data_ptr()
+{
+  if (is_eof()) {
+    return NULL;
+  }
+  return &reader_data_[cur_data_pos_ + sizeof(ChunkHeader) - window_ofs_];
+}
+
+bool ChunkIo::next() 
+{
+  if (is_eof()) {
+    return false;
+  }
+  last_header_pos_ += cur_header().size_ + sizeof(ChunkHeader);
+  cur_data_pos_ = last_header_pos_;
+  if (!fill_chunk()) {
+    // there's nothing sensible left to read
+    last_header_pos_ = cur_data_pos_ = reader_data_len_;
+    return false;
+  }
+  return true;
+}
+
+uint32_t ChunkIo::read_uint() 
+{
+  return read_generic<uint32_t>();
+}
+
+int32_t ChunkIo::read_int() 
+{
+  return read_generic<int32_t>();
+}
+
+std::string ChunkIo::read_string() 
+{
+  const uint32_t string_len = read_int();
+  return std::string(reinterpret_cast<const char*>(read_data(string_len)), string_len);
+}
+
+const char* ChunkIo::read_cstring()
+{
+  const uint32_t string_len = read_int();
+  return reinterpret_cast<const char*>(read_data(string_len));
+}
+
+const uint8_t* ChunkIo::read_data(const uint32_t len)
+{
+  const uint8_t* ptr = data_ptr();
+  cur_data_pos_ += len;
+  return ptr;
+}
+
+
+
+bool ChunkIo::init_writer(const MainHeader::Version version, const int level)
+{
+  // uncompressed data goes to the file in blocks, so give it room for a bunch of them
+  writer_buf_len_ = writer_file_ != kNoFile && version == MainHeader::Uncompressed ? kFileBufLen : kDefaultBufLen;
+  writer_buf_ = new uint8_t[writer_buf_len_];
+  bytes_used_ = 0;
+  flushed_bytes_ = 0;
+  out_flushed_ = 0;
+  failed_ = false;
+  version_ = version;
+  level_ = level;
+  directory_.clear();
+  chunk_checksums_.clear();
+  block_crcs_.clear();
+
+  MainHeader header;
+  header.id = MainHeader::kHeaderId;
+  header.version = version_;
+  header.uncompressesd_size = 0;
+
+  if (version_ == MainHeader::Uncompressed) {
+    if (!write_generic(header)) {
+      return false;
+    }
+    return true;
+  }
+
+  // the main header isn't compressed, so it goes straight to the output, and the chunks
+  // are compressed after it
+  out_buf_ = new uint8_t[kDefaultBufLen];
+  out_buf_len_ = kDefaultBufLen;
+  memcpy(out_buf_, &header, sizeof(header));
+  out_bytes_used_ = sizeof(header);
+  flushed_bytes_ = sizeof(header);
+
+  if (version_ == MainHeader::CompressedBlocks) {
+    // the block count and table offset are filled in by end_of_data
+    BlockHeader blocks = { block_codec_, block_size_, 0, 0 };
+    memcpy(out_buf_ + out_bytes_used_, &blocks, sizeof(blocks));
+    out_bytes_used_ += sizeof(blocks);
+    block_table_.clear();
+    return true;
+  }
+
+  if (!begin_stream(version_, true)) {
+    return false;
+  }
+  return true;
+}
+
+bool ChunkIo::init_block_writer(const MainHeader::Version codec, const int level, const uint32_t block_size)
+{
+  if (codec == MainHeader::Uncompressed || codec == MainHeader::CompressedBlocks || block_size == 0) {
+    LOG_WARNING_LN("Invalid block codec");
+    return false;
+  }
+  block_codec_ = codec;
+  block_size_ = block_size;
+  return init_writer(MainHeader::CompressedBlocks, level);
+}
+
+void ChunkIo::set_write_directory(const bool write)
+{
+  write_directory_ = write;
+}
+
+void ChunkIo::set_write_checksums(const bool write)
+{
+  write_checksums_ = write;
+}
+
+bool ChunkIo::init_appender(const char* filename)
+{
+  // let a reader check the file and the directory first
+  uint32_t payload_len = 0;
+  uint32_t trailer_len = 0;
+  {
+    ChunkIo reader;
+    if (!reader.init_mapped_reader(filename)) {
+      return false;
+    }
+    if (!reader.has_directory()) {
+      LOG_WARNING_LN("Can't append to a file without a directory: %s", filename);
+      return false;
+    }
+    payload_len = reader.reader_data_len_;
+    trailer_len = reader.reader_directory_len_ * sizeof(DirectoryEntry) + sizeof(DirectoryFooter);
+    directory_.assign(reader.reader_directory_, reader.reader_directory_ + reader.reader_directory_len_);
+    write_directory_ = true;
+    write_checksums_ = reader.reader_checksums_ != NULL;
+    chunk_checksums_.clear();
+    if (write_checksums_) {
+      chunk_checksums_.assign(reader.reader_checksums_, reader.reader_checksums_ + reader.reader_checksums_len_);
+      trailer_len += reader.reader_checksums_len_ * sizeof(ChunkChecksum) + sizeof(ChecksumFooter);
+    }
+  }
+
+  close_output();
+  writer_file_ = open_output(filename, false);
+  if (writer_file_ == kNoFile) {
+    LOG_WARNING_LN("Unable to open file: %s", filename);
+    return false;
+  }
+  MainHeader header;
+  if (read_at(writer_file_, &header, sizeof(header), 0) != sizeof(header) || header.version != MainHeader::Uncompressed) {
+    LOG_WARNING_LN("Can only append to uncompressed files: %s", filename);
+    close_output();
+    return false;
+  }
+
+  // new chunks go after the old directory and checksums, which stay valid until end_of_data has
+  // written the new ones. Anything after them is left over from an append that didn't finish
+  SAFE_ADELETE(writer_buf_);
+  writer_buf_len_ = kFileBufLen;
+  writer_buf_ = new uint8_t[writer_buf_len_];
+  bytes_used_ = 0;
+  flushed_bytes_ = sizeof(MainHeader) + payload_len + trailer_len;
+  failed_ = false;
+  version_ = MainHeader::Uncompressed;
+  return true;
+}
+
+bool ChunkIo::remove_chunk(const ChunkHeader::Id id, const uint32_t nth)
+{
+  uint32_t found = 0;
+  for (size_t i = 0; i < directory_.size(); ++i) {
+    if (directory_[i].depth != 0 || directory_[i].id != id || found++ != nth) {
+      continue;
+    }
+
+    // its nested chunks go with it
+    size_t end = i + 1;
+    while (end < directory_.size() && directory_[end].depth > 0) {
+      ++end;
+    }
+    const uint32_t offset = directory_[i].offset;
+    directory_.erase(directory_.begin() + i, directory_.begin() + end);
+    for (size_t j = 0; j < chunk_checksums_.size(); ++j) {
+      if (chunk_checksums_[j].offset == offset) {
+        chunk_checksums_.erase(chunk_checksums_.begin() + j);
+        break;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+bool ChunkIo::compact(const char* filename, const char* out_filename, const MainHeader::Version version)
+{
+  ChunkIo reader;
+  if (!reader.init_mapped_reader(filename)) {
+    return false;
+  }
+  ChunkIo writer;
+  writer.set_write_directory(reader.has_directory());
+  writer.set_write_checksums(reader.reader_checksums_ != NULL);
+  if (!writer.set_output_file(out_filename)) {
+    return false;
+  }
+
+  // compression errors still throw, and either way what's been written is no use to anyone
+  bool ok = false;
+  try {
+    ok = writer.init_writer(version) && writer.copy_listed_chunks(reader) && writer.end_of_data();
+  } catch (const std::string& error) {
+    LOG_WARNING_LN("%s: %s", error.c_str(), out_filename);
+  }
+  if (!ok) {
+    writer.close_output();
+    remove(out_filename);
+  }
+  return ok;
+}
+
+// Copies everything the reader finds as it is, along with its directory entries. The reader skips
+// whatever isn't in the directory, so that's left out
+bool ChunkIo::copy_listed_chunks(ChunkIo& reader)
+{
+  int entry = 0;
+  while (!reader.is_eof()) {
+    const uint32_t src_ofs = reader.last_header_pos_;
+    const uint32_t dst_ofs = tell() - sizeof(MainHeader);
+    const uint8_t* chunk = &reader.reader_data_[src_ofs - reader.window_ofs_];
+    const uint32_t chunk_len = sizeof(ChunkHeader) + reader.cur_header().size_;
+
+    while (entry < (int)reader.reader_directory_len_ && reader.reader_directory_[entry].offset < src_ofs) {
+      ++entry;
+    }
+    for (; entry < (int)reader.reader_directory_len_ && reader.reader_directory_[entry].offset < src_ofs + chunk_len; ++entry) {
+      DirectoryEntry moved = reader.reader_directory_[entry];
+      moved.offset = moved.offset - src_ofs + dst_ofs;
+      directory_.push_back(moved);
+    }
+    if (write_checksums_) {
+      const ChunkChecksum checksum = { dst_ofs, crc32c(chunk, chunk_len) };
+      chunk_checksums_.push_back(checksum);
+    }
+
+    if (!write_raw_data(chunk, chunk_len)) {
+      return false;
+    }
+    if (!reader.next()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ChunkIo::set_output_file(const char* filename)
+{
+  close_output();
+  writer_file_ = open_output(filename, true);
+  if (writer_file_ == kNoFile) {
+    LOG_WARNING_LN("Unable to create file: %s", filename);
+    return false;
+  }
+  return true;
+}
+
+
+bool ChunkIo::expand_buffer_if_needed(const uint32_t data_size)
+{
+  if (bytes_used_ + data_size <= writer_buf_len_) {
+    return true;
+  }
+
+  // try making room by compressing what's done first
+  flush_writer(false);
+  if (bytes_used_ + data_size <= writer_buf_len_) {
+    return true;
+  }
+
+  const uint32_t new_size = 2 * max(writer_buf_len_, data_size);
+  uint8_t* new_buf = new uint8_t[new_size];
+  if (new_buf == NULL) {
+    return false;
+  }
+  memcpy(new_buf, writer_buf_, bytes_used_);
+  delete [] writer_buf_;
+  writer_buf_ = new_buf;
+  writer_buf_len_ = new_size;
+  return true;
+}
+
+void ChunkIo::flush_writer(const bool finish)
+{
+  // the sizes of open chunks are patched when they are closed, so only the data before the
+  // outermost open chunk can be compressed
+  uint32_t done = header_pos_stack_.empty() ? bytes_used_ : outer_header_pos_ - flushed_bytes_;
+
+  if (version_ == MainHeader::Uncompressed) {
+    // without compression, everything can go straight to the file, as the headers can be
+    // patched there
+    if (writer_file_ == kNoFile) {
+      return;
+    }
+    done = finish ? bytes_used_ : bytes_used_ / kFileBlockLen * kFileBlockLen;
+    if (done == 0) {
+      return;
+    }
+    write_output(writer_buf_, done, flushed_bytes_);
+  } else if (version_ == MainHeader::CompressedBlocks) {
+    // whole batches of blocks only, to keep all the threads busy, until the very end
+    if (!finish) {
+      const uint32_t batch_len = block_size_ * kBlocksPerBatch;
+      done = done / batch_len * batch_len;
+    }
+    if (done == 0) {
+      return;
+    }
+    compress_blocks(writer_buf_, done);
+    flush_output(false);
+  } else {
+    if (stream_state_ != kStreamCompress || (done == 0 && !finish)) {
+      return;
+    }
+    if (!compress_stream(writer_buf_, done, finish)) {
+      throw std::string("Error compressing data");
+    }
+    flush_output(false);
+  }
+  memmove(writer_buf_, writer_buf_ + done, bytes_used_ - done);
+  bytes_used_ -= done;
+  flushed_bytes_ += done;
+}
+
+bool ChunkIo::write_raw_data(const uint8_t* data, const uint32_t len) 
+{
+  // uncompressed data going to a file can be flushed at any point, so large writes go
+  // through the buffer a piece at a time instead of growing it
+  if (writer_file_ != kNoFile && version_ == MainHeader::Uncompressed) {
+    const uint8_t* src = data;
+    uint32_t left = len;
+    while (left > writer_buf_len_ - bytes_used_) {
+      const uint32_t part = writer_buf_len_ - bytes_used_;
+      memcpy(&writer_buf_[bytes_used_], src, part);
+      bytes_used_ += part;
+      src += part;
+      left -= part;
+      flush_writer(false);
+    }
+    memcpy(&writer_buf_[bytes_used_], src, left);
+    bytes_used_ += left;
+    return !failed_;
+  }
+
+  if (!expand_buffer_if_needed(len)) {
+    return false;
+  }
+
+  memcpy(&writer_buf_[bytes_used_], data, len);
+  bytes_used_ += len;
+
+  return !failed_;
+}
+
+
+uint32_t ChunkIo::tell() const
+{
+  return flushed_bytes_ + bytes_used_;
+}
+
+bool ChunkIo::link(const uint32_t ptr_pos, const uint32_t target_pos)
+{
+  if (ptr_pos < flushed_bytes_ && version_ != MainHeader::Uncompressed) {
+    LOG_WARNING_LN("Can't link data that's already compressed");
+    return false;
+  }
+  const int32_t offset = (int32_t)(target_pos - ptr_pos);
+  patch(writer_buf_, flushed_bytes_, ptr_pos, &offset, sizeof(offset));
+  return true;
+}
+
+bool ChunkIo::valid_alignment(const uint32_t alignment)
+{
+  return alignment != 0 && (alignment & (alignment - 1)) == 0 && alignment <= kMaxArrayAlignment;
+}
+
+uint32_t ChunkIo::padding_for(const uint32_t pos, const uint32_t alignment)
+{
+  return (alignment - pos % alignment) % alignment;
+}
+
+// Strings are written as [len, data]
+bool ChunkIo::write_string(const std::string& str)
+{
+  const size_t len = str.length();
+  if (!write_generic<int32_t>(len)) {
+    return false;
+  }
+
+  if (!write_raw_data((const uint8_t*)&str.c_str()[0], len)) {
+    return false;
+  }
+  return true;
+}
+
+
+void ChunkIo::get_buffer(uint8_t*& buf, uint32_t& len)
+{
+  buf = writer_buf_;
+  len = bytes_used_;
+}
+
+void ChunkIo::enter_scope(const ChunkHeader::Id id)
+{
+  // Save header pos, and write header with dummy info
+  const long cur_pos = flushed_bytes_ + bytes_used_;
+  if (header_pos_stack_.empty()) {
+    outer_header_pos_ = cur_pos;
+  }
+  if (write_directory_) {
+    const DirectoryEntry entry = { id, (uint32_t)header_pos_stack_.size(), (uint32_t)(cur_pos - sizeof(MainHeader)), 0 };
+    directory_stack_.push(directory_.size());
+    directory_.push_back(entry);
+  }
+  header_pos_stack_.push(cur_pos);
+  ChunkHeader header(id);
+  write_generic(header);
+}
+
+void ChunkIo::leave_scope(const ChunkHeader::Id id)
+{
+  // Patch the header with the correct block length. Unless the data goes to a file as is, nothing
+  // after the outermost open chunk has been flushed, so the header is still in the buffer
+  const long end_of_data = flushed_bytes_ + bytes_used_;
   const long last_header_pos = header_pos_stack_.top();
   header_pos_stack_.pop();
   const uint32_t data_length = (end_of_data - last_header_pos) - sizeof(ChunkHeader);
-  bytes_used_ = last_header_pos;
+  if (write_directory_) {
+    directory_[directory_stack_.top()].size = data_length;
+    directory_stack_.pop();
+  }
+
+  // this runs from ChunkScoper's destructor, so a failed write is only recorded for end_of_data
+  if (failed_) {
+    return;
+  }
   ChunkHeader header(id, data_length);
-  write_generic(header);
-  bytes_used_ = end_of_data;
+  patch(writer_buf_, flushed_bytes_, last_header_pos, &header, sizeof(header));
+  if (write_checksums_ && header_pos_stack_.empty()) {
+    const ChunkChecksum checksum = { (uint32_t)(last_header_pos - sizeof(MainHeader)), written_crc(last_header_pos, end_of_data - last_header_pos) };
+    chunk_checksums_.push_back(checksum);
+  }
+}
+
+bool ChunkIo::end_of_data()
+{
+  MainHeader header;
+  header.id = MainHeader::kHeaderId;
+  header.version = version_;
+  header.uncompressesd_size = flushed_bytes_ + bytes_used_ - sizeof(MainHeader);
+
+  if (version_ == MainHeader::Uncompressed) {
+    append_checksums();
+    append_directory();
+    flush_writer(true);
+    // the header goes last, once everything it points at is on disk, as until then an appended
+    // file still reads as it was. If anything failed, it's left that way
+    if (writer_file_ != kNoFile && !failed_ && !flush_file(writer_file_)) {
+      failed_ = true;
+    }
+    if (!failed_) {
+      patch(writer_buf_, flushed_bytes_, 0, &header, sizeof(header));
+    }
+    if (writer_file_ != kNoFile && !failed_ && !truncate_file(writer_file_, flushed_bytes_)) {
+      // only drops what's left over from an append that didn't finish, so the file is fine as is
+      LOG_WARNING_LN("Unable to truncate the output file");
+    }
+    close_output();
+    return !failed_;
+  }
+
+  flush_writer(true);
+  end_stream();
+
+  if (version_ == MainHeader::CompressedBlocks) {
+    const uint32_t table_offset = out_flushed_ + out_bytes_used_;
+    const uint32_t table_len = block_table_.size() * sizeof(BlockEntry);
+    reserve_output(table_len);
+    if (table_len > 0) {
+      memcpy(out_buf_ + out_bytes_used_, &block_table_[0], table_len);
+    }
+    out_bytes_used_ += table_len;
+
+    const BlockHeader blocks = { block_codec_, block_size_, (uint32_t)block_table_.size(), table_offset };
+    patch(out_buf_, out_flushed_, sizeof(MainHeader), &blocks, sizeof(blocks));
+  }
+
+  append_checksums();
+  append_directory();
+
+  patch(out_buf_, out_flushed_, 0, &header, sizeof(header));
+  printf("Data compressed: [%d -> %d]\n", header.uncompressesd_size, out_flushed_ + out_bytes_used_ - sizeof(MainHeader));
+
+  if (writer_file_ != kNoFile) {
+    flush_output(true);
+    close_output();
+    return !failed_;
+  }
+
+  // hand out the compressed data from get_buffer
+  delete [] writer_buf_;
+  writer_buf_ = out_buf_;
+  writer_buf_len_ = out_buf_len_;
+  bytes_used_ = out_bytes_used_;
+  out_buf_ = NULL;
+  out_buf_len_ = out_bytes_used_ = 0;
+  return true;
 }
 
-void ChunkIo::end_of_data()
+
+void ChunkIo::flush_output(const bool finish)
 {
-  MainHeader* header = (MainHeader*)writer_buf_;
-  header->uncompressesd_size = bytes_used_ - sizeof(MainHeader);
+  if (writer_file_ == kNoFile) {
+    return;
+  }
 
-  switch (header->version) {
-    case MainHeader::Uncompressed:
-      {
+  // write whole blocks, and keep the rest until there's more
+  const uint32_t len = finish ? out_bytes_used_ : out_bytes_used_ / kFileBlockLen * kFileBlockLen;
+  if (len == 0) {
+    return;
+  }
+  write_output(out_buf_, len, out_flushed_);
+  memmove(out_buf_, out_buf_ + len, out_bytes_used_ - len);
+  out_bytes_used_ -= len;
+  out_flushed_ += len;
+}
+
+// Once a write has failed the output is no good, so nothing more is written to it
+bool ChunkIo::write_output(const uint8_t* data, const uint32_t len, const uint32_t pos)
+{
+  if (!failed_ && !write_at(writer_file_, data, len, pos)) {
+    LOG_WARNING_LN("Error writing file");
+    failed_ = true;
+  }
+  return !failed_;
+}
+
+// Writes data at pos, where buf holds everything from buf_pos on, and anything before that is
+// already in the output file
+void ChunkIo::patch(uint8_t* buf, const uint32_t buf_pos, const uint32_t pos, const void* data, const uint32_t len)
+{
+  const uint32_t file_len = pos < buf_pos ? min(len, buf_pos - pos) : 0;
+  if (file_len > 0) {
+    write_output((const uint8_t*)data, file_len, pos);
+  }
+  if (file_len < len) {
+    memcpy(buf + pos + file_len - buf_pos, (const uint8_t*)data + file_len, len - file_len);
+  }
+}
+
+void ChunkIo::close_output()
+{
+  if (writer_file_ != kNoFile) {
+    close_file(writer_file_);
+    writer_file_ = kNoFile;
+  }
+}
+
+// Adds data to the end of the file, after the payload
+void ChunkIo::append_output(const void* data, const uint32_t len)
+{
+  if (len == 0) {
+    return;
+  }
+  if (version_ == MainHeader::Uncompressed) {
+    write_raw_data((const uint8_t*)data, len);
+    return;
+  }
+  reserve_output(len);
+  memcpy(out_buf_ + out_bytes_used_, data, len);
+  out_bytes_used_ += len;
+}
+
+void ChunkIo::append_directory()
+{
+  if (!write_directory_) {
+    return;
+  }
+
+  // the directory goes after everything else, so the reader can find it from the end of the file
+  const DirectoryFooter footer = { (uint32_t)directory_.size(), DirectoryFooter::kFooterId };
+  if (!directory_.empty()) {
+    append_output(&directory_[0], directory_.size() * sizeof(DirectoryEntry));
+  }
+  append_output(&footer, sizeof(footer));
+}
+
+void ChunkIo::append_checksums()
+{
+  if (!write_checksums_) {
+    return;
+  }
+
+  const ChecksumFooter footer = { (uint32_t)chunk_checksums_.size(), (uint32_t)block_crcs_.size(), ChecksumFooter::kFooterId };
+  if (!chunk_checksums_.empty()) {
+    append_output(&chunk_checksums_[0], chunk_checksums_.size() * sizeof(ChunkChecksum));
+  }
+  if (!block_crcs_.empty()) {
+    append_output(&block_crcs_[0], block_crcs_.size() * sizeof(uint32_t));
+  }
+  append_output(&footer, sizeof(footer));
+}
+
+// Returns the crc of the uncompressed data from pos on. Only uncompressed data is flushed while
+// a chunk is open, and what's already in the file is read back from there. A failed read fails the
+// output, like a failed write
+uint32_t ChunkIo::written_crc(const uint32_t pos, const uint32_t len)
+{
+  uint32_t crc = 0;
+  const uint32_t file_len = pos < flushed_bytes_ ? min(len, flushed_bytes_ - pos) : 0;
+  if (file_len > 0) {
+    const uint32_t block_len = kFileBlockLen;
+    std::vector<uint8_t> buf(block_len);
+    for (uint32_t ofs = 0; ofs < file_len; ) {
+      const uint32_t bytes_read = read_at(writer_file_, &buf[0], min(block_len, file_len - ofs), pos + ofs);
+      if (bytes_read == 0) {
+        LOG_WARNING_LN("Error reading file");
+        failed_ = true;
+        return 0;
       }
-      break;
+      crc = crc32c(&buf[0], bytes_read, crc);
+      ofs += bytes_read;
+    }
+  }
+  return crc32c(writer_buf_ + pos + file_len - flushed_bytes_, len - file_len, crc);
+}
+
+void ChunkIo::set_dictionary(const ChunkDictionary* dictionary)
+{
+  dictionary_ = dictionary;
+}
+
+void ChunkIo::reserve_output(const uint32_t len)
+{
+  if (out_buf_len_ - out_bytes_used_ >= len) {
+    return;
+  }
+
+  // when writing to a file, make room by writing out what's there first. Otherwise the compressed
+  // data ends up in memory anyway, so just keep doubling the output buffer
+  flush_output(false);
+  if (out_buf_len_ - out_bytes_used_ >= len) {
+    return;
+  }
+  uint32_t new_size = 2 * out_buf_len_;
+  while (new_size - out_bytes_used_ < len) {
+    new_size *= 2;
+  }
+  uint8_t* new_buf = new uint8_t[new_size];
+  memcpy(new_buf, out_buf_, out_bytes_used_);
+  delete [] out_buf_;
+  out_buf_ = new_buf;
+  out_buf_len_ = new_size;
+}
+
+bool ChunkIo::begin_stream(const MainHeader::Version version, const bool compress)
+{
+  end_stream();
 
+  switch (version) {
     case MainHeader::CompressedBZLib:
       {
 #ifdef CHUNK_SUPPORTS_BZLIB
-        // from the bzip manual
-        uint32_t compressed_buf_len = 101 * bytes_used_ / 100 + 600;
-        uint8_t* compressed_buf = new uint8_t[compressed_buf_len];
-        memcpy(compressed_buf, writer_buf_, sizeof(MainHeader));
-        uint32_t dest_len = compressed_buf_len;
-        const int32_t res = BZ2_bzBuffToBuffCompress(
-          (char*)(compressed_buf + sizeof(MainHeader)), &dest_len, 
-          (char*)(writer_buf_ + sizeof(MainHeader)), bytes_used_ - sizeof(MainHeader), 9, 0, 0);
+        memset(&bz_stream_, 0, sizeof(bz_stream_));
+        const int32_t res = compress
+          ? BZ2_bzCompressInit(&bz_stream_, level_ < 1 || level_ > 9 ? 9 : level_, 0, 0)
+          : BZ2_bzDecompressInit(&bz_stream_, 0, 0);
         if (res != BZ_OK) {
-          throw std::string("Error compressing data");
+          LOG_WARNING_LN("Error initializing bzlib");
+          return false;
         }
-        printf("Data compressed: [%d -> %d]\n", bytes_used_ - sizeof(MainHeader), dest_len);
-        delete [] writer_buf_;
-        writer_buf_ = compressed_buf;
-        bytes_used_ = dest_len + sizeof(MainHeader);
 #else
-        throw std::exception("bzlib not supported");
+        throw std::string("bzlib not supported");
 #endif
       }
       break;
@@ -286,25 +1634,555 @@ void ChunkIo::end_of_data()
     case MainHeader::CompressedZLib:
       {
 #ifdef CHUNK_SUPPORTS_ZLIB
-        // from the zlib manual
-        uint32_t compressed_buf_len = 101 * bytes_used_ / 100 + 12;
-        uint8_t* compressed_buf = new uint8_t[compressed_buf_len];
-        memcpy(compressed_buf, writer_buf_, sizeof(MainHeader));
-        uLongf dest_len = compressed_buf_len;
-        const int32_t res = compress2(
-          (Bytef*)(compressed_buf + sizeof(MainHeader)), &dest_len, 
-          (Bytef*)(writer_buf_ + sizeof(MainHeader)), bytes_used_ - sizeof(MainHeader), 9);
+        memset(&z_stream_, 0, sizeof(z_stream_));
+        const int32_t res = compress
+          ? deflateInit(&z_stream_, level_ < 1 || level_ > 9 ? Z_DEFAULT_COMPRESSION : level_)
+          : inflateInit(&z_stream_);
         if (res != Z_OK) {
-          throw std::string("Error compressing data");
+          LOG_WARNING_LN("Error initializing zlib");
+          return false;
+        }
+#else
+        throw std::string("zlib not supported");
+#endif
+      }
+      break;
+
+    case MainHeader::CompressedLZ4:
+      {
+#ifdef CHUNK_SUPPORTS_LZ4
+        if (compress) {
+          if (LZ4F_isError(LZ4F_createCompressionContext(&lz4_cctx_, LZ4F_VERSION))) {
+            LOG_WARNING_LN("Error initializing lz4");
+            return false;
+          }
+          // the frame header goes first
+          LZ4F_preferences_t prefs;
+          memset(&prefs, 0, sizeof(prefs));
+          prefs.compressionLevel = level_ < 1 ? 0 : level_;
+          reserve_output(LZ4F_HEADER_SIZE_MAX);
+          const size_t res = LZ4F_compressBegin(lz4_cctx_, out_buf_ + out_bytes_used_, out_buf_len_ - out_bytes_used_, &prefs);
+          if (LZ4F_isError(res)) {
+            LZ4F_freeCompressionContext(lz4_cctx_);
+            LOG_WARNING_LN("Error initializing lz4");
+            return false;
+          }
+          out_bytes_used_ += (uint32_t)res;
+        } else {
+          if (LZ4F_isError(LZ4F_createDecompressionContext(&lz4_dctx_, LZ4F_VERSION))) {
+            LOG_WARNING_LN("Error initializing lz4");
+            return false;
+          }
+        }
+#else
+        throw std::string("lz4 not supported");
+#endif
+      }
+      break;
+
+    case MainHeader::CompressedZstd:
+      {
+#ifdef CHUNK_SUPPORTS_ZSTD
+        if (compress) {
+          zstd_cctx_ = ZSTD_createCCtx();
+          if (!zstd_cctx_) {
+            LOG_WARNING_LN("Error initializing zstd");
+            return false;
+          }
+          ZSTD_CCtx_setParameter(zstd_cctx_, ZSTD_c_compressionLevel, level_ < 1 ? ZSTD_CLEVEL_DEFAULT : level_);
+          ZSTD_CCtx_setParameter(zstd_cctx_, ZSTD_c_checksumFlag, 0);
+          if (dictionary_ && dictionary_->cdict_) {
+            ZSTD_CCtx_refCDict(zstd_cctx_, dictionary_->cdict_);
+          }
+        } else {
+          zstd_dctx_ = ZSTD_createDCtx();
+          if (!zstd_dctx_) {
+            LOG_WARNING_LN("Error initializing zstd");
+            return false;
+          }
+          if (dictionary_ && dictionary_->ddict_) {
+            ZSTD_DCtx_refDDict(zstd_dctx_, dictionary_->ddict_);
+          }
         }
-        printf("Data compressed: [%d -> %d]\n", bytes_used_ - sizeof(MainHeader), dest_len);
-        delete [] writer_buf_;
-        writer_buf_ = compressed_buf;
-        bytes_used_ = dest_len + sizeof(MainHeader);
 #else
-        throw std::exception("zlib not supported");
+        throw std::string("zstd not supported");
+#endif
+      }
+      break;
+
+    default:
+      return false;
+  }
+
+  stream_version_ = version;
+  stream_state_ = compress ? kStreamCompress : kStreamDecompress;
+  return true;
+}
+
+bool ChunkIo::compress_stream(const uint8_t* data, const uint32_t len, const bool finish)
+{
+  switch (stream_version_) {
+    case MainHeader::CompressedBZLib:
+      {
+#ifdef CHUNK_SUPPORTS_BZLIB
+        bz_stream_.next_in = (char*)data;
+        bz_stream_.avail_in = len;
+        for (;;) {
+          reserve_output(1);
+          const uint32_t avail_out = out_buf_len_ - out_bytes_used_;
+          bz_stream_.next_out = (char*)(out_buf_ + out_bytes_used_);
+          bz_stream_.avail_out = avail_out;
+          const int32_t res = BZ2_bzCompress(&bz_stream_, finish ? BZ_FINISH : BZ_RUN);
+          if (res != BZ_RUN_OK && res != BZ_FINISH_OK && res != BZ_STREAM_END) {
+            return false;
+          }
+          out_bytes_used_ += avail_out - bz_stream_.avail_out;
+          if (finish ? res == BZ_STREAM_END : bz_stream_.avail_in == 0) {
+            return true;
+          }
+        }
+#endif
+      }
+      break;
+
+    case MainHeader::CompressedZLib:
+      {
+#ifdef CHUNK_SUPPORTS_ZLIB
+        z_stream_.next_in = (Bytef*)data;
+        z_stream_.avail_in = len;
+        for (;;) {
+          reserve_output(1);
+          const uint32_t avail_out = out_buf_len_ - out_bytes_used_;
+          z_stream_.next_out = (Bytef*)(out_buf_ + out_bytes_used_);
+          z_stream_.avail_out = avail_out;
+          const int32_t res = deflate(&z_stream_, finish ? Z_FINISH : Z_NO_FLUSH);
+          if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) {
+            return false;
+          }
+          out_bytes_used_ += avail_out - z_stream_.avail_out;
+          if (finish ? res == Z_STREAM_END : z_stream_.avail_in == 0) {
+            return true;
+          }
+        }
+#endif
+      }
+      break;
+
+    case MainHeader::CompressedLZ4:
+      {
+#ifdef CHUNK_SUPPORTS_LZ4
+        // lz4 wants room for the worst case up front, so feed it a piece at a time
+        const uint32_t kPieceLen = 64 * 1024;
+        for (uint32_t ofs = 0; ofs < len; ofs += kPieceLen) {
+          const uint32_t piece_len = min(kPieceLen, len - ofs);
+          // the level doesn't change the bound, so the default preferences give the same worst case
+          reserve_output((uint32_t)LZ4F_compressBound(piece_len, NULL));
+          const size_t res = LZ4F_compressUpdate(lz4_cctx_, out_buf_ + out_bytes_used_, out_buf_len_ - out_bytes_used_, data + ofs, piece_len, NULL);
+          if (LZ4F_isError(res)) {
+            return false;
+          }
+          out_bytes_used_ += (uint32_t)res;
+        }
+        if (finish) {
+          reserve_output((uint32_t)LZ4F_compressBound(0, NULL));
+          const size_t res = LZ4F_compressEnd(lz4_cctx_, out_buf_ + out_bytes_used_, out_buf_len_ - out_bytes_used_, NULL);
+          if (LZ4F_isError(res)) {
+            return false;
+          }
+          out_bytes_used_ += (uint32_t)res;
+        }
+        return true;
+#endif
+      }
+      break;
+
+    case MainHeader::CompressedZstd:
+      {
+#ifdef CHUNK_SUPPORTS_ZSTD
+        ZSTD_inBuffer input = { data, len, 0 };
+        for (;;) {
+          reserve_output((uint32_t)ZSTD_CStreamOutSize());
+          ZSTD_outBuffer output = { out_buf_ + out_bytes_used_, out_buf_len_ - out_bytes_used_, 0 };
+          const size_t res = ZSTD_compressStream2(zstd_cctx_, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+          if (ZSTD_isError(res)) {
+            return false;
+          }
+          out_bytes_used_ += (uint32_t)output.pos;
+          if (finish ? res == 0 : input.pos == input.size) {
+            return true;
+          }
+        }
+#endif
+      }
+      break;
+  }
+  return false;
+}
+
+bool ChunkIo::decompress_stream(uint8_t* buf, const uint32_t len, uint32_t* produced)
+{
+  *produced = 0;
+  while (*produced < len) {
+    const uint32_t avail_out = len - *produced;
+    const uint32_t avail_in = stream_in_len_;
+    const uint32_t produced_before = *produced;
+    bool end = false;
+
+    switch (stream_version_) {
+      case MainHeader::CompressedBZLib:
+        {
+#ifdef CHUNK_SUPPORTS_BZLIB
+          bz_stream_.next_in = (char*)stream_in_;
+          bz_stream_.avail_in = stream_in_len_;
+          bz_stream_.next_out = (char*)(buf + *produced);
+          bz_stream_.avail_out = avail_out;
+          const int32_t res = BZ2_bzDecompress(&bz_stream_);
+          if (res != BZ_OK && res != BZ_STREAM_END) {
+            return false;
+          }
+          stream_in_len_ = bz_stream_.avail_in;
+          *produced += avail_out - bz_stream_.avail_out;
+          end = res == BZ_STREAM_END;
+#endif
+        }
+        break;
+
+      case MainHeader::CompressedZLib:
+        {
+#ifdef CHUNK_SUPPORTS_ZLIB
+          z_stream_.next_in = (Bytef*)stream_in_;
+          z_stream_.avail_in = stream_in_len_;
+          z_stream_.next_out = (Bytef*)(buf + *produced);
+          z_stream_.avail_out = avail_out;
+          const int32_t res = inflate(&z_stream_, Z_NO_FLUSH);
+          if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) {
+            return false;
+          }
+          stream_in_len_ = z_stream_.avail_in;
+          *produced += avail_out - z_stream_.avail_out;
+          end = res == Z_STREAM_END;
+#endif
+        }
+        break;
+
+      case MainHeader::CompressedLZ4:
+        {
+#ifdef CHUNK_SUPPORTS_LZ4
+          size_t dst_len = avail_out;
+          size_t src_len = stream_in_len_;
+          const size_t res = LZ4F_decompress(lz4_dctx_, buf + *produced, &dst_len, stream_in_, &src_len, NULL);
+          if (LZ4F_isError(res)) {
+            return false;
+          }
+          stream_in_len_ -= (uint32_t)src_len;
+          *produced += (uint32_t)dst_len;
+          end = res == 0;
+#endif
+        }
+        break;
+
+      case MainHeader::CompressedZstd:
+        {
+#ifdef CHUNK_SUPPORTS_ZSTD
+          ZSTD_inBuffer input = { stream_in_, stream_in_len_, 0 };
+          ZSTD_outBuffer output = { buf + *produced, avail_out, 0 };
+          const size_t res = ZSTD_decompressStream(zstd_dctx_, &output, &input);
+          if (ZSTD_isError(res)) {
+            LOG_WARNING_LN("zstd: %s", ZSTD_getErrorName(res));
+            return false;
+          }
+          stream_in_len_ -= (uint32_t)input.pos;
+          *produced += (uint32_t)output.pos;
+          end = res == 0;
+#endif
+        }
+        break;
+
+      default:
+        return false;
+    }
+
+    // the input pointers are just advanced by what was consumed, whatever the codec
+    stream_in_ += avail_in - stream_in_len_;
+
+    // stop at the end of the stream, or when we're not getting anywhere, which means the data
+    // is truncated
+    if (end || (*produced == produced_before && stream_in_len_ == avail_in)) {
+      break;
+    }
+  }
+  return true;
+}
+
+void ChunkIo::end_stream()
+{
+  if (stream_state_ == kStreamNone) {
+    return;
+  }
+
+  const bool compress = stream_state_ == kStreamCompress;
+  switch (stream_version_) {
+    case MainHeader::CompressedBZLib:
+#ifdef CHUNK_SUPPORTS_BZLIB
+      if (compress) {
+        BZ2_bzCompressEnd(&bz_stream_);
+      } else {
+        BZ2_bzDecompressEnd(&bz_stream_);
+      }
+#endif
+      break;
+
+    case MainHeader::CompressedZLib:
+#ifdef CHUNK_SUPPORTS_ZLIB
+      if (compress) {
+        deflateEnd(&z_stream_);
+      } else {
+        inflateEnd(&z_stream_);
+      }
+#endif
+      break;
+
+    case MainHeader::CompressedLZ4:
+#ifdef CHUNK_SUPPORTS_LZ4
+      if (compress) {
+        LZ4F_freeCompressionContext(lz4_cctx_);
+      } else {
+        LZ4F_freeDecompressionContext(lz4_dctx_);
+      }
 #endif
+      break;
+
+    case MainHeader::CompressedZstd:
+#ifdef CHUNK_SUPPORTS_ZSTD
+      if (compress) {
+        ZSTD_freeCCtx(zstd_cctx_);
+      } else {
+        ZSTD_freeDCtx(zstd_dctx_);
       }
+#endif
       break;
   }
+  stream_state_ = kStreamNone;
+}
+
+void ChunkIo::compress_blocks(const uint8_t* data, const uint32_t len)
+{
+  const uint32_t count = (len + block_size_ - 1) / block_size_;
+  const uint32_t bound = block_bound(block_codec_, block_size_);
+  uint8_t* compressed = new uint8_t[count * bound];
+  std::vector<uint32_t> sizes(count);
+  std::vector<uint32_t> crcs(count);
+
+#ifdef CHUNK_SUPPORTS_ZSTD
+  block_cctxs_.resize(WorkerPool::max_slots(), NULL);
+#endif
+  std::vector<uint8_t> failed(count);
+  WorkerPool::run(count, [&](int i, int slot) {
+    const uint8_t* block = data + i * block_size_;
+    const uint32_t block_len = min(block_size_, len - i * block_size_);
+    uint8_t* out = compressed + i * bound;
+    uint32_t out_len = bound;
+    if (!compress_block(block, block_len, out, &out_len, slot)) {
+      failed[i] = 1;
+    } else if (out_len >= block_len) {
+      // not worth decompressing
+      memcpy(out, block, block_len);
+      out_len = block_len;
+    }
+    sizes[i] = out_len;
+    if (write_checksums_) {
+      crcs[i] = crc32c(out, out_len);
+    }
+  });
+
+  if (std::find(failed.begin(), failed.end(), 1) != failed.end()) {
+    delete [] compressed;
+    throw std::string("Error compressing data");
+  }
+
+  for (uint32_t i = 0; i < count; ++i) {
+    reserve_output(sizes[i]);
+    const BlockEntry entry = { out_flushed_ + out_bytes_used_, sizes[i] };
+    block_table_.push_back(entry);
+    if (write_checksums_) {
+      block_crcs_.push_back(crcs[i]);
+    }
+    memcpy(out_buf_ + out_bytes_used_, compressed + i * bound, sizes[i]);
+    out_bytes_used_ += sizes[i];
+  }
+  delete [] compressed;
+}
+
+// Returns the most a block of len bytes can compress to, or 0 for an unknown codec
+uint32_t ChunkIo::block_bound(const MainHeader::Version codec, const uint32_t len)
+{
+  switch (codec) {
+    case MainHeader::CompressedBZLib:
+#ifdef CHUNK_SUPPORTS_BZLIB
+      // from the bzip2 manual
+      return len + len / 100 + 600;
+#else
+      throw std::string("bzlib not supported");
+#endif
+
+    case MainHeader::CompressedZLib:
+#ifdef CHUNK_SUPPORTS_ZLIB
+      return compressBound(len);
+#else
+      throw std::string("zlib not supported");
+#endif
+
+    case MainHeader::CompressedLZ4:
+#ifdef CHUNK_SUPPORTS_LZ4
+      return LZ4_compressBound(len);
+#else
+      throw std::string("lz4 not supported");
+#endif
+
+    case MainHeader::CompressedZstd:
+#ifdef CHUNK_SUPPORTS_ZSTD
+      return (uint32_t)ZSTD_compressBound(len);
+#else
+      throw std::string("zstd not supported");
+#endif
+
+    default:
+      return 0;
+  }
+}
+
+// Called from several threads at once, so apart from the context of its slot, it mustn't touch
+// anything that changes while compressing
+bool ChunkIo::compress_block(const uint8_t* data, const uint32_t len, uint8_t* out, uint32_t* out_len, const int slot)
+{
+  switch (block_codec_) {
+#ifdef CHUNK_SUPPORTS_BZLIB
+    case MainHeader::CompressedBZLib:
+      return BZ2_bzBuffToBuffCompress((char*)out, out_len, (char*)data, len, level_ < 1 || level_ > 9 ? 9 : level_, 0, 0) == BZ_OK;
+#endif
+
+#ifdef CHUNK_SUPPORTS_ZLIB
+    case MainHeader::CompressedZLib:
+      {
+        uLongf dest_len = *out_len;
+        const int32_t res = compress2(out, &dest_len, data, len, level_ < 1 || level_ > 9 ? Z_DEFAULT_COMPRESSION : level_);
+        *out_len = dest_len;
+        return res == Z_OK;
+      }
+#endif
+
+#ifdef CHUNK_SUPPORTS_LZ4
+    case MainHeader::CompressedLZ4:
+      {
+        // same as the frame api, levels from 3 up use the high compression compressor
+        const int res = level_ < 3
+          ? LZ4_compress_default((const char*)data, (char*)out, len, *out_len)
+          : LZ4_compress_HC((const char*)data, (char*)out, len, *out_len, level_);
+        *out_len = res;
+        return res > 0;
+      }
+#endif
+
+#ifdef CHUNK_SUPPORTS_ZSTD
+    case MainHeader::CompressedZstd:
+      {
+        ZSTD_CCtx*& ctx = block_cctxs_[slot];
+        if (!ctx && !(ctx = ZSTD_createCCtx())) {
+          return false;
+        }
+        const size_t res = dictionary_ && dictionary_->cdict_
+          ? ZSTD_compress_usingCDict(ctx, out, *out_len, data, len, dictionary_->cdict_)
+          : ZSTD_compressCCtx(ctx, out, *out_len, data, len, level_ < 1 ? ZSTD_CLEVEL_DEFAULT : level_);
+        *out_len = (uint32_t)res;
+        return !ZSTD_isError(res);
+      }
+#endif
+
+    default:
+      return false;
+  }
+}
+
+// Called from several threads at once, so apart from the context of its slot, it mustn't touch
+// anything that changes while decompressing
+bool ChunkIo::decompress_block(const BlockEntry& entry, uint8_t* out, const uint32_t out_len, const int slot)
+{
+  const uint8_t* data = reader_file_data_ + entry.offset;
+  if (reader_block_crcs_ && crc32c(data, entry.size) != reader_block_crcs_[&entry - reader_block_table_]) {
+    return false;
+  }
+  if (entry.size == out_len) {
+    // stored as is
+    memcpy(out, data, out_len);
+    return true;
+  }
+
+  switch (reader_blocks_->codec) {
+#ifdef CHUNK_SUPPORTS_BZLIB
+    case MainHeader::CompressedBZLib:
+      {
+        uint32_t dest_len = out_len;
+        return BZ2_bzBuffToBuffDecompress((char*)out, &dest_len, (char*)data, entry.size, 0, 0) == BZ_OK && dest_len == out_len;
+      }
+#endif
+
+#ifdef CHUNK_SUPPORTS_ZLIB
+    case MainHeader::CompressedZLib:
+      {
+        uLongf dest_len = out_len;
+        return uncompress(out, &dest_len, data, entry.size) == Z_OK && dest_len == out_len;
+      }
+#endif
+
+#ifdef CHUNK_SUPPORTS_LZ4
+    case MainHeader::CompressedLZ4:
+      return LZ4_decompress_safe((const char*)data, (char*)out, entry.size, out_len) == (int)out_len;
+#endif
+
+#ifdef CHUNK_SUPPORTS_ZSTD
+    case MainHeader::CompressedZstd:
+      {
+        ZSTD_DCtx*& ctx = block_dctxs_[slot];
+        if (!ctx && !(ctx = ZSTD_createDCtx())) {
+          return false;
+        }
+        const size_t res = dictionary_ && dictionary_->ddict_
+          ? ZSTD_decompress_usingDDict(ctx, out, out_len, data, entry.size, dictionary_->ddict_)
+          : ZSTD_decompressDCtx(ctx, out, out_len, data, entry.size);
+        return res == out_len;
+      }
+#endif
+
+    default:
+      return false;
+  }
+}
+
+
+ChunkDictionary::ChunkDictionary()
+  : cdict_(NULL)
+  , ddict_(NULL)
+{
+}
+
+ChunkDictionary::~ChunkDictionary()
+{
+#ifdef CHUNK_SUPPORTS_ZSTD
+  ZSTD_freeCDict(cdict_);
+  ZSTD_freeDDict(ddict_);
+#endif
+}
+
+bool ChunkDictionary::init(const void* data, const uint32_t len, const int level)
+{
+#ifdef CHUNK_SUPPORTS_ZSTD
+  ZSTD_freeCDict(cdict_);
+  ZSTD_freeDDict(ddict_);
+  // digest the dictionary once, instead of for every file that uses it
+  cdict_ = ZSTD_createCDict(data, len, level < 1 ? ZSTD_CLEVEL_DEFAULT : level);
+  ddict_ = ZSTD_createDDict(data, len);
+  return cdict_ != NULL && ddict_ != NULL;
+#else
+  throw std::string("zstd not supported");
+#endif
 }
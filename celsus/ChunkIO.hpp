@@ -3,9 +3,15 @@
 #include <stdint.h>
 #include <string>
 #include <stack>
+#include <vector>
 
 #define CHUNK_SUPPORTS_BZLIB
 #define CHUNK_SUPPORTS_ZLIB
+// lz4 and zstd are optional, and off by default. To use them, define CHUNK_SUPPORTS_LZ4 and/or
+// CHUNK_SUPPORTS_ZSTD in the project that builds ChunkIO.cpp, with the library's include directory
+// on its include path, and the directory of liblz4_static.lib or libzstd_static.lib on the library
+// path of whatever links with celsus. Their headers are only needed in ChunkIO.cpp, so the class
+// looks the same with or without them
 
 #ifdef CHUNK_SUPPORTS_BZLIB
 #include <bzlib.h>
@@ -13,6 +19,14 @@
 #ifdef CHUNK_SUPPORTS_ZLIB
 #include <zlib.h>
 #endif
+class MemoryMappedFile;
+class ChunkDictionary;
+struct LZ4F_cctx_s;
+struct LZ4F_dctx_s;
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
 
 // TODO: Make this a template class, taking the id enum as the template parameter, and move it to celsus
 
@@ -38,6 +52,32 @@ struct ChunkHeader
 };
 #pragma pack(pop)
 
+// An array read in place by ChunkIo::read_array
+template<typename T>
+struct ChunkSpan
+{
+  ChunkSpan() : data_(NULL), count_(0) {}
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + count_; }
+  const T& operator[](const uint32_t idx) const { return data_[idx]; }
+
+  const T*  data_;
+  uint32_t  count_;
+};
+
+// A pointer stored as an offset from itself, so structs holding them can be used straight from
+// the file, wherever the chunk ends up in memory. It can only point within its own chunk, and is
+// set up with ChunkIo::link
+template<typename T>
+struct ChunkPtr
+{
+  const T* get() const { return offset_ ? reinterpret_cast<const T*>(reinterpret_cast<const uint8_t*>(this) + offset_) : NULL; }
+  const T* operator->() const { return get(); }
+  const T& operator[](const uint32_t idx) const { return get()[idx]; }
+
+  int32_t   offset_;  // 0 for NULL
+};
+
 class ChunkIo
 {
 public:
@@ -49,6 +89,9 @@ public:
       Uncompressed,
       CompressedBZLib,
       CompressedZLib,
+      CompressedLZ4,
+      CompressedZstd,
+      CompressedBlocks,
     };
 
     static const uint32_t kHeaderId = 'DATA';
@@ -57,36 +100,180 @@ public:
     Version   version;
     uint32_t  uncompressesd_size;
   };
+
+  // Follows the MainHeader of a CompressedBlocks file. The payload is split into blocks that are
+  // compressed independently, so they can be (de)compressed in parallel, and a chunk can be read
+  // without decompressing everything before it. The block table is written after the blocks, as
+  // their number isn't known until the end
+  struct BlockHeader
+  {
+    MainHeader::Version codec;  // how each block is compressed
+    uint32_t  block_size;       // uncompressed size of every block but the last
+    uint32_t  block_count;
+    uint32_t  table_offset;     // from the start of the file to the BlockEntry table
+  };
+
+  struct BlockEntry
+  {
+    uint32_t  offset;           // from the start of the file
+    uint32_t  size;             // blocks that don't compress are stored as is, so their size is the uncompressed size
+  };
+
+  // The optional chunk directory goes at the very end of the file, uncompressed, with one entry for
+  // every chunk, nested ones included, in the order they were started. That's also the order of
+  // their offsets, and a chunk's children are the entries right after it with depth one more
+  struct DirectoryEntry
+  {
+    ChunkHeader::Id id;
+    uint32_t  depth;            // 0 for top level chunks
+    uint32_t  offset;           // of the ChunkHeader, from the start of the uncompressed payload
+    uint32_t  size;             // same as in the ChunkHeader
+  };
+
+  struct DirectoryFooter
+  {
+    static const uint32_t kFooterId = 'DIRS';
+    uint32_t  entry_count;      // the entries come right before the footer
+    uint32_t  id;
+  };
+
+  // Optional CRC32Cs go right before the directory, or at the end of the file without one. There's
+  // one for every top level chunk, over its header and data, followed by one for every block of a
+  // CompressedBlocks file, over the block as stored
+  struct ChunkChecksum
+  {
+    uint32_t  offset;           // of the ChunkHeader, from the start of the uncompressed payload
+    uint32_t  crc;
+  };
+
+  struct ChecksumFooter
+  {
+    static const uint32_t kFooterId = 'CRCS';
+    uint32_t  chunk_count;      // the ChunkChecksums come first, then the block crcs, then the footer
+    uint32_t  block_count;
+    uint32_t  id;
+  };
 #pragma pack(pop)
 
   ChunkIo();
   ~ChunkIo();
 
   // reader
+  // Compressed data is decompressed as it's read, into a window that holds the current chunk, so
+  // pointers returned by read_data and read_cstring are only valid until the next call to next()
+  // Top level chunks that are missing from the directory were replaced or removed by an appender,
+  // and are skipped
+  // Files with checksums have each chunk checked the first time it becomes the current chunk, and
+  // blocks as they're decompressed. A chunk that doesn't match can't be read, so next() and seek()
+  // fail, just like for truncated data
+
+  // Takes ownership of data, which must be allocated with new[]
   bool          init_reader(uint8_t* data, const uint32_t data_len);
+  // Reads straight from a memory mapped view of the file. Uncompressed files are used in place, without
+  // a copy, so only the pages that are actually read get loaded
+  bool          init_mapped_reader(const char* filename);
   bool          is_eof();
   bool          is_end_of_chunk();
+  // How much of the current chunk hasn't been read yet
+  uint32_t      bytes_left();
   ChunkHeader   cur_header();
   int32_t       read_int();
   uint32_t      read_uint();
   std::string   read_string();
-  char*         read_cstring();
-  uint8_t*      read_data(const uint32_t len);
+  const char*   read_cstring();
+  const uint8_t* read_data(const uint32_t len);
   bool          next();
 
+  // For files with a chunk directory, chunks can be looked up and jumped to directly. Entries are
+  // referred to by their index, and the functions return -1 when there's nothing to find.
+  // next() only steps over top level chunks, so use next_sibling to move on from a nested one
+  bool          has_directory() const;
+  uint32_t      directory_size() const;
+  const DirectoryEntry& directory_entry(const int entry) const;
+  int           find(const ChunkHeader::Id id, const uint32_t nth = 0) const;
+  int           first_child(const int entry) const;
+  int           next_sibling(const int entry) const;
+  // Makes the entry the current chunk. Uncompressed and CompressedBlocks files only read the chunk
+  // itself, while the streamed versions have to decompress up to it, and start over to go backwards
+  bool          seek(const int entry);
+
   template<typename T>
   T read_generic() {
-    const T value = *reinterpret_cast<T*>(data_ptr());
+    const T value = *reinterpret_cast<const T*>(data_ptr());
     cur_data_pos_ += sizeof(T);
     return value;
   }
 
+  // Returns an array written with write_array, straight from the file or the window, without copying.
+  // The elements are aligned in memory if the data passed to init_reader is aligned to at least as
+  // much, which mapped files always are
+  template<typename T>
+  ChunkSpan<T> read_array() {
+    ChunkSpan<T> span;
+    span.count_ = read_uint();
+    const uint32_t padding = read_uint();
+    read_data(padding);
+    span.data_ = reinterpret_cast<const T*>(read_data(span.count_ * sizeof(T)));
+    return span;
+  }
+
+  // Returns count elements written with write_in_place, in place like read_array. Structs that
+  // point at each other with ChunkPtrs are ready to use, so a whole chunk can be loaded by reading
+  // its root struct, and following the pointers from there
+  template<typename T>
+  const T* read_in_place(const uint32_t count = 1, const uint32_t alignment = __alignof(T)) {
+    read_data(padding_for(sizeof(MainHeader) + sizeof(ChunkHeader) + cur_data_pos_, alignment));
+    return reinterpret_cast<const T*>(read_data(count * sizeof(T)));
+  }
+
+  // Zstd files written with a dictionary can only be read with the same dictionary. It has to be set
+  // before init_reader or init_writer, and must outlive the ChunkIo
+  void  set_dictionary(const ChunkDictionary* dictionary);
+
   // writer
-  bool  init_writer(const MainHeader::Version version);
+  // The compression level is passed on to the codec, and -1 picks the codec's default. For zlib
+  // it's 1 (fastest) to 9 (smallest), and for bzlib it's the block size, 1 to 9 times 100k.
+  // lz4 goes from 1 to 12, where 3 and up is the slower high compression mode, and zstd from 1 to 22.
+  // Everything before the outermost open chunk is final, so it's compressed as soon as the buffer
+  // fills up, and the buffer only has to hold the chunk being written
+  static const int kDefaultCompressionLevel = -1;
+  bool  init_writer(const MainHeader::Version version, const int level = kDefaultCompressionLevel);
+  // Writes a CompressedBlocks file, with each block compressed with codec. The blocks are compressed
+  // a batch at a time, spread over all processors. Plain init_writer(CompressedBlocks) uses zstd
+  // (zlib without CHUNK_SUPPORTS_ZSTD) with the default block size
+  static const uint32_t kDefaultBlockSize = 256 * 1024;
+  bool  init_block_writer(const MainHeader::Version codec, const int level = kDefaultCompressionLevel, const uint32_t block_size = kDefaultBlockSize);
+  // Has end_of_data add a chunk directory to the file. Set it before init_writer
+  void  set_write_directory(const bool write);
+  // Has end_of_data add checksums to the file. Set it before init_writer
+  void  set_write_checksums(const bool write);
+  // Streams the output to filename as it's written, instead of collecting it for get_buffer, so
+  // memory use stays at the buffer size. Uncompressed data is written out in kFileBlockLen blocks,
+  // with the sizes of chunks that have already gone to disk patched in the file, while compressed
+  // data still has to buffer the outermost open chunk. Set it before init_writer, and end_of_data
+  // closes the file
+  static const uint32_t kFileBlockLen = 64 * 1024;
+  bool  set_output_file(const char* filename);
+  // Opens an existing uncompressed file with a directory, to change it without rewriting it. New
+  // chunks are written after the existing ones and the old directory, and end_of_data writes a new
+  // directory after them. The old directory stays valid until the header is updated at the very
+  // end, so a file is never left without one. Chunks that are replaced are left where they are, as
+  // is the old directory, but aren't in the new directory, so readers skip them, and compact gets
+  // rid of them for good
+  bool  init_appender(const char* filename);
+  // Removes the nth top level chunk with the id from the directory. To replace a chunk, remove it,
+  // and write the new version, which ends up after all the others. Nested chunks can only be
+  // changed by replacing the top level chunk they're in
+  bool  remove_chunk(const ChunkHeader::Id id, const uint32_t nth = 0);
+  // Rewrites filename to out_filename, leaving out anything that was replaced or removed. If it
+  // fails, out_filename is deleted
+  static bool compact(const char* filename, const char* out_filename, const MainHeader::Version version = MainHeader::Uncompressed);
   void  enter_scope(const ChunkHeader::Id id);
   void  leave_scope(const ChunkHeader::Id id);
   void  get_buffer(uint8_t*& buf, uint32_t& len);
-  void  end_of_data();
+  // Returns false if writing the output file failed. Failed writes don't throw, as they can happen
+  // when a ChunkScoper closes its chunk, and an appended file keeps its old header and directory
+  bool  end_of_data();
   bool  write_raw_data(const uint8_t* data, const uint32_t len);
   bool  write_string(const std::string& str);
   template<typename T> bool write_generic(const T value) 
@@ -98,24 +285,172 @@ public:
     return write_raw_data((const uint8_t*)&value, len);
   }
 
+  // Arrays are written as [count, padding length, padding, elements], with the padding placing the
+  // elements at a multiple of alignment from the start of the file. The alignment has to be a power
+  // of two, up to kMaxArrayAlignment
+  static const uint32_t kMaxArrayAlignment = 64;
+  template<typename T> bool write_array(const T* data, const uint32_t count, const uint32_t alignment = __alignof(T))
+  {
+    if (!valid_alignment(alignment)) {
+      return false;
+    }
+    const uint32_t padding = padding_for(tell() + 2 * sizeof(uint32_t), alignment);
+    const uint8_t zeros[kMaxArrayAlignment] = { 0 };
+    return write_generic(count) && write_generic(padding) &&
+      write_raw_data(zeros, padding) && write_raw_data((const uint8_t*)data, count * sizeof(T));
+  }
+
+  // Writes count elements, aligned like write_array but with nothing else around them, for reading
+  // with read_in_place. Returns the position of the first element, for linking ChunkPtrs to it, or
+  // 0 if it failed
+  template<typename T> uint32_t write_in_place(const T* data, const uint32_t count = 1, const uint32_t alignment = __alignof(T))
+  {
+    if (!valid_alignment(alignment)) {
+      return 0;
+    }
+    const uint32_t padding = padding_for(tell(), alignment);
+    const uint8_t zeros[kMaxArrayAlignment] = { 0 };
+    if (!write_raw_data(zeros, padding)) {
+      return 0;
+    }
+    const uint32_t pos = tell();
+    return write_raw_data((const uint8_t*)data, count * sizeof(T)) ? pos : 0;
+  }
+
+  // Points the ChunkPtr at ptr_pos to target_pos. Both have to be in the same chunk, which has
+  // to still be open, as only uncompressed data can be patched once it's flushed
+  bool  link(const uint32_t ptr_pos, const uint32_t target_pos);
+  // Position of the next byte written, from the start of the file
+  uint32_t  tell() const;
+
 private:
-  uint8_t*      data_ptr();
-  bool          handle_compression();
+  static bool     valid_alignment(const uint32_t alignment);
+  static uint32_t padding_for(const uint32_t pos, const uint32_t alignment);
+  const uint8_t* data_ptr();
+  bool          handle_compression(const uint8_t* data, const uint32_t file_len);
+  bool          read_directory(const uint8_t* data, uint32_t* data_len);
+  bool          read_checksums(const uint8_t* data, uint32_t* data_len);
+  void          reset_reader();
+  bool          fill_chunk();
+  bool          verify_chunk();
+  uint32_t      next_listed_chunk() const;
+  bool          fill_window(const uint32_t end);
+  bool          fill_blocks(const uint32_t end);
+  void          move_window(const uint32_t ofs, const uint32_t len);
 
   bool  expand_buffer_if_needed(const uint32_t data_size);
+  void  flush_writer(const bool finish);
+  void  flush_output(const bool finish);
+  bool  write_output(const uint8_t* data, const uint32_t len, const uint32_t pos);
+  void  patch(uint8_t* buf, const uint32_t buf_pos, const uint32_t pos, const void* data, const uint32_t len);
+  void  close_output();
+  void  append_output(const void* data, const uint32_t len);
+  bool  copy_listed_chunks(ChunkIo& reader);
+  void  append_directory();
+  void  append_checksums();
+  uint32_t  written_crc(const uint32_t pos, const uint32_t len);
+
+  // streaming (de)compression of the payload, for the compressed versions
+  bool  begin_stream(const MainHeader::Version version, const bool compress);
+  void  reserve_output(const uint32_t len);
+
+  // blocks of CompressedBlocks files
+  void  compress_blocks(const uint8_t* data, const uint32_t len);
+  static uint32_t block_bound(const MainHeader::Version codec, const uint32_t len);
+  bool  compress_block(const uint8_t* data, const uint32_t len, uint8_t* out, uint32_t* out_len, const int slot);
+  bool  decompress_block(const BlockEntry& entry, uint8_t* out, const uint32_t out_len, const int slot);
+  bool  compress_stream(const uint8_t* data, const uint32_t len, const bool finish);
+  bool  decompress_stream(uint8_t* buf, const uint32_t len, uint32_t* produced);
+  void  end_stream();
 
-  uint8_t* reader_data_;
+  const uint8_t* reader_data_;    // start of the window, so reader_data_[0] is at uncompressed offset window_ofs_
+  uint8_t* reader_input_;         // buffer passed to init_reader, owned by the reader
+  uint8_t* reader_buf_;           // window of decompressed data
+  uint32_t reader_buf_len_;
+  uint8_t* window_;               // where the window starts in reader_buf_
+  MemoryMappedFile* reader_file_;
   uint32_t reader_data_len_;
+  uint32_t window_ofs_;
+  uint32_t window_len_;
+  const uint8_t* reader_file_data_;   // the whole file, for CompressedBlocks
+  const BlockHeader* reader_blocks_;
+  const BlockEntry* reader_block_table_;
+  const DirectoryEntry* reader_directory_;
+  uint32_t reader_directory_len_;
+  const ChunkChecksum* reader_checksums_;
+  uint32_t reader_checksums_len_;
+  const uint32_t* reader_block_crcs_;
+  uint32_t reader_block_crcs_len_;
+  std::vector<uint8_t> chunk_verified_;
   uint32_t last_header_pos_;
   uint32_t cur_data_pos_;
 
   static const uint32_t kDefaultBufLen = 32 * 1024;
+  static const uint32_t kFileBufLen = 16 * kFileBlockLen;
+  static const uint32_t kDefaultWindowLen = 256 * 1024;
   uint8_t* writer_buf_;
   uint32_t writer_buf_len_;
   uint32_t bytes_used_;
+  uint32_t flushed_bytes_;        // bytes written before the start of writer_buf_
+  long outer_header_pos_;         // position of the outermost open chunk
+  uint8_t* out_buf_;              // compressed output
+  uint32_t out_buf_len_;
+  uint32_t out_bytes_used_;
+  uint32_t out_flushed_;          // compressed bytes written to the output file before the start of out_buf_
+  intptr_t writer_file_;          // HANDLE on Windows, file descriptor elsewhere, -1 without a file
+  bool failed_;                   // set when writing or reading back the output file fails
   MainHeader::Version version_;
+  int level_;
+  MainHeader::Version block_codec_;
+  uint32_t block_size_;
+  std::vector<BlockEntry> block_table_;
+  static const uint32_t kBlocksPerBatch = 16;
   std::stack<long> header_pos_stack_;
+  bool write_directory_;
+  std::vector<DirectoryEntry> directory_;
+  std::stack<uint32_t> directory_stack_;  // entries of the open chunks
+  bool write_checksums_;
+  std::vector<ChunkChecksum> chunk_checksums_;
+  std::vector<uint32_t> block_crcs_;
 
+  const ChunkDictionary* dictionary_;
+
+  enum StreamState { kStreamNone, kStreamCompress, kStreamDecompress };
+  StreamState stream_state_;
+  MainHeader::Version stream_version_;
+  const uint8_t* stream_in_;      // compressed data not yet consumed by the reader
+  uint32_t stream_in_len_;
+  const uint8_t* stream_start_;   // all of it, for seeking backwards
+  uint32_t stream_start_len_;
+#ifdef CHUNK_SUPPORTS_BZLIB
+  bz_stream bz_stream_;
+#endif
+#ifdef CHUNK_SUPPORTS_ZLIB
+  z_stream z_stream_;
+#endif
+  LZ4F_cctx_s* lz4_cctx_;
+  LZ4F_dctx_s* lz4_dctx_;
+  ZSTD_CCtx_s* zstd_cctx_;
+  ZSTD_DCtx_s* zstd_dctx_;
+  // zstd contexts for the blocks, one for each worker slot, made the first time a slot needs one
+  std::vector<ZSTD_CCtx_s*> block_cctxs_;
+  std::vector<ZSTD_DCtx_s*> block_dctxs_;
+
+};
+
+// A zstd dictionary, prepared once and shared by any number of readers and writers. Dictionaries
+// trained on typical data (with zstd --train) make small files compress a lot better
+class ChunkDictionary
+{
+public:
+  ChunkDictionary();
+  ~ChunkDictionary();
+  // The level is the one files written with the dictionary are compressed at
+  bool init(const void* data, const uint32_t len, const int level = ChunkIo::kDefaultCompressionLevel);
+private:
+  friend class ChunkIo;
+  ZSTD_CDict_s* cdict_;
+  ZSTD_DDict_s* ddict_;
 };
 
 class ChunkScoper
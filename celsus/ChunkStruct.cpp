@@ -0,0 +1,243 @@
+#include "StdAfx.h"
+#include "ChunkStruct.hpp"
+#include "crc32c.hpp"
+#include "ErrorHandling.hpp"
+
+namespace
+{
+  // Numbers are converted through the widest type of their kind
+  union Number
+  {
+    int64_t i;
+    uint64_t u;
+    double f;
+  };
+
+  Number load_number(const uint8_t* src, const uint32_t size, const ChunkFieldKind kind)
+  {
+    Number n;
+    n.u = 0;
+    switch (kind) {
+      case kChunkFieldSigned:
+        switch (size) {
+          case 1: n.i = *(const int8_t*)src; break;
+          case 2: n.i = *(const int16_t*)src; break;
+          case 4: n.i = *(const int32_t*)src; break;
+          case 8: n.i = *(const int64_t*)src; break;
+        }
+        break;
+      case kChunkFieldUnsigned:
+        switch (size) {
+          case 1: n.u = *(const uint8_t*)src; break;
+          case 2: n.u = *(const uint16_t*)src; break;
+          case 4: n.u = *(const uint32_t*)src; break;
+          case 8: n.u = *(const uint64_t*)src; break;
+        }
+        break;
+      case kChunkFieldFloat:
+        n.f = size == 4 ? *(const float*)src : *(const double*)src;
+        break;
+    }
+    return n;
+  }
+
+  void store_number(const Number n, const ChunkFieldKind src_kind, uint8_t* dst, const uint32_t size, const ChunkFieldKind kind)
+  {
+    if (kind == kChunkFieldFloat) {
+      const double f = src_kind == kChunkFieldFloat ? n.f : src_kind == kChunkFieldSigned ? (double)n.i : (double)n.u;
+      if (size == 4) {
+        *(float*)dst = (float)f;
+      } else {
+        *(double*)dst = f;
+      }
+      return;
+    }
+
+    // integers are truncated like a cast would
+    const uint64_t u = src_kind == kChunkFieldFloat ? (kind == kChunkFieldSigned ? (uint64_t)(int64_t)n.f : (uint64_t)n.f) : n.u;
+    switch (size) {
+      case 1: *(uint8_t*)dst = (uint8_t)u; break;
+      case 2: *(uint16_t*)dst = (uint16_t)u; break;
+      case 4: *(uint32_t*)dst = (uint32_t)u; break;
+      case 8: *(uint64_t*)dst = u; break;
+    }
+  }
+
+  bool is_number(const uint32_t kind, const uint32_t size)
+  {
+    if (kind == kChunkFieldFloat) {
+      return size == 4 || size == 8;
+    }
+    return (kind == kChunkFieldSigned || kind == kChunkFieldUnsigned) && (size == 1 || size == 2 || size == 4 || size == 8);
+  }
+}
+
+ChunkStructLayout::ChunkStructLayout(const ChunkField* fields, const uint32_t field_count, const uint32_t struct_size, const uint32_t hash)
+  : fields_(fields, fields + field_count)
+  , struct_size_(struct_size)
+  , hash_(hash)
+  , whole_(false)
+{
+  for (uint32_t i = 0; i < field_count; ++i) {
+    const ChunkField& field = fields[i];
+    const bool blob = field.kind == kChunkFieldBlob;
+    const FieldDesc desc = { crc32c(field.name, strlen(field.name)), blob ? 0 : field.size, field.kind };
+    descs_.push_back(desc);
+
+    // plain fields that carry on where the last one ended are copied along with it
+    if (!blob && !runs_.empty() && runs_.back().blob_field == -1 && runs_.back().offset + runs_.back().size == field.offset) {
+      runs_.back().size += field.size;
+      continue;
+    }
+    const Run run = { field.offset, blob ? 0 : field.size, blob ? (int)i : -1 };
+    runs_.push_back(run);
+  }
+  whole_ = runs_.size() == 1 && runs_[0].blob_field == -1 && runs_[0].offset == 0 && runs_[0].size == struct_size_;
+}
+
+// The structs are written as [format hash, field count, FieldDescs, struct count, structs], where
+// each struct is its fields in order, without any padding
+bool ChunkStructLayout::write(ChunkIo& writer, const void* data, const uint32_t count) const
+{
+  if (!writer.write_generic(hash_) || !writer.write_generic((uint32_t)descs_.size()) ||
+    !writer.write_raw_data((const uint8_t*)&descs_[0], descs_.size() * sizeof(FieldDesc)) || !writer.write_generic(count)) {
+    return false;
+  }
+
+  const uint8_t* src = (const uint8_t*)data;
+  if (whole_) {
+    return writer.write_raw_data(src, count * struct_size_);
+  }
+
+  for (uint32_t i = 0; i < count; ++i, src += struct_size_) {
+    for (size_t r = 0; r < runs_.size(); ++r) {
+      const Run& run = runs_[r];
+      const bool res = run.blob_field == -1
+        ? writer.write_raw_data(src + run.offset, run.size)
+        : fields_[run.blob_field].write(writer, src + run.offset);
+      if (!res) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool ChunkStructLayout::read_format(ChunkIo& reader, Format* format) const
+{
+  const uint8_t* header = read_chunk_bytes(reader, 2 * sizeof(uint32_t));
+  if (header == NULL) {
+    LOG_WARNING_LN("Invalid struct format");
+    return false;
+  }
+  const uint32_t hash = ((const uint32_t*)header)[0];
+  const uint32_t field_count = ((const uint32_t*)header)[1];
+  const FieldDesc* descs = (const FieldDesc*)read_chunk_bytes(reader, (uint64_t)field_count * sizeof(FieldDesc));
+  const uint8_t* count = descs ? read_chunk_bytes(reader, sizeof(uint32_t)) : NULL;
+  if (count == NULL) {
+    LOG_WARNING_LN("Invalid struct format");
+    return false;
+  }
+  format->count = *(const uint32_t*)count;
+
+  // every struct takes at least its plain fields and the lengths of its blobs, so a count that
+  // can't fit in the chunk is caught before anything is allocated for it
+  uint64_t min_size = 0;
+  for (uint32_t i = 0; i < field_count; ++i) {
+    min_size += descs[i].kind == kChunkFieldBlob ? sizeof(uint32_t) : descs[i].size;
+  }
+  if ((uint64_t)format->count * min_size > reader.bytes_left()) {
+    LOG_WARNING_LN("Invalid struct format");
+    return false;
+  }
+
+  format->same = hash == hash_ && field_count == descs_.size() && memcmp(descs, &descs_[0], field_count * sizeof(FieldDesc)) == 0;
+  if (format->same) {
+    return true;
+  }
+
+  // match the fields up by name
+  format->fields.assign(descs, descs + field_count);
+  format->targets.assign(field_count, -1);
+  for (uint32_t i = 0; i < field_count; ++i) {
+    for (size_t j = 0; j < descs_.size(); ++j) {
+      if (descs[i].name_hash == descs_[j].name_hash) {
+        format->targets[i] = (int)j;
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+bool ChunkStructLayout::read(ChunkIo& reader, const Format& format, void* data, const uint32_t count) const
+{
+  uint8_t* dst = (uint8_t*)data;
+  if (format.same && whole_) {
+    const uint8_t* src = read_chunk_bytes(reader, (uint64_t)count * struct_size_);
+    if (src == NULL) {
+      return false;
+    }
+    memcpy(dst, src, count * struct_size_);
+    return true;
+  }
+
+  for (uint32_t i = 0; i < count; ++i, dst += struct_size_) {
+    if (!format.same) {
+      if (!read_converted(reader, format, dst)) {
+        return false;
+      }
+      continue;
+    }
+    for (size_t r = 0; r < runs_.size(); ++r) {
+      const Run& run = runs_[r];
+      if (run.blob_field == -1) {
+        const uint8_t* src = read_chunk_bytes(reader, run.size);
+        if (src == NULL) {
+          return false;
+        }
+        memcpy(dst + run.offset, src, run.size);
+      } else if (!fields_[run.blob_field].read(reader, dst + run.offset)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool ChunkStructLayout::read_converted(ChunkIo& reader, const Format& format, uint8_t* data) const
+{
+  for (size_t i = 0; i < format.fields.size(); ++i) {
+    const FieldDesc& src = format.fields[i];
+    const ChunkField* field = format.targets[i] == -1 ? NULL : &fields_[format.targets[i]];
+
+    if (src.kind == kChunkFieldBlob) {
+      if (field && field->kind == kChunkFieldBlob) {
+        if (!field->read(reader, data + field->offset)) {
+          return false;
+        }
+      } else {
+        const uint8_t* len = read_chunk_bytes(reader, sizeof(uint32_t));
+        if (len == NULL || read_chunk_bytes(reader, *(const uint32_t*)len) == NULL) {
+          return false;
+        }
+      }
+      continue;
+    }
+
+    const uint8_t* value = read_chunk_bytes(reader, src.size);
+    if (value == NULL) {
+      return false;
+    }
+    if (field == NULL) {
+      continue;
+    }
+    if (field->kind == src.kind && field->size == src.size) {
+      memcpy(data + field->offset, value, src.size);
+    } else if (is_number(src.kind, src.size) && is_number(field->kind, field->size)) {
+      store_number(load_number(value, src.size, (ChunkFieldKind)src.kind), (ChunkFieldKind)src.kind, data + field->offset, field->size, field->kind);
+    }
+    // anything else has changed too much, and keeps its value
+  }
+  return true;
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "ChunkIO.hpp"
+
+// Serializers for structs described with CHUNK_STRUCT, so chunks don't have to be read and written
+// a field at a time:
+//
+//   struct Transform { float pos[3]; float rot[4]; uint32_t parent; std::string name; };
+//   #define TRANSFORM_FIELDS(FIELD) FIELD(pos) FIELD(rot) FIELD(parent) FIELD(name)
+//   CHUNK_STRUCT(Transform, TRANSFORM_FIELDS)
+//
+//   write_structs(writer, transforms, count);
+//   read_structs(reader, &transforms);
+//
+// Fields that are next to each other in memory are copied with a single memcpy, and structs that
+// are nothing but such fields are copied whole. The description of the fields goes in the file, so
+// when a struct changes, files written with the old version are converted a field at a time: fields
+// are matched by name, numbers are converted to the new type, and fields that are new keep the
+// value they're constructed with
+
+// How a field is stored. Plain data is copied as is, with numbers marked so they can be converted
+// between types. Anything else is a blob, written as [len, data], like strings, so that readers
+// that don't know the field can skip it
+enum ChunkFieldKind
+{
+  kChunkFieldRaw,
+  kChunkFieldSigned,
+  kChunkFieldUnsigned,
+  kChunkFieldFloat,
+  kChunkFieldBlob,
+};
+
+// Returns the next len bytes of the current chunk, or NULL if the chunk doesn't have that many left
+inline const uint8_t* read_chunk_bytes(ChunkIo& reader, const uint64_t len)
+{
+  // reading nothing is fine even at the end of the file, where read_data has nothing to point at
+  static const uint8_t kNothing = 0;
+  if (len > reader.bytes_left()) {
+    return NULL;
+  }
+  return len > 0 ? reader.read_data((uint32_t)len) : &kNothing;
+}
+
+template<typename T, ChunkFieldKind kind = kChunkFieldRaw>
+struct ChunkRawFieldTraits
+{
+  static const ChunkFieldKind kKind = kind;
+  static bool write(ChunkIo& writer, const void* value) { return writer.write_raw_data((const uint8_t*)value, sizeof(T)); }
+  static bool read(ChunkIo& reader, void* value)
+  {
+    const uint8_t* src = read_chunk_bytes(reader, sizeof(T));
+    if (src == NULL) {
+      return false;
+    }
+    memcpy(value, src, sizeof(T));
+    return true;
+  }
+};
+
+template<typename T>
+struct ChunkFieldTraits : ChunkRawFieldTraits<T> {};
+
+#define CHUNK_NUMBER_FIELD(type_, kind_) \
+  template<> struct ChunkFieldTraits<type_> : ChunkRawFieldTraits<type_, kind_> {};
+
+CHUNK_NUMBER_FIELD(int8_t, kChunkFieldSigned)
+CHUNK_NUMBER_FIELD(int16_t, kChunkFieldSigned)
+CHUNK_NUMBER_FIELD(int32_t, kChunkFieldSigned)
+CHUNK_NUMBER_FIELD(int64_t, kChunkFieldSigned)
+CHUNK_NUMBER_FIELD(uint8_t, kChunkFieldUnsigned)
+CHUNK_NUMBER_FIELD(uint16_t, kChunkFieldUnsigned)
+CHUNK_NUMBER_FIELD(uint32_t, kChunkFieldUnsigned)
+CHUNK_NUMBER_FIELD(uint64_t, kChunkFieldUnsigned)
+CHUNK_NUMBER_FIELD(float, kChunkFieldFloat)
+CHUNK_NUMBER_FIELD(double, kChunkFieldFloat)
+
+template<>
+struct ChunkFieldTraits<std::string>
+{
+  static const ChunkFieldKind kKind = kChunkFieldBlob;
+  static bool write(ChunkIo& writer, const void* value) { return writer.write_string(*(const std::string*)value); }
+  static bool read(ChunkIo& reader, void* value)
+  {
+    const uint8_t* len = read_chunk_bytes(reader, sizeof(uint32_t));
+    const uint8_t* str = len ? read_chunk_bytes(reader, *(const uint32_t*)len) : NULL;
+    if (str == NULL) {
+      return false;
+    }
+    ((std::string*)value)->assign((const char*)str, *(const uint32_t*)len);
+    return true;
+  }
+};
+
+struct ChunkField
+{
+  const char* name;
+  uint32_t  offset;
+  uint32_t  size;
+  ChunkFieldKind kind;
+  bool (*write)(ChunkIo& writer, const void* value);
+  bool (*read)(ChunkIo& reader, void* value);
+};
+
+template<typename T>
+ChunkField make_chunk_field(const char* name, const size_t offset)
+{
+  const ChunkField field = { name, (uint32_t)offset, sizeof(T), ChunkFieldTraits<T>::kKind, ChunkFieldTraits<T>::write, ChunkFieldTraits<T>::read };
+  return field;
+}
+
+// The fields of a struct, and how to copy them
+class ChunkStructLayout
+{
+public:
+#pragma pack(push, 1)
+  // Written in front of the structs, so the reader knows what it's getting
+  struct FieldDesc
+  {
+    uint32_t  name_hash;
+    uint32_t  size;             // 0 for blobs
+    uint32_t  kind;
+  };
+#pragma pack(pop)
+
+  // A file's version of the struct, as read by read_format
+  struct Format
+  {
+    bool      same;             // as the layout, so the fast path can be used
+    uint32_t  count;            // of structs
+    std::vector<FieldDesc> fields;
+    std::vector<int> targets;   // the layout's field for every field in the file, or -1
+  };
+
+  ChunkStructLayout(const ChunkField* fields, const uint32_t field_count, const uint32_t struct_size, const uint32_t hash);
+
+  bool  write(ChunkIo& writer, const void* data, const uint32_t count) const;
+  // Both fail on data that runs past the end of the chunk
+  bool  read_format(ChunkIo& reader, Format* format) const;
+  bool  read(ChunkIo& reader, const Format& format, void* data, const uint32_t count) const;
+
+private:
+  // a field that isn't plain data, or a number of plain fields that follow each other in memory
+  struct Run
+  {
+    uint32_t  offset;
+    uint32_t  size;
+    int       blob_field;       // -1 for plain data
+  };
+
+  bool  read_converted(ChunkIo& reader, const Format& format, uint8_t* data) const;
+
+  std::vector<ChunkField> fields_;
+  std::vector<FieldDesc> descs_;
+  std::vector<Run> runs_;
+  uint32_t struct_size_;
+  uint32_t hash_;
+  bool whole_;                  // the struct is a single run, so arrays are copied in one go
+};
+
+template<typename T>
+struct ChunkStruct;
+
+// The format hash is a compile time constant, covering the size of the struct and the offset and
+// size of every field, so formats that files depend on can be pinned with CHUNK_STRUCT_HASH
+#define CHUNK_FIELD_HASH(name_) \
+  ^ ((uint32_t)(offsetof(Type, name_) + 1) * 0x9e3779b1u + (uint32_t)sizeof(((Type*)0)->name_) * 0x85ebca6bu)
+
+#define CHUNK_FIELD_DESC(name_) \
+  make_chunk_field<decltype(((Type*)0)->name_)>(#name_, offsetof(Type, name_)),
+
+#define CHUNK_STRUCT(type_, fields_) \
+  template<> struct ChunkStruct<type_> \
+  { \
+    typedef type_ Type; \
+    static const uint32_t kFormatHash = (uint32_t)sizeof(Type) * 0xc2b2ae35u fields_(CHUNK_FIELD_HASH); \
+    static const ChunkStructLayout& layout() \
+    { \
+      static const ChunkField fields[] = { fields_(CHUNK_FIELD_DESC) }; \
+      static const ChunkStructLayout layout(fields, sizeof(fields) / sizeof(fields[0]), sizeof(Type), kFormatHash); \
+      return layout; \
+    } \
+  };
+
+// Fails to compile when the struct's layout changes
+#define CHUNK_STRUCT_HASH(type_, hash_) \
+  static_assert(ChunkStruct<type_>::kFormatHash == hash_, "The layout of " #type_ " has changed");
+
+template<typename T>
+bool write_structs(ChunkIo& writer, const T* data, const uint32_t count)
+{
+  return ChunkStruct<T>::layout().write(writer, data, count);
+}
+
+template<typename T>
+bool write_struct(ChunkIo& writer, const T& value)
+{
+  return write_structs(writer, &value, 1);
+}
+
+// Replaces the contents of values with the structs written by write_structs
+template<typename T>
+bool read_structs(ChunkIo& reader, std::vector<T>* values)
+{
+  const ChunkStructLayout& layout = ChunkStruct<T>::layout();
+  ChunkStructLayout::Format format;
+  if (!layout.read_format(reader, &format)) {
+    return false;
+  }
+  values->clear();
+  values->resize(format.count);
+  if (format.count > 0 && !layout.read(reader, format, &(*values)[0], format.count)) {
+    values->clear();
+    return false;
+  }
+  return true;
+}
+
+// Reads a single struct written by write_struct. Fields that aren't in the file are left as they are
+template<typename T>
+bool read_struct(ChunkIo& reader, T* value)
+{
+  const ChunkStructLayout& layout = ChunkStruct<T>::layout();
+  ChunkStructLayout::Format format;
+  if (!layout.read_format(reader, &format) || format.count != 1) {
+    return false;
+  }
+  return layout.read(reader, format, value, 1);
+}
@@ -0,0 +1,128 @@
+#include "stdafx.h"
+#include "MappedFileCache.hpp"
+#include "path_utils.hpp"
+#include "file_watcher.hpp"
+#include "celsus.hpp"
+
+MappedFileCache* volatile MappedFileCache::instance_ = nullptr;
+
+MappedFileView::MappedFileView(const string2& path)
+  : path_(path)
+  , data_(NULL)
+  , size_(0)
+  , ref_count_(1)
+  , stale_(false)
+{
+}
+
+MappedFileView::~MappedFileView()
+{
+}
+
+void MappedFileView::add_ref() const
+{
+  MappedFileCache& cache = MappedFileCache::instance();
+  SCOPED_CS(&cache.cs_);
+  ++ref_count_;
+}
+
+void MappedFileView::release() const
+{
+  MappedFileCache::instance().release(this);
+}
+
+MappedFileCache::MappedFileCache()
+{
+  InitializeCriticalSection(&cs_);
+}
+
+MappedFileCache::~MappedFileCache()
+{
+  DeleteCriticalSection(&cs_);
+}
+
+MappedFileCache& MappedFileCache::instance()
+{
+  MappedFileCache* cache = instance_;
+  if (cache != NULL)
+    return *cache;
+
+  // threads can race to create the cache, so the first one to publish its cache wins, and the others
+  // throw theirs away
+  MappedFileCache* new_cache = new MappedFileCache();
+  cache = (MappedFileCache*)InterlockedCompareExchangePointer((PVOID volatile*)&instance_, new_cache, NULL);
+  if (cache != NULL) {
+    delete new_cache;
+    return *cache;
+  }
+  return *new_cache;
+}
+
+string2 MappedFileCache::make_key(const string2& filename)
+{
+  // the same key FileWatcher uses, so its notifications can be matched up
+  return Path::make_canonical(Path::get_full_path_name(filename));
+}
+
+MappedFileView* MappedFileCache::get(const char* filename)
+{
+  const string2 key = make_key(filename);
+  MappedFileView* view = NULL;
+  bool watch = false;
+  {
+    SCOPED_CS(&cs_);
+    Views::iterator it = views_.find(key);
+    if (it != views_.end()) {
+      ++it->second->ref_count_;
+      return it->second;
+    }
+
+    // mapping is quick, as nothing is read until it's touched, so it's done with the lock held to
+    // keep two threads from mapping the same file
+    view = new MappedFileView(key);
+    void* data = NULL;
+    if (!view->file_.open(key, &data, &view->size_, 0, MemoryMappedFile::kShareDelete)) {
+      delete view;
+      return NULL;
+    }
+    view->data_ = (const uint8_t*)data;
+    views_[key] = view;
+
+    // FileWatcher can't remove callbacks, so every file is only ever registered once
+    watch = watched_.insert(key).second;
+  }
+
+  // registered without our lock, as FileWatcher holds its own lock when it calls invalidate
+  if (watch) {
+    FileWatcher::instance().add_file_changed(key, [](const string2& filename) -> bool {
+      MappedFileCache::instance().invalidate(filename);
+      return true;
+    }, false);
+  }
+  return view;
+}
+
+void MappedFileCache::invalidate(const string2& filename)
+{
+  SCOPED_CS(&cs_);
+  Views::iterator it = views_.find(make_key(filename));
+  if (it != views_.end()) {
+    it->second->stale_ = true;
+    views_.erase(it);
+  }
+}
+
+void MappedFileCache::release(const MappedFileView* view)
+{
+  {
+    SCOPED_CS(&cs_);
+    if (--view->ref_count_ > 0)
+      return;
+
+    // stale views have already been dropped, and might have been replaced by a newer view
+    Views::iterator it = views_.find(view->path_);
+    if (it != views_.end() && it->second == view)
+      views_.erase(it);
+  }
+  delete view;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <windows.h>
+#include "string_utils.hpp"
+#include "MemoryMappedFile.hpp"
+
+class MappedFileCache;
+
+// A read only mapping of a whole file, shared by everyone that asks the cache for the same file.
+// The file can be replaced while it's mapped, which is how most editors save, by writing a new file
+// and renaming it over the old one. On Windows it can't be written in place though, so views should
+// still be released once the data is loaded, for editors that save that way
+class MappedFileView
+{
+public:
+  const uint8_t* data() const { return data_; }
+  uint64_t size() const { return size_; }
+  const string2& path() const { return path_; }
+
+  // Set when the file has changed on disk since it was mapped. The view stays readable, but
+  // getting the file from the cache again gives the new contents
+  bool is_stale() const { return stale_; }
+
+  void add_ref() const;
+  void release() const;
+
+private:
+  friend class MappedFileCache;
+  MappedFileView(const string2& path);
+  ~MappedFileView();
+
+  MemoryMappedFile file_;
+  string2 path_;
+  const uint8_t* data_;
+  uint64_t size_;
+  mutable int ref_count_;       // only touched with the cache's lock held
+  volatile bool stale_;
+};
+
+// Process wide cache of mapped files, so systems that load the same file share a single copy of it.
+// Files are keyed by their canonical full path, and are unmapped when the last view is released.
+// Every file that's mapped is watched with FileWatcher, and changes invalidate the cached view
+class MappedFileCache
+{
+public:
+  static MappedFileCache& instance();
+
+  // Returns the file's view with a reference added, which the caller releases, or NULL if the
+  // file can't be mapped
+  MappedFileView* get(const char* filename);
+
+  // Marks the file's view as stale, and drops it from the cache. Views that are handed out stay
+  // valid until they're released
+  void invalidate(const string2& filename);
+
+private:
+  friend class MappedFileView;
+  MappedFileCache();
+  ~MappedFileCache();
+
+  static string2 make_key(const string2& filename);
+  void release(const MappedFileView* view);
+
+  typedef std::map<string2, MappedFileView*> Views;
+  CRITICAL_SECTION cs_;
+  Views views_;
+  std::set<string2> watched_;
+
+  static MappedFileCache* volatile instance_;
+};
@@ -0,0 +1,166 @@
+#include "stdafx.h"
+#include "MappedFileWriter.hpp"
+#include "MemoryMappedFile.hpp"
+#include <cstring>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFileWriter::MappedFileWriter()
+#ifdef _WIN32
+  : file_(INVALID_HANDLE_VALUE)
+  , mapping_(NULL)
+#else
+  : fd_(-1)
+#endif
+  , view_(NULL)
+  , size_(0)
+  , capacity_(0)
+  , grow_size_(kDefaultGrowSize)
+{
+}
+
+MappedFileWriter::~MappedFileWriter()
+{
+  close();
+}
+
+bool MappedFileWriter::open(const char* filename, const uint64_t initial_size, const size_t grow_size)
+{
+  close();
+  grow_size_ = grow_size > 0 ? grow_size : kDefaultGrowSize;
+#ifdef _WIN32
+  file_ = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file_ == INVALID_HANDLE_VALUE)
+    return false;
+#else
+  fd_ = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ == -1)
+    return false;
+#endif
+  return initial_size == 0 || map(initial_size);
+}
+
+bool MappedFileWriter::close()
+{
+  unmap();
+  bool res = true;
+#ifdef _WIN32
+  if (file_ != INVALID_HANDLE_VALUE) {
+    LARGE_INTEGER size;
+    size.QuadPart = (LONGLONG)size_;
+    res = SetFilePointerEx(file_, size, NULL, FILE_BEGIN) && SetEndOfFile(file_);
+    CloseHandle(file_);
+    file_ = INVALID_HANDLE_VALUE;
+  }
+#else
+  if (fd_ != -1) {
+    res = ftruncate(fd_, (off_t)size_) == 0;
+    ::close(fd_);
+    fd_ = -1;
+  }
+#endif
+  size_ = capacity_ = 0;
+  return res;
+}
+
+bool MappedFileWriter::reserve(const uint64_t capacity)
+{
+  if (capacity <= capacity_)
+    return true;
+
+  // grow by at least grow_size_, so filling the file a bit at a time doesn't remap it every time
+  const uint64_t grown = capacity_ + grow_size_;
+  return map(capacity > grown ? capacity : grown);
+}
+
+bool MappedFileWriter::resize(const uint64_t size)
+{
+  if (!reserve(size))
+    return false;
+  size_ = size;
+  return true;
+}
+
+uint8_t* MappedFileWriter::append(const size_t len)
+{
+  const uint64_t ofs = size_;
+  if (!resize(size_ + len))
+    return NULL;
+  return view_ + ofs;
+}
+
+bool MappedFileWriter::write(const void* data, const size_t len)
+{
+  uint8_t* dst = append(len);
+  if (dst == NULL)
+    return false;
+  memcpy(dst, data, len);
+  return true;
+}
+
+bool MappedFileWriter::flush(const uint64_t ofs, const size_t len)
+{
+  if (view_ == NULL || ofs + len > capacity_)
+    return false;
+#ifdef _WIN32
+  // FlushViewOfFile only hands the pages to the cache manager, so the file has to be flushed too
+  return FlushViewOfFile(view_ + ofs, len) && FlushFileBuffers(file_);
+#else
+  // msync wants a page aligned start
+  const uint64_t start = ofs & ~(uint64_t)(MemoryMappedFile::granularity() - 1);
+  return msync(view_ + start, (size_t)(ofs + len - start), MS_SYNC) == 0;
+#endif
+}
+
+// Sets the file to the new capacity, and maps all of it. The new view is mapped before the old one
+// is dropped, so a failed remap leaves the file as it was
+bool MappedFileWriter::map(const uint64_t capacity)
+{
+#ifdef _WIN32
+  if (file_ == INVALID_HANDLE_VALUE)
+    return false;
+  // the mapping grows the file to its size
+  HANDLE mapping = CreateFileMapping(file_, NULL, PAGE_READWRITE, (DWORD)(capacity >> 32), (DWORD)(capacity & 0xffffffff), NULL);
+  if (mapping == NULL)
+    return false;
+  uint8_t* view = (uint8_t*)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)capacity);
+  if (view == NULL) {
+    CloseHandle(mapping);
+    return false;
+  }
+  unmap();
+  mapping_ = mapping;
+#else
+  if (fd_ == -1 || ftruncate(fd_, (off_t)capacity) != 0)
+    return false;
+  void* view = mmap(NULL, (size_t)capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (view == MAP_FAILED) {
+    // put the file back to the size the old view covers
+    ftruncate(fd_, (off_t)capacity_);
+    return false;
+  }
+  unmap();
+#endif
+  view_ = (uint8_t*)view;
+  capacity_ = capacity;
+  return true;
+}
+
+void MappedFileWriter::unmap()
+{
+#ifdef _WIN32
+  if (view_ != NULL)
+    UnmapViewOfFile(view_);
+  if (mapping_ != NULL)
+    CloseHandle(mapping_);
+  mapping_ = NULL;
+#else
+  if (view_ != NULL)
+    munmap(view_, (size_t)capacity_);
+#endif
+  view_ = NULL;
+  capacity_ = 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Writes a file through a writable mapping, so large outputs can be filled in place instead of being
+// copied through WriteFile. The file is presized, or grown in big steps as it's written, and is
+// truncated to the bytes actually used when it's closed:
+//
+//   MappedFileWriter writer;
+//   writer.open("atlas.bin", header_size + pixel_size);
+//   uint8_t* header = writer.append(header_size);
+//   uint8_t* pixels = writer.append(pixel_size);
+//   ...
+//   writer.close();
+//
+// Growing the file remaps it, which moves it in memory, so pointers into it are only good until the
+// next append, reserve or resize
+class MappedFileWriter
+{
+public:
+  static const size_t kDefaultGrowSize = 64 * 1024 * 1024;
+
+  MappedFileWriter();
+  ~MappedFileWriter();
+
+  bool open(const char* filename, const uint64_t initial_size = 0, const size_t grow_size = kDefaultGrowSize);
+  // Truncates the file to size() and closes it
+  bool close();
+
+  // Maps at least capacity bytes, without changing the size
+  bool reserve(const uint64_t capacity);
+  // Sets the size the file ends up with, growing it if needed
+  bool resize(const uint64_t size);
+  // Adds len bytes to the end of the file, and returns them to be filled in, or NULL on failure
+  uint8_t* append(const size_t len);
+  bool write(const void* data, const size_t len);
+
+  // Writes a range of the file out to disk, instead of when the system gets around to it
+  bool flush(const uint64_t ofs, const size_t len);
+
+  uint8_t* data() const { return view_; }
+  uint64_t size() const { return size_; }
+  uint64_t capacity() const { return capacity_; }
+
+private:
+  bool map(const uint64_t capacity);
+  void unmap();
+
+#ifdef _WIN32
+  HANDLE file_;
+  HANDLE mapping_;
+#else
+  int fd_;
+#endif
+  uint8_t* view_;
+  uint64_t size_;
+  uint64_t capacity_;
+  size_t grow_size_;
+};
@@ -0,0 +1,299 @@
+// Doesn't use the precompiled header, so it builds as is on platforms without windows.h
+#include "MappedWindowReader.hpp"
+
+MappedWindowReader::MappedWindowReader()
+  : current_(NULL)
+  , spare_(NULL)
+#ifdef _WIN32
+  , thread_(NULL)
+  , request_event_(NULL)
+  , ready_event_(NULL)
+#else
+  , request_(false)
+  , ready_(false)
+#endif
+  , thread_running_(false)
+  , quit_(false)
+  , prefetching_(false)
+  , prefetch_window_(0)
+  , prefetch_ok_(false)
+  , file_size_(0)
+  , window_size_(0)
+  , max_span_(0)
+  , window_idx_(0)
+  , window_ofs_(0)
+  , window_(NULL)
+  , cur_(NULL)
+  , end_(NULL)
+{
+}
+
+MappedWindowReader::~MappedWindowReader()
+{
+  close();
+}
+
+bool MappedWindowReader::open(const char* filename, size_t window_size, size_t max_span)
+{
+  close();
+
+  const size_t granularity = MemoryMappedFile::granularity();
+  window_size_ = (window_size + granularity - 1) & ~(granularity - 1);
+  max_span_ = max_span < window_size_ ? max_span : window_size_;
+
+  void* data = NULL;
+  current_ = new MemoryMappedFile();
+  if (!current_->open(filename, &data, &file_size_, window_size_ + max_span_, MemoryMappedFile::kPopulate)) {
+    close();
+    return false;
+  }
+
+  window_idx_ = 0;
+  window_ofs_ = 0;
+  if (file_size_ == 0) {
+    // nothing to map, so the cursor starts out at the end
+    window_ = cur_ = end_ = NULL;
+    return true;
+  }
+
+  // the spare view is remapped before it's used, so it starts out as small as it can be
+  spare_ = new MemoryMappedFile();
+  if (!spare_->open(filename, &data, &file_size_, granularity, MemoryMappedFile::kPopulate) || !start_thread()) {
+    close();
+    return false;
+  }
+  current_->advise(MemoryMappedFile::kSequential);
+
+  window_ = (const uint8_t*)current_->view();
+  cur_ = window_;
+  end_ = window_ + window_len(0);
+
+  if (file_size_ > window_size_) {
+    prefetch_window_ = 1;
+    prefetching_ = true;
+    signal(true);
+  }
+  return true;
+}
+
+void MappedWindowReader::close()
+{
+  if (thread_running_) {
+    wait_prefetch();
+    stop_thread();
+  }
+  delete current_;
+  delete spare_;
+  current_ = spare_ = NULL;
+  file_size_ = 0;
+  window_ = cur_ = end_ = NULL;
+}
+
+bool MappedWindowReader::advance(const size_t len)
+{
+  if (len > available()) {
+    return false;
+  }
+  cur_ += len;
+
+  // the overlap is only there for reads that start in this window, so move on once the cursor leaves it
+  const uint64_t ofs = pos();
+  if (ofs >= window_ofs_ + window_size_ && ofs < file_size_) {
+    return seek(ofs);
+  }
+  return true;
+}
+
+bool MappedWindowReader::seek(const uint64_t pos)
+{
+  if (pos > file_size_) {
+    return false;
+  }
+
+  // the end of the file belongs to the window it ends in, to keep eof() simple
+  const uint64_t window = (pos == file_size_ && pos > 0 ? pos - 1 : pos) / window_size_;
+  if (window != window_idx_ && !switch_window(window)) {
+    return false;
+  }
+  cur_ = window_ + (size_t)(pos - window_ofs_);
+  return true;
+}
+
+bool MappedWindowReader::map_window(MemoryMappedFile* file, const uint64_t window) const
+{
+  return file->lock(window * window_size_, window_len(window));
+}
+
+size_t MappedWindowReader::window_len(const uint64_t window) const
+{
+  const uint64_t left = file_size_ - window * window_size_;
+  return left < window_size_ + max_span_ ? (size_t)left : window_size_ + max_span_;
+}
+
+void MappedWindowReader::wait_prefetch()
+{
+  if (prefetching_) {
+    wait(false);
+    prefetching_ = false;
+  }
+}
+
+bool MappedWindowReader::switch_window(const uint64_t window)
+{
+  // wait for the helper, so it's done with spare_ either way
+  wait_prefetch();
+  if (prefetch_window_ == window && prefetch_ok_) {
+    MemoryMappedFile* tmp = current_;
+    current_ = spare_;
+    spare_ = tmp;
+    prefetch_ok_ = false;
+  } else if (!map_window(current_, window)) {
+    // the old window is gone too, so there's nothing left to read until a seek maps one again
+    window_idx_ = (uint64_t)-1;
+    window_ = cur_ = end_ = NULL;
+    return false;
+  }
+
+  window_idx_ = window;
+  window_ofs_ = window * window_size_;
+  window_ = (const uint8_t*)current_->view();
+  end_ = window_ + window_len(window);
+
+  if (window_ofs_ + window_size_ < file_size_) {
+    prefetch_window_ = window + 1;
+    prefetching_ = true;
+    signal(true);
+  }
+  return true;
+}
+
+void MappedWindowReader::prefetch_loop()
+{
+  const size_t page_size = MemoryMappedFile::page_size();
+  for (;;) {
+    wait(true);
+    if (quit_) {
+      return;
+    }
+
+    // remapping also drops the window before last, which is slow enough to keep off the reader
+    prefetch_ok_ = map_window(spare_, prefetch_window_);
+    if (prefetch_ok_) {
+      spare_->advise(MemoryMappedFile::kSequential);
+      spare_->advise(MemoryMappedFile::kWillNeed);
+
+      // touch every page, so the reader doesn't take the page faults
+      const size_t len = window_len(prefetch_window_);
+      const volatile uint8_t* data = (const volatile uint8_t*)spare_->view();
+      uint8_t sum = 0;
+      for (size_t i = 0; i < len; i += page_size) {
+        sum += data[i];
+      }
+    }
+    signal(false);
+  }
+}
+
+#ifdef _WIN32
+
+DWORD WINAPI MappedWindowReader::prefetch_thread(void* param)
+{
+  ((MappedWindowReader*)param)->prefetch_loop();
+  return 0;
+}
+
+bool MappedWindowReader::start_thread()
+{
+  request_event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+  ready_event_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (request_event_ != NULL && ready_event_ != NULL) {
+    thread_ = CreateThread(NULL, 0, prefetch_thread, this, 0, NULL);
+  }
+  if (thread_ == NULL) {
+    if (request_event_ != NULL)
+      CloseHandle(request_event_);
+    if (ready_event_ != NULL)
+      CloseHandle(ready_event_);
+    request_event_ = ready_event_ = NULL;
+    return false;
+  }
+  thread_running_ = true;
+  return true;
+}
+
+void MappedWindowReader::stop_thread()
+{
+  quit_ = true;
+  signal(true);
+  WaitForSingleObject(thread_, INFINITE);
+  CloseHandle(thread_);
+  CloseHandle(request_event_);
+  CloseHandle(ready_event_);
+  thread_ = request_event_ = ready_event_ = NULL;
+  thread_running_ = false;
+  quit_ = false;
+}
+
+void MappedWindowReader::signal(const bool request)
+{
+  SetEvent(request ? request_event_ : ready_event_);
+}
+
+void MappedWindowReader::wait(const bool request)
+{
+  WaitForSingleObject(request ? request_event_ : ready_event_, INFINITE);
+}
+
+#else
+
+void* MappedWindowReader::prefetch_thread(void* param)
+{
+  ((MappedWindowReader*)param)->prefetch_loop();
+  return NULL;
+}
+
+bool MappedWindowReader::start_thread()
+{
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&cond_, NULL);
+  request_ = ready_ = false;
+  if (pthread_create(&thread_, NULL, prefetch_thread, this) != 0) {
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+    return false;
+  }
+  thread_running_ = true;
+  return true;
+}
+
+void MappedWindowReader::stop_thread()
+{
+  quit_ = true;
+  signal(true);
+  pthread_join(thread_, NULL);
+  pthread_cond_destroy(&cond_);
+  pthread_mutex_destroy(&mutex_);
+  thread_running_ = false;
+  quit_ = false;
+}
+
+void MappedWindowReader::signal(const bool request)
+{
+  pthread_mutex_lock(&mutex_);
+  (request ? request_ : ready_) = true;
+  pthread_cond_broadcast(&cond_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void MappedWindowReader::wait(const bool request)
+{
+  pthread_mutex_lock(&mutex_);
+  bool& flag = request ? request_ : ready_;
+  while (!flag) {
+    pthread_cond_wait(&cond_, &mutex_);
+  }
+  flag = false;
+  pthread_mutex_unlock(&mutex_);
+}
+
+#endif
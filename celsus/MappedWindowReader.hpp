@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#include "MemoryMappedFile.hpp"
+
+// Reads through a file of any size, a mapped window at a time. While the cursor is in one window, a
+// helper thread maps the next one and reads it in, so walking the file doesn't stall on every switch.
+//
+// Windows overlap by max_span bytes, so anything up to that size can be read in one go, no matter
+// where it starts:
+//
+//   MappedWindowReader reader;
+//   reader.open("capture.txt");
+//   while (!reader.eof()) {
+//     const char* buf = (const char*)reader.data();
+//     int len;
+//     scan_read_line(buf, buf + reader.available() - 1, &len);
+//     ...
+//     reader.advance(len + 1);
+//   }
+class MappedWindowReader
+{
+public:
+  static const size_t kDefaultWindowSize = 64 * 1024 * 1024;
+  static const size_t kDefaultMaxSpan = 1024 * 1024;
+
+  MappedWindowReader();
+  ~MappedWindowReader();
+
+  // window_size is rounded up to the mapping granularity, and max_span can't be larger than it.
+  // An empty file opens fine, and is at eof right away
+  bool open(const char* filename, size_t window_size = kDefaultWindowSize, size_t max_span = kDefaultMaxSpan);
+  void close();
+
+  // The cursor, with available() bytes mapped after it. That's at least max_span, unless the file
+  // ends first
+  const uint8_t* data() const { return cur_; }
+  size_t available() const { return (size_t)(end_ - cur_); }
+  uint64_t pos() const { return window_ofs_ + (cur_ - window_); }
+  uint64_t size() const { return file_size_; }
+  bool eof() const { return cur_ == end_; }
+
+  // Moves the cursor forward, at most available() bytes
+  bool advance(const size_t len);
+  bool seek(const uint64_t pos);
+
+private:
+#ifdef _WIN32
+  static DWORD WINAPI prefetch_thread(void* param);
+#else
+  static void* prefetch_thread(void* param);
+#endif
+  void prefetch_loop();
+  bool start_thread();
+  void stop_thread();
+  // the reader requests a window, and the helper says when it's ready, like auto reset events
+  void signal(const bool request);
+  void wait(const bool request);
+  bool map_window(MemoryMappedFile* file, const uint64_t window) const;
+  size_t window_len(const uint64_t window) const;
+  bool switch_window(const uint64_t window);
+  void wait_prefetch();
+
+  // the helper thread maps the next window into spare_, while current_ is being read
+  MemoryMappedFile* current_;
+  MemoryMappedFile* spare_;
+#ifdef _WIN32
+  HANDLE thread_;
+  HANDLE request_event_;
+  HANDLE ready_event_;
+#else
+  pthread_t thread_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+  bool request_;
+  bool ready_;
+#endif
+  bool thread_running_;
+  volatile bool quit_;
+  bool prefetching_;
+  uint64_t prefetch_window_;
+  bool prefetch_ok_;
+
+  uint64_t file_size_;
+  size_t window_size_;
+  size_t max_span_;
+  uint64_t window_idx_;
+  uint64_t window_ofs_;
+  const uint8_t* window_;
+  const uint8_t* cur_;
+  const uint8_t* end_;
+};
@@ -1,5 +1,13 @@
-#include "stdafx.h"
+// Doesn't use the precompiled header, so it builds as is on platforms without windows.h
 #include "MemoryMappedFile.hpp"
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
 
 MemoryMappedFile::MemoryMappedFile() 
   : _file_handle(INVALID_HANDLE_VALUE) 
@@ -21,24 +29,39 @@ MemoryMappedFile::~MemoryMappedFile()
 
 }
 
-bool MemoryMappedFile::open(const char* filename, void** data, uint64_t* data_len, size_t lock_size)
+// Windows reads ahead and pulls in large pages on its own, so only kShareDelete is used
+bool MemoryMappedFile::open(const char* filename, void** data, uint64_t* data_len, size_t lock_size, const uint32_t flags)
 {
-  _file_handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  const DWORD share = FILE_SHARE_READ | (flags & kShareDelete ? FILE_SHARE_DELETE : 0);
+  _file_handle = CreateFileA(filename, GENERIC_READ, share, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
   if (_file_handle == INVALID_HANDLE_VALUE)
     return false;
 
   DWORD hi, lo = GetFileSize(_file_handle, &hi);
+  const uint64_t file_size = (uint64_t)hi << 32 | lo;
+  if (file_size == 0) {
+    *data = NULL;
+    *data_len = 0;
+    return true;
+  }
+
+  // a view can't go past the end of the file
+  if (lock_size > file_size)
+    lock_size = (size_t)file_size;
 
   _file_mapping = CreateFileMapping(_file_handle, NULL, PAGE_READONLY, 0, 0, 0);
-  if (_file_mapping == INVALID_HANDLE_VALUE)
+  if (_file_mapping == NULL) {
+    // CreateFileMapping returns NULL on failure, but the destructor checks for INVALID_HANDLE_VALUE
+    _file_mapping = INVALID_HANDLE_VALUE;
     return false;
+  }
 
   *data = _view = MapViewOfFile(_file_mapping, FILE_MAP_READ, 0, 0, lock_size);
 	if (!*data) {
 		DWORD err = GetLastError();
 		return false;
 	}
-  *data_len = (uint64_t)hi << 32 | lo;
+  *data_len = file_size;
   return true;
 }
 
@@ -48,5 +71,132 @@ bool MemoryMappedFile::lock(uint64_t ofs, size_t len)
 		UnmapViewOfFile(_view);
 
 	_view = MapViewOfFile(_file_mapping, FILE_MAP_READ, (DWORD)(ofs >> 32), (DWORD)(ofs & 0xffffffff), len);
-	return true;
+	return _view != NULL;
+}
+
+bool MemoryMappedFile::advise(const Access access, const uint64_t ofs, const size_t len)
+{
+  return _view != NULL;
+}
+
+size_t MemoryMappedFile::granularity()
+{
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwAllocationGranularity;
+}
+
+size_t MemoryMappedFile::page_size()
+{
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+}
+
+#else
+
+MemoryMappedFile::MemoryMappedFile()
+  : _fd(-1)
+  , _flags(0)
+  , _view_len(0)
+  , _view(NULL)
+{
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+  if (_view != NULL)
+    munmap(_view, _view_len);
+
+  if (_fd != -1)
+    close(_fd);
+}
+
+bool MemoryMappedFile::open(const char* filename, void** data, uint64_t* data_len, size_t lock_size, const uint32_t flags)
+{
+  _fd = ::open(filename, O_RDONLY);
+  if (_fd == -1)
+    return false;
+
+  struct stat st;
+  if (fstat(_fd, &st) != 0) {
+    close(_fd);
+    _fd = -1;
+    return false;
+  }
+
+  _flags = flags;
+  *data_len = (uint64_t)st.st_size;
+  if (*data_len == 0) {
+    *data = NULL;
+    return true;
+  }
+  if (!lock(0, lock_size != 0 && lock_size < *data_len ? lock_size : (size_t)*data_len)) {
+    close(_fd);
+    _fd = -1;
+    return false;
+  }
+
+  *data = _view;
+  return true;
+}
+
+// Like MapViewOfFile, ofs has to be a multiple of the page size
+bool MemoryMappedFile::lock(uint64_t ofs, size_t len)
+{
+  if (_view != NULL) {
+    munmap(_view, _view_len);
+    _view = NULL;
+    _view_len = 0;
+  }
+
+  int map_flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+  if (_flags & kPopulate)
+    map_flags |= MAP_POPULATE;
+#endif
+  void* view = mmap(NULL, len, PROT_READ, map_flags, _fd, (off_t)ofs);
+  if (view == MAP_FAILED)
+    return false;
+
+  _view = view;
+  _view_len = len;
+#ifdef MADV_HUGEPAGE
+  // only a hint, as most file systems can't back files with huge pages
+  if (_flags & kHugePages)
+    madvise(_view, _view_len, MADV_HUGEPAGE);
+#endif
+  return true;
 }
+
+bool MemoryMappedFile::advise(const Access access, const uint64_t ofs, const size_t len)
+{
+  if (_view == NULL || ofs >= _view_len)
+    return false;
+
+  // madvise wants a page aligned start, so round it down and cover the extra bytes
+  const size_t start = (size_t)ofs & ~(granularity() - 1);
+  const size_t end = len == 0 || len > _view_len - ofs ? _view_len : (size_t)ofs + len;
+
+  int advice = MADV_NORMAL;
+  switch (access) {
+    case kNormal: advice = MADV_NORMAL; break;
+    case kSequential: advice = MADV_SEQUENTIAL; break;
+    case kRandom: advice = MADV_RANDOM; break;
+    case kWillNeed: advice = MADV_WILLNEED; break;
+    case kDontNeed: advice = MADV_DONTNEED; break;
+  }
+  return madvise((uint8_t*)_view + start, end - start, advice) == 0;
+}
+
+size_t MemoryMappedFile::granularity()
+{
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+size_t MemoryMappedFile::page_size()
+{
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+#endif
@@ -2,19 +2,56 @@
 #define MEMORY_MAPPED_FILE_HPP
 
 #include <stdint.h>
+#include <stddef.h>
+#ifdef _WIN32
 #include <windows.h>
+#endif
 
+// Read only view of a file, built on CreateFileMapping on Windows, and mmap everywhere else
 class MemoryMappedFile
 {
 public:
+  // How the view is going to be read, passed on to madvise. Windows has no equivalent for a view
+  // that's already mapped, so there they're ignored
+  enum Access
+  {
+    kNormal,
+    kSequential,  // read ahead aggressively, and drop pages soon after they're read
+    kRandom,      // don't read ahead
+    kWillNeed,    // start reading the range in now
+    kDontNeed,    // the range can be dropped, and is read again if it's touched
+  };
+
+  // Flags for open
+  enum
+  {
+    kPopulate = 1 << 0,   // read the whole view in up front, instead of faulting it in page by page
+    kHugePages = 1 << 1,  // back the view with huge pages where the kernel and file system allow it
+    kShareDelete = 1 << 2,  // let the file be deleted or renamed over while it's open. Always the case off Windows
+  };
+
   MemoryMappedFile();
   ~MemoryMappedFile();
 
-  bool open(const char* filename, void** data, uint64_t* data_len, size_t lock_size);
+  // An empty file can't be mapped, so it opens without a view, and data is set to NULL
+  bool open(const char* filename, void** data, uint64_t* data_len, size_t lock_size, const uint32_t flags = 0);
 	bool lock(uint64_t ofs, size_t len);
+  // Hints how a range of the current view is going to be used, with len 0 meaning the rest of it
+  bool advise(const Access access, const uint64_t ofs = 0, const size_t len = 0);
+  void* view() const { return _view; }
+
+  // What the offsets passed to lock have to be a multiple of
+  static size_t granularity();
+  static size_t page_size();
 private:
+#ifdef _WIN32
   HANDLE _file_handle;
   HANDLE _file_mapping;
+#else
+  int _fd;
+  uint32_t _flags;
+  size_t _view_len;
+#endif
   void* _view;
 };
 
@@ -1,8 +1,19 @@
 #include "stdafx.h"
 #include "Profiler.hpp"
 #include "Logger.hpp"
+#include <intrin.h>
 
 Profiler* Profiler::instance_ = NULL;
+Profiler::ThreadBuffer* volatile Profiler::buffers_ = NULL;
+volatile LONG Profiler::event_count_ = Profiler::kDefaultEventCount;
+volatile LONG Profiler::fls_index_ = (LONG)FLS_OUT_OF_INDEXES;
+volatile LONG Profiler::threads_started_ = 0;
+
+namespace
+{
+  // the calling thread's buffer, created the first time it records something
+  __declspec(thread) void* g_thread_buffer = NULL;
+}
 
 Profiler& Profiler::instance()
 {
@@ -13,42 +24,203 @@ Profiler& Profiler::instance()
   return *instance_;
 }
 
-void Profiler::enter_scope(const char* name)
+void Profiler::set_event_count(const uint32_t count)
+{
+  uint32_t n = 1;
+  while (n < count) {
+    n *= 2;
+  }
+  InterlockedExchange(&event_count_, (LONG)n);
+}
+
+// The fiber local storage slot that tells us when a thread with a buffer exits. Unlike
+// __declspec(thread), it calls thread_exited with the thread's buffer when it does
+DWORD Profiler::fls_index()
+{
+  if (fls_index_ == (LONG)FLS_OUT_OF_INDEXES) {
+    const DWORD index = FlsAlloc(thread_exited);
+    if (InterlockedCompareExchange(&fls_index_, (LONG)index, (LONG)FLS_OUT_OF_INDEXES) != (LONG)FLS_OUT_OF_INDEXES) {
+      FlsFree(index);
+    }
+  }
+  return (DWORD)fls_index_;
+}
+
+void WINAPI Profiler::thread_exited(void* buffer)
+{
+  if (buffer != NULL) {
+    InterlockedExchange(&((ThreadBuffer*)buffer)->state, kExited);
+  }
+}
+
+// Buffers are never freed. Once a thread has exited, and its events have been collected, a new
+// thread takes its buffer over, so there are only as many buffers as threads that are running or
+// haven't been looked at since they exited
+Profiler::ThreadBuffer* Profiler::create_thread_buffer()
 {
+  const uint32_t count = (uint32_t)event_count_;
+  ThreadBuffer* buffer = NULL;
+  for (ThreadBuffer* cur = buffers_; cur != NULL; cur = cur->next) {
+    if (cur->mask + 1 == count && InterlockedCompareExchange(&cur->state, kRecording, kCollected) == kCollected) {
+      buffer = cur;
+      buffer->count = 0;
+      buffer->full = false;
+      buffer->thread_id = GetCurrentThreadId();
+      buffer->thread_order = InterlockedIncrement(&threads_started_);
+      break;
+    }
+  }
+
+  if (buffer == NULL) {
+    buffer = new ThreadBuffer();
+    buffer->thread_id = GetCurrentThreadId();
+    buffer->thread_order = InterlockedIncrement(&threads_started_);
+    buffer->state = kRecording;
+    buffer->events = new Event[count];
+    buffer->mask = count - 1;
+    buffer->count = 0;
+    buffer->full = false;
+
+    // push it on the list of buffers
+    ThreadBuffer* head;
+    do {
+      head = buffers_;
+      buffer->next = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*)&buffers_, buffer, head) != head);
+  }
+
+  // without it, the buffer is never reused, which only costs memory
+  FlsSetValue(fls_index(), buffer);
+  return buffer;
+}
+
+void Profiler::add_event(const char* name)
+{
+  ThreadBuffer* buffer = (ThreadBuffer*)g_thread_buffer;
+  if (buffer == NULL) {
+    g_thread_buffer = buffer = create_thread_buffer();
+  }
+
   LARGE_INTEGER cur_time;
   QueryPerformanceCounter(&cur_time);
-  Scope* new_scope = new Scope(name, cur_time);
+  const uint32_t count = buffer->count;
+  Event& event = buffer->events[count & buffer->mask];
+  event.name = name;
+  event.time = cur_time.QuadPart;
 
-  if (parent_stack_.empty()) {
-    top_level_.push_back(new_scope);
-  } else {
-    parent_stack_.back()->children_.push_back(new_scope);
+  // the event has to be written before the count says it's there. This only stops the compiler
+  // from reordering the stores, which is enough on x86, but not on CPUs that reorder stores
+  _ReadWriteBarrier();
+  buffer->count = count + 1;
+  if (count == buffer->mask) {
+    buffer->full = true;
   }
+}
 
-  parent_stack_.push_back(new_scope);
+void Profiler::enter_scope(const char* name)
+{
+  add_event(name);
 }
 
 void Profiler::leave_scope()
 {
-  if (parent_stack_.empty()) {
-    return;
+  add_event(NULL);
+}
+
+// Copies out the events of a thread, oldest first. The thread might still be recording, so events
+// that could have been overwritten while they were copied are dropped. Like add_event, this relies
+// on x86 not reordering the loads, as _ReadWriteBarrier is only a compiler barrier
+void Profiler::collect(ThreadBuffer* buffer, std::vector<Event>* events)
+{
+  const LONG state = buffer->state;
+  const uint32_t end = buffer->count;
+  const uint32_t len = buffer->full ? buffer->mask + 1 : end;
+  events->resize(len);
+  for (uint32_t i = 0; i < len; ++i) {
+    (*events)[i] = buffer->events[(end - len + i) & buffer->mask];
+  }
+
+  // event n goes in the slot of event n - (mask + 1), so a copied event is gone once the count is
+  // mask past it, as the event being written isn't counted yet. Nothing is overwritten until the
+  // buffer wraps around
+  _ReadWriteBarrier();
+  const uint32_t written = buffer->count - (end - len);
+  const uint32_t overwritten = written > buffer->mask ? written - buffer->mask : 0;
+  events->erase(events->begin(), events->begin() + min(overwritten, len));
+
+  // the thread had exited before we started, so this is all of its events, and the buffer can go
+  // to the next thread
+  if (state == kExited) {
+    InterlockedCompareExchange(&buffer->state, kCollected, kExited);
   }
-  LARGE_INTEGER cur_time;
-  QueryPerformanceCounter(&cur_time);
-  parent_stack_.back()->leave_ = cur_time;
-  parent_stack_.pop_back();
 }
 
-void Profiler::print()
+// Rebuilds the scope trees from a thread's events. Leaves whose enter has been overwritten are
+// skipped, and scopes that are still open end now
+void Profiler::build_scopes(ThreadBuffer* buffer, const LARGE_INTEGER& now, std::list<Scope*>* top_level)
+{
+  std::vector<Event> events;
+  collect(buffer, &events);
+
+  std::vector<Scope*> parent_stack;
+  for (size_t i = 0; i < events.size(); ++i) {
+    const Event& event = events[i];
+    if (event.name == NULL) {
+      if (!parent_stack.empty()) {
+        parent_stack.back()->leave_.QuadPart = event.time;
+        parent_stack.pop_back();
+      }
+      continue;
+    }
+
+    LARGE_INTEGER enter;
+    enter.QuadPart = event.time;
+    Scope* scope = new Scope(event.name, enter);
+    if (parent_stack.empty()) {
+      top_level->push_back(scope);
+    } else {
+      parent_stack.back()->children_.push_back(scope);
+    }
+    parent_stack.push_back(scope);
+  }
+  for (size_t i = 0; i < parent_stack.size(); ++i) {
+    parent_stack[i]->leave_ = now;
+  }
+}
+
+void Profiler::thread_scopes(const DWORD thread_id, std::list<Scope*>* top_level)
 {
-  // Leave the outstanding scopes
-  const uint32_t outstanding_stacks = parent_stack_.size();
-  for (uint32_t i = 0; i < outstanding_stacks; ++i) {
-    leave_scope();
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+
+  // ids are reused, so use the thread with the id that started last
+  ThreadBuffer* found = NULL;
+  for (ThreadBuffer* buffer = buffers_; buffer != NULL; buffer = buffer->next) {
+    if (buffer->thread_id == thread_id && (found == NULL || buffer->thread_order > found->thread_order)) {
+      found = buffer;
+    }
   }
+  if (found != NULL) {
+    build_scopes(found, now, top_level);
+  }
+}
+
+void Profiler::print()
+{
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+
+  for (ThreadBuffer* buffer = buffers_; buffer != NULL; buffer = buffer->next) {
+    std::list<Scope*> top_level;
+    build_scopes(buffer, now, &top_level);
 
-  for (TopLevel::const_iterator it = top_level_.begin(); it != top_level_.end(); ++it) {
-    print_inner(*it, "");
+    if (!top_level.empty()) {
+      LOG_WARNING_LN("Thread %u", buffer->thread_id);
+    }
+    for (std::list<Scope*>::const_iterator it = top_level.begin(); it != top_level.end(); ++it) {
+      print_inner(*it, "  ");
+    }
+    container_delete(top_level);
   }
 }
 
@@ -70,7 +242,6 @@ Profiler::Profiler()
 
 Profiler::~Profiler()
 {
-  container_delete(top_level_);
 }
 
 void Profiler::close()
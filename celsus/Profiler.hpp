@@ -1,18 +1,26 @@
 #ifndef PROFILER_HPP
 #define PROFILER_HPP
 
-#include <deque>
 #include <list>
-#include <stack>
 #include <string>
+#include <vector>
 #include <cassert>
 #include <windows.h>
 #include "celsus.hpp"
 
 // Profiler singleton. Use the SCOPED_PROFILE macro to mark enter/leaving scope
+//
+// Every thread records its enter and leave events into a ring buffer of its own, so recording
+// doesn't lock or allocate, and can be left on in any thread. The buffers only keep the most recent
+// events, and the scope trees are rebuilt from them when they're printed. A buffer outlives its
+// thread, so the events of threads that are gone still get printed, and once they have been, a new
+// thread takes the buffer over. Scope names aren't copied, so they have to outlive the profiler,
+// like string literals and __FUNCTION__ do
 class Profiler
 {
 public:
+  static const uint32_t kDefaultEventCount = 64 * 1024;
+
   struct Scope
   {
     Scope(const char* name, const LARGE_INTEGER& enter) 
@@ -33,35 +41,65 @@ public:
   };
 
   static Profiler& instance();
-  void enter_scope(const char* name);
-  void leave_scope();
+  static void enter_scope(const char* name);
+  static void leave_scope();
+  // Number of events kept by each thread that starts recording after this, rounded up to a power of 2
+  static void set_event_count(const uint32_t count);
   void print();
+  // Rebuilds the scope trees of the most recent thread with the given id. The caller owns the scopes
+  void thread_scopes(const DWORD thread_id, std::list<Scope*>* top_level);
   static void close();
 
 private:
+  struct Event
+  {
+    const char* name;           // NULL when leaving a scope
+    LONGLONG time;
+  };
+
+  enum BufferState { kRecording, kExited, kCollected };
+
+  struct ThreadBuffer
+  {
+    DWORD thread_id;
+    LONG thread_order;          // order the threads started recording in, as ids are reused
+    volatile LONG state;        // a BufferState
+    Event* events;
+    uint32_t mask;              // the buffer holds mask + 1 events
+    volatile uint32_t count;    // of events ever written, so it wraps around
+    volatile bool full;
+    ThreadBuffer* next;
+  };
+
+  static ThreadBuffer* create_thread_buffer();
+  static DWORD fls_index();
+  static void WINAPI thread_exited(void* buffer);
+  static void add_event(const char* name);
+  void collect(ThreadBuffer* buffer, std::vector<Event>* events);
+  void build_scopes(ThreadBuffer* buffer, const LARGE_INTEGER& now, std::list<Scope*>* top_level);
   void print_inner(const Scope* cur, const std::string& indent);
   Profiler();
   ~Profiler();
 
   static Profiler* instance_;
+  static ThreadBuffer* volatile buffers_;
+  static volatile LONG event_count_;
+  static volatile LONG fls_index_;
+  static volatile LONG threads_started_;
 
   LARGE_INTEGER frequency_;
-  typedef std::list<Scope*> TopLevel;
-  typedef std::deque<Scope*> ParentStack;
-  TopLevel top_level_;
-  ParentStack parent_stack_;
 };
 
 struct ScopedScope
 {
   ScopedScope(const char* name)
   {
-    Profiler::instance().enter_scope(name);
+    Profiler::enter_scope(name);
   }
 
   ~ScopedScope()
   {
-    Profiler::instance().leave_scope();
+    Profiler::leave_scope();
   }
 };
 
@@ -22,18 +22,47 @@ StringId::StringId(const char* idString)
 }
 
 
+//*** Constructor ***
+
+StringId::StringId(const StringIdLiteral& literal)
+  : idString_(0)
+{
+  // The hash has already been calculated at compile time, so go straight to the shared table.
+  // Just like for regular strings, the empty string gives the empty id
+  if (literal.get_string()[0])
+  {
+    idString_=StringIdTable::instance().FindIdString(literal.hash(),literal.length(),literal.get_string());
+  }
+}
+
+
 void StringId::set(const char* idString)
 {
   // Only initialize if idString is a non-zero pointer, and of non-zero length
   if (idString && idString[0])
   {
     // Calculate hash value for the string
-    unsigned int hash=StringIdTable::instance().CalculateHash(idString);
+    int length=0;
+    unsigned int hash=StringIdTable::instance().CalculateHash(idString,&length);
 
     // Do a lookup in the shared table to find this string if it already exists, or
     // to insert it into the shared table if it does not
-    idString_=StringIdTable::instance().FindIdString(hash,idString);
+    idString_=StringIdTable::instance().FindIdString(hash,length,idString);
+  }
+}
+
+//*** find ***
+
+StringId StringId::find(const char* idString)
+{
+  StringId id;
+  if (idString && idString[0])
+  {
+    int length=0;
+    unsigned int hash=StringIdTable::instance().CalculateHash(idString,&length);
+    id.idString_=StringIdTable::instance().FindExistingIdString(hash,length,idString);
   }
+  return id;
 }
 
 //*** GetString ***
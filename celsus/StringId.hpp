@@ -30,17 +30,24 @@
 *
 * There's also a couple of macros, strSwitch and strCase, which you can use to emulate
 * the behaviour of the c-language statements "switch" and "case", to make it more easy
-* to do a bunch of comparisons for a single StringId. The strCase macro is written such
-* that it automatically initializes the specified StringId once on the first time it is
-* run, meaning it will always just do a pointer compare on subsequent runs.
+* to do a bunch of comparisons for a single StringId. The strCase macro hashes its
+* string at compile time, so at run time it just compares the hash stored with the
+* StringId against a constant, and only touches the characters when the hashes match.
+*
+* String literals can be hashed at compile time in general by wrapping them in a
+* StringIdLiteral. The compile time hash is the same as the one the string table
+* calculates at run time, so literals and StringIds can be freely compared and mixed,
+* and a StringId created from a literal skips the hashing step.
 */
 
 #ifndef __StringId_H__
 #define __StringId_H__
 
 // Includes
+#include <string.h>
 
 // External classes
+class StringIdLiteral;
 
 // StringId
 class StringId
@@ -63,6 +70,14 @@ public:
     const char* idString	///< The string to use for identifier
     );
 
+  /**
+  * Constructor. Looks up the string of the literal in the shared string table,
+  * using the hash value that was calculated at compile time.
+  */
+  StringId(
+    const StringIdLiteral& literal	///< The string literal to use for identifier
+    );
+
   /**
   * Used to retrieve the original, c-style string (const char*) for this StringId.
   *
@@ -72,6 +87,31 @@ public:
 
   void set(const char* idString);
 
+  /**
+  * Looks up the specified string in the shared string table, without adding it
+  * if it isn't there. Use this for strings that only need to be matched against
+  * existing ids, like user input, so the table doesn't keep growing with strings
+  * nothing will ever refer to again. Allocates nothing.
+  *
+  * \returns The id for the string, or the empty id if the string isn't in the table
+  */
+  static StringId find(
+    const char* idString	///< The string to look up
+    );
+
+  /**
+  * Used to retrieve the hash value of the string, as calculated by the shared
+  * string table. The hash is stored along with the shared string, so this is
+  * just a memory read.
+  *
+  * \returns The hash value for this id, or 0 for the empty id
+  */
+  unsigned int hash() const
+  {
+    // The shared string table stores the hash number in the four bytes preceding the string
+    return idString_ ? *((const unsigned int*)idString_-1) : 0;
+  }
+
 
   /**
   * Copy constructor. Just duplicates the internally stored hash value and string
@@ -105,15 +145,121 @@ public:
     const StringId& stringId
     ) const;
 
+  /**
+  * Comparison operation (equality) against a literal. Compares the hash values
+  * first, so the characters are only compared if the hashes match.
+  */
+  bool operator==(
+    const StringIdLiteral& literal
+    ) const;
+
+  bool operator!=(
+    const StringIdLiteral& literal
+    ) const;
+
   bool operator<(const StringId& rhs) const {
     return idString_ < rhs.idString_;
   }
 
 private:
+  // intern_batch and StringIdScope fill in ids directly, as they have already done the lookups
+  friend class StringIdTable;
+  friend class StringIdScope;
+
   const char* idString_;	///< Pointer to the (shared) string for this id
 };
 
 
+//*** Compile time hashing of string literals ***
+
+namespace string_id_detail
+{
+  // Same as toupper in the "C" locale, but simple enough for the compiler to fold
+  __forceinline int to_upper(const char ch)
+  {
+    return (ch >= 'a' && ch <= 'z') ? ch - ('a' - 'A') : ch;
+  }
+
+  // Case insensitive compare with the same ASCII folding as the hash, so it agrees with the
+  // string table whatever the locale is
+  inline bool equal_no_case(const char* a, const char* b)
+  {
+    for (; *a && to_upper(*a) == to_upper(*b); ++a, ++b)
+    {
+    }
+    return *a == *b;
+  }
+
+  // The djb2 hash from StringIdTable::CalculateHash, unrolled over the N characters of a
+  // literal. As the length is known, every step can be folded to a constant
+  template<int N>
+  struct LiteralHash
+  {
+    static __forceinline unsigned int calc(const char* str)
+    {
+      const unsigned int hash=LiteralHash<N-1>::calc(str);
+      return ((hash << 5) + hash) ^ to_upper(str[N-1]);
+    }
+  };
+
+  template<>
+  struct LiteralHash<0>
+  {
+    static __forceinline unsigned int calc(const char*)
+    {
+      return 5381; // Seed value
+    }
+  };
+}
+
+/**
+* \ingroup core
+* \brief String literal with its StringId hash calculated at compile time
+*
+* Can only be constructed from a string literal (or other char array), as the length
+* of the string has to be known at compile time for the hash to be folded away. The
+* constructor is explicit, so comparing a StringId with a plain literal still goes
+* through StringId(const char*), instead of being ambiguous.
+*/
+class StringIdLiteral
+{
+public:
+  template<int N>
+  explicit __forceinline StringIdLiteral(
+    const char (&idString)[N]	///< The string literal, the terminator is not included in the hash
+    )
+    : hash_(N>1 ? string_id_detail::LiteralHash<N-1>::calc(idString) : 0) // "" is the empty id, with hash 0
+    , length_(N-1)
+    , idString_(idString)
+  {
+  }
+
+  unsigned int hash() const { return hash_; }
+  int length() const { return length_; }
+  const char* get_string() const { return idString_; }
+
+private:
+  unsigned int hash_;	///< Hash value, identical to the one calculated by the shared string table
+  int length_;	///< Length of the literal, not counting the terminator
+  const char* idString_;	///< Pointer to the literal itself (not the shared string)
+};
+
+
+inline bool StringId::operator==(const StringIdLiteral& literal) const
+{
+  if (!idString_)
+  {
+    return literal.length()==0;
+  }
+  return hash()==literal.hash() && string_id_detail::equal_no_case(idString_,literal.get_string());
+}
+
+inline bool StringId::operator!=(const StringIdLiteral& literal) const
+{
+  return !(*this==literal);
+}
+
+
 //*** Helper macros for working with StringIds ***
 
 /**
@@ -140,18 +286,19 @@ private:
 *
 * The above is the equivalent of doing:
 *
-*		static StringId applesId("Apples");
-*		if (myFruitTypeStringId==applesId)
+*		if (myFruitTypeStringId==StringIdLiteral("Apples"))
 *			{
 *			// code to do stuff here
 *			}
 *
-*		static StringId orangesId("Oranges");
-*		if (myFruitTypeStringId==orangesId)
+*		if (myFruitTypeStringId==StringIdLiteral("Oranges"))
 *			{
 *			// code to do other stuff here
 *			}
 *
+* The hashes of "Apples" and "Oranges" are calculated at compile time, so there are no
+* lookups and no function-local statics with their initialization checks.
+*
 * Note that you can't have to strSwitch blocks within the same code block, and you
 * can't test for the same strCase more than once in the same strSwitch. The internal
 * variable names of the macros have been chosen to indicate these errors in case it
@@ -168,8 +315,8 @@ private:
 * Used in conjunction with the strSwitch macro (see strSwitch for further info)
 */
 #define strCase(stringId)																					\
-  static StringId _duplicate_strCase_statement_##stringId(#stringId);										\
-  if (_duplicate_strCase_statement_##stringId==_multiple_strSwitch_not_allowed_within_one_code_block_)	\
+  enum { _duplicate_strCase_statement_##stringId };															\
+  if (_multiple_strSwitch_not_allowed_within_one_code_block_==StringIdLiteral(#stringId))				\
 
 
 #endif /* __StringId_H__ */
@@ -0,0 +1,277 @@
+#ifndef STRING_ID_MAP_HPP
+#define STRING_ID_MAP_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <utility>
+#include "StringId.hpp"
+#include "ErrorHandling.hpp"
+
+// Hash map keyed by StringId. As StringIds are interned, two keys are the same exactly when
+// their string pointers are, so the map hashes and compares the pointers themselves, without
+// ever touching the characters. Uses open addressing with linear probing, with the keys and
+// the values in two contiguous arrays, so there is no allocation per entry, and a lookup
+// usually costs a single cache miss in the key array.
+// Erasing shifts the following entries of the probe run back, so there are no tombstones, but
+// it does invalidate iterators.
+template<typename V>
+class StringIdMap
+{
+public:
+  class iterator
+  {
+  public:
+    iterator() : _map(nullptr), _idx(0) {}
+    iterator(StringIdMap* map, int idx) : _map(map), _idx(idx) { skip_empty(); }
+
+    const StringId& key() const { return _map->_keys[_idx]; }
+    V& value() const { return _map->_values[_idx]; }
+
+    iterator& operator++() { ++_idx; skip_empty(); return *this; }
+    bool operator==(const iterator& rhs) const { return _idx == rhs._idx; }
+    bool operator!=(const iterator& rhs) const { return _idx != rhs._idx; }
+
+  private:
+    void skip_empty() { while (_idx < _map->_capacity && _map->_keys[_idx] == StringId()) ++_idx; }
+
+    StringIdMap* _map;
+    int _idx;
+  };
+
+  class const_iterator
+  {
+  public:
+    const_iterator() : _map(nullptr), _idx(0) {}
+    const_iterator(const StringIdMap* map, int idx) : _map(map), _idx(idx) { skip_empty(); }
+
+    const StringId& key() const { return _map->_keys[_idx]; }
+    const V& value() const { return _map->_values[_idx]; }
+
+    const_iterator& operator++() { ++_idx; skip_empty(); return *this; }
+    bool operator==(const const_iterator& rhs) const { return _idx == rhs._idx; }
+    bool operator!=(const const_iterator& rhs) const { return _idx != rhs._idx; }
+
+  private:
+    void skip_empty() { while (_idx < _map->_capacity && _map->_keys[_idx] == StringId()) ++_idx; }
+
+    const StringIdMap* _map;
+    int _idx;
+  };
+
+  StringIdMap()
+    : _keys(nullptr)
+    , _values(nullptr)
+    , _capacity(0)
+    , _bits(0)
+    , _size(0)
+  {
+  }
+
+  StringIdMap(const StringIdMap& rhs)
+    : _keys(nullptr)
+    , _values(nullptr)
+    , _capacity(0)
+    , _bits(0)
+    , _size(0)
+  {
+    *this = rhs;
+  }
+
+  ~StringIdMap()
+  {
+    clear();
+    free(_keys);
+    free(_values);
+  }
+
+  StringIdMap& operator=(const StringIdMap& rhs)
+  {
+    if (this != &rhs) {
+      clear();
+      reserve(rhs._size);
+      for (const_iterator i = rhs.begin(), e = rhs.end(); i != e; ++i)
+        insert(i.key(), i.value());
+    }
+    return *this;
+  }
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, _capacity); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, _capacity); }
+
+  int size() const { return _size; }
+  bool empty() const { return _size == 0; }
+
+  // Returns a pointer to the value for the key, or nullptr if the key isn't in the map
+  V* find(const StringId& key)
+  {
+    const int idx = find_index(key);
+    return idx == -1 ? nullptr : &_values[idx];
+  }
+
+  const V* find(const StringId& key) const
+  {
+    const int idx = find_index(key);
+    return idx == -1 ? nullptr : &_values[idx];
+  }
+
+  bool contains(const StringId& key) const { return find_index(key) != -1; }
+
+  // Returns the value for the key, inserting a default constructed one if the key isn't in the map
+  V& operator[](const StringId& key)
+  {
+    const int idx = find_index(key);
+    if (idx != -1)
+      return _values[idx];
+    // inserting can reallocate _values, so don't index it until afterwards
+    const int new_idx = insert_new(key, V());
+    return _values[new_idx];
+  }
+
+  // Inserts the value if the key isn't already in the map. Returns false if it was
+  bool insert(const StringId& key, const V& value)
+  {
+    if (find_index(key) != -1)
+      return false;
+    insert_new(key, value);
+    return true;
+  }
+
+  // Removes the key from the map. Returns false if it wasn't in the map
+  bool erase(const StringId& key)
+  {
+    int idx = find_index(key);
+    if (idx == -1)
+      return false;
+
+    _values[idx].~V();
+    _keys[idx] = StringId();
+    --_size;
+
+    // Move back any entries further along the probe run that could have used the slot we just freed,
+    // so lookups never have to step over holes
+    const int mask = _capacity - 1;
+    int cur = (idx + 1) & mask;
+    while (_keys[cur] != StringId()) {
+      const int home = slot_for(_keys[cur]);
+      // the entry can move to the hole if its home slot isn't cyclically in (idx, cur]
+      if (((cur - home) & mask) >= ((cur - idx) & mask)) {
+        _keys[idx] = _keys[cur];
+        new (&_values[idx]) V(std::move(_values[cur]));
+        _values[cur].~V();
+        _keys[cur] = StringId();
+        idx = cur;
+      }
+      cur = (cur + 1) & mask;
+    }
+    return true;
+  }
+
+  void clear()
+  {
+    for (int i = 0; i < _capacity; ++i) {
+      if (_keys[i] != StringId()) {
+        _values[i].~V();
+        _keys[i] = StringId();
+      }
+    }
+    _size = 0;
+  }
+
+  // Makes room for count entries, so they can be inserted without the arrays being reallocated
+  void reserve(int count)
+  {
+    // stay below 3/4 full, to keep the probe runs short
+    int capacity = _capacity ? _capacity : kMinCapacity;
+    while (count >= capacity - capacity / 4)
+      capacity *= 2;
+    if (capacity > _capacity)
+      rehash(capacity);
+  }
+
+private:
+  static const int kMinCapacity = 8;
+
+  int slot_for(const StringId& key) const
+  {
+    // Fibonacci hashing of the interned pointer. The low bits of the pointer are always the same,
+    // so multiply them up into the high bits, and use those
+    const uint32_t p = (uint32_t)(uintptr_t)key.get_string();
+    return (int)((p * 2654435769u) >> (32 - _bits));
+  }
+
+  int find_index(const StringId& key) const
+  {
+    if (_size == 0 || key == StringId())
+      return -1;
+
+    const int mask = _capacity - 1;
+    for (int idx = slot_for(key); _keys[idx] != StringId(); idx = (idx + 1) & mask) {
+      if (_keys[idx] == key)
+        return idx;
+    }
+    return -1;
+  }
+
+  int insert_new(const StringId& key, const V& value)
+  {
+    SUPER_ASSERT(key != StringId());
+    if (_size + 1 >= _capacity - _capacity / 4) {
+      // value could live in the map itself, so take a copy before growing moves it
+      const V tmp(value);
+      reserve(_size + 1);
+      return insert_new(key, tmp);
+    }
+
+    const int mask = _capacity - 1;
+    int idx = slot_for(key);
+    while (_keys[idx] != StringId())
+      idx = (idx + 1) & mask;
+
+    _keys[idx] = key;
+    new (&_values[idx]) V(value);
+    ++_size;
+    return idx;
+  }
+
+  void rehash(const int capacity)
+  {
+    StringId* old_keys = _keys;
+    V* old_values = _values;
+    const int old_capacity = _capacity;
+
+    _keys = (StringId*)malloc(capacity * sizeof(StringId));
+    _values = (V*)malloc(capacity * sizeof(V));
+    for (int i = 0; i < capacity; ++i)
+      new (&_keys[i]) StringId();
+    _capacity = capacity;
+    _bits = 0;
+    while ((1 << _bits) < capacity)
+      ++_bits;
+
+    const int mask = _capacity - 1;
+    for (int i = 0; i < old_capacity; ++i) {
+      if (old_keys[i] != StringId()) {
+        int idx = slot_for(old_keys[i]);
+        while (_keys[idx] != StringId())
+          idx = (idx + 1) & mask;
+        _keys[idx] = old_keys[i];
+        new (&_values[idx]) V(std::move(old_values[i]));
+        old_values[i].~V();
+      }
+    }
+
+    free(old_keys);
+    free(old_values);
+  }
+
+  StringId* _keys;
+  V* _values;
+  int _capacity;  // always 0 or a power of two
+  int _bits;      // log2 of _capacity
+  int _size;
+};
+
+#endif
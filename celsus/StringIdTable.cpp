@@ -1,76 +1,134 @@
 //*** StringIdTable.cpp ***/
 #include <stdafx.h>
 #include <string.h>
-#include <ctype.h>
+#include <emmintrin.h>
 #include "celsus.hpp"
 #include "StringIdTable.hpp"
+#include "StringId.hpp"
+#include "MemoryMappedFile.hpp"
+#include "file_utils.hpp"
+#include "Logger.hpp"
 
 
-StringIdTable* StringIdTable::instance_ = NULL;
+StringIdTable* volatile StringIdTable::instance_ = NULL;
 
 
 //*** GetInstance ***
 
 StringIdTable& StringIdTable::instance()
 {
-  if (instance_ == NULL) {
-    instance_ = new StringIdTable();
-    atexit(close);
+  // Fast path, the table has already been created
+  StringIdTable* table=instance_;
+  if (table != NULL) {
+    return *table;
   }
-  return *instance_;
+
+  // Several threads can get here at the same time. Each creates a table, and the one
+  // that manages to publish it first wins. The others throw theirs away
+  StringIdTable* newTable=new StringIdTable();
+  table=(StringIdTable*)InterlockedCompareExchangePointer((PVOID volatile*)&instance_, newTable, NULL);
+  if (table != NULL) {
+    delete newTable;
+    return *table;
+  }
+
+  atexit(close);
+  return *newTable;
 }
 
 void StringIdTable::close()
 {
-  SAFE_DELETE(instance_);
+  StringIdTable* table=(StringIdTable*)InterlockedExchangePointer((PVOID volatile*)&instance_, NULL);
+  SAFE_DELETE(table);
 }
 
 //*** Constructor ***
 
-StringIdTable::StringIdTable():
-stringStorageBlockCount_(0),
-stringStorageBlockMaxCount_(8),
-idStringTableSlots_(256),	///< Note - with this implementation of a hash table, using a prime number of slots gives no benefit over power-of-two number of slots
-idStringTableItemCount_(0)
+StringIdTable::StringIdTable()
+  : snapshot_(NULL)
+  , snapshotFile_(NULL)
 {
-  // Allocate the array which stores the string block info
-  stringStorageBlocks_=(StringStorageBlock*)malloc(stringStorageBlockMaxCount_*sizeof(StringStorageBlock));
-
-  // Allocated the first string block
-  stringStorageBlocks_[0].head=(char*)malloc(stringStorageBlockSize_);
-  stringStorageBlocks_[0].tail=stringStorageBlocks_[0].head;
-  stringStorageBlockCount_++; 
+  for (int i=0; i<shardCount_; i++)
+  {
+    InitShard(shards_[i]);
+  }
 
-  // Allocate the hash table
-  idStringTable_=(char**)malloc(sizeof(char*)*idStringTableSlots_);
+#ifdef STRING_ID_TABLE_COUNTERS
+  QueryPerformanceCounter(&countersResetTime_);
+#endif
+}
 
-  // Mark all the slots of the string table as unused
-  for (int i=0; i<idStringTableSlots_; i++)
+StringIdTable::~StringIdTable()
+{
+  for (int i=0; i<shardCount_; i++)
   {
-    idStringTable_[i]=0;
+    FreeShard(shards_[i]);
   }
 
+  // Unmap the snapshot, if one was loaded
+  SAFE_DELETE(snapshotFile_);
 }
 
-StringIdTable::~StringIdTable()
+
+//*** InitShard ***
+
+void StringIdTable::InitShard(Shard& shard)
+{
+  InitializeCriticalSection(&shard.lock);
+
+  // Allocate the hash table. Note - with this implementation of a hash table, using a prime number of slots gives no benefit over power-of-two number of slots
+  shard.table=CreateSlotTable(initialShardSlots_);
+  shard.migratingTable=NULL;
+  shard.migratedSlots=0;
+  shard.generation=0;
+  shard.retiredTables=NULL;
+  shard.itemCount=0;
+  shard.rehashCount=0;
+#ifdef STRING_ID_TABLE_COUNTERS
+  shard.lookupCount=0;
+  shard.insertCount=0;
+#endif
+
+  // Allocate the array which stores the string block info. The blocks themselves are allocated
+  // on first use, so shards that never see a string don't cost a full block
+  shard.stringStorageBlockMaxCount=8;
+  shard.stringStorageBlockCount=0;
+  shard.stringStorageBlocks=(StringStorageBlock*)malloc(shard.stringStorageBlockMaxCount*sizeof(StringStorageBlock));
+}
+
+
+//*** FreeShard ***
+
+void StringIdTable::FreeShard(Shard& shard)
 {
   // Free all the string storage blocks
-  if (stringStorageBlocks_ != NULL) {
-    for (int i=0; i<stringStorageBlockCount_; i++)
+  if (shard.stringStorageBlocks != NULL) {
+    for (int j=0; j<shard.stringStorageBlockCount; j++)
     {
-      SAFE_FREE(stringStorageBlocks_[i].head);
+      SAFE_FREE(shard.stringStorageBlocks[j].head);
     }
   }
 
   // Free the array holding the string storage block info
-  SAFE_FREE(stringStorageBlocks_);
-  SAFE_FREE(idStringTable_);
+  SAFE_FREE(shard.stringStorageBlocks);
+
+  // Free the current slot table, and all the ones it replaced
+  while (shard.retiredTables)
+  {
+    SlotTable* next=shard.retiredTables->retired;
+    free(shard.retiredTables);
+    shard.retiredTables=next;
+  }
+  SAFE_FREE(shard.migratingTable);
+  SAFE_FREE(shard.table);
+
+  DeleteCriticalSection(&shard.lock);
 }
 
 
 //*** CalculateHash ***
 
-unsigned int StringIdTable::CalculateHash(const char* idString) const
+unsigned int StringIdTable::CalculateHash(const char* idString, int* length) const
 {
   unsigned long hash = 5381; // Seed value
 
@@ -78,154 +136,799 @@ unsigned int StringIdTable::CalculateHash(const char* idString) const
   const char* stringData=idString;
   while (*stringData)
   {
-    // A little bit-manipulation magic to get a nice distribution of values
-    hash = ((hash << 5) + hash) ^ toupper(*stringData);
+    // A little bit-manipulation magic to get a nice distribution of values. The case folding is the
+    // same one StringIdLiteral uses at compile time, so the two always agree, whatever the CRT's
+    // toupper does with characters outside of ASCII
+    hash = ((hash << 5) + hash) ^ string_id_detail::to_upper(*stringData);
     stringData++;
   }
 
+  // Return the length too, as we get it for free, and the lookup uses it to rule out strings quickly
+  if (length)
+  {
+    *length=(int)(stringData-idString);
+  }
+
   // Return the final hash value
   return hash;
 }
 
 
-//*** FindIdString ***
+//*** CreateSlotTable ***
 
-const char* StringIdTable::FindIdString(unsigned int hash, const char* idString)
+StringIdTable::SlotTable* StringIdTable::CreateSlotTable(int slots)
 {
-  // Find slot for this string. This simply uses the passed in hash value, and modulates it by the number of slots. 
-  // Note that as the number of slots is always a power-of-two-number, we can use a binary AND instead of modulo
-  unsigned int slot=hash&(idStringTableSlots_-1);
+  // Allocate memory for the header and the slots in one go (the header already holds one slot)
+  SlotTable* table=(SlotTable*)malloc(sizeof(SlotTable)+sizeof(char*)*(slots-1));
+  table->slots=slots;
+  table->retired=NULL;
 
-  // Loop through all the entries until we find the one we are looking for or an empty slot
-  char* entry=idStringTable_[slot];
+  // Mark all the slots of the string table as unused
+  for (int i=0; i<slots; i++)
+  {
+    table->entries[i]=0;
+  }
+
+  return table;
+}
+
+
+//*** LookupIdString ***
+
+const char* StringIdTable::LookupIdString(const SlotTable* table, unsigned int hash, int length, const char* idString)
+{
+  // Find slot for this string. The low bits of the hash have already been used to pick the shard, so
+  // we use the bits above them. As the number of slots is always a power-of-two-number, we can use a
+  // binary AND instead of modulo
+  const unsigned int mask=table->slots-1;
+  unsigned int slot=(hash>>shardBits_)&mask;
+
+  // Loop through all the entries until we find the one we are looking for or an empty slot. Entries are
+  // only published once the string has been fully written, so anything we see here is safe to read
+  const char* entry=table->entries[slot];
   while(entry)
-  {  
+  {
     // Is this the one we're looking for?
-    unsigned int strhash=(*((unsigned int*)entry));
-    if (strhash==hash && _stricmp(entry+4,idString)==0)
+    if (EntryMatches(entry, hash, length, idString))
     {
       // Yes, so we just return the shared idString
-      return entry+4; // Skip the first four bytes, as that's the hash number
+      return entry+sizeof(EntryHeader); // Skip the header, the string follows right after it
     }
 
     // Not found the one we're looking for, so continue with the next entry 
-    slot=(slot+1)&(idStringTableSlots_-1);
-    entry=idStringTable_[slot];
+    slot=(slot+1)&mask;
+    entry=table->entries[slot];
   }
 
-  // We didn't find an entry for that string, so we need to add it
+  return NULL;
+}
 
-  // If the table is more than two-thirds full, double its size and reinsert the strings
-  if (idStringTableItemCount_>=(idStringTableSlots_-(idStringTableSlots_/3)))
-  {
-    // Make the new table twice the size
-    int newidStringTableSlots=idStringTableSlots_*2;
 
-    // Allocate memory for it
-    char** newIdStringTable=(char**)malloc(sizeof(char*)*newidStringTableSlots);
+//*** EntryMatches ***
 
-    // And initialize all slots to unused
-    for (int i=0; i<newidStringTableSlots; i++)
+bool StringIdTable::EntryMatches(const char* entry, unsigned int hash, int length, const char* idString)
+{
+  // Compare the hash numbers and lengths first, as that rules out almost every other string without
+  // touching the characters
+  const EntryHeader* header=(const EntryHeader*)entry;
+  if (header->hash!=hash || header->length!=(unsigned int)length)
+  {
+    return false;
+  }
+
+  // This is almost certainly the string we're looking for, so compare against the upper case copy stored
+  // after the string. Only our side needs folding, which we do 16 characters at a time
+  const char* folded=entry+sizeof(EntryHeader)+length+1;
+  const __m128i lowerA=_mm_set1_epi8('a'-1);
+  const __m128i lowerZ=_mm_set1_epi8('z'+1);
+  const __m128i caseBit=_mm_set1_epi8('a'-'A');
+  int i=0;
+  for (; i+16<=length; i+=16)
+  {
+    // Subtract the case bit from every character in a..z. Characters outside of ASCII are negative
+    // as signed bytes, so they are left alone, just like string_id_detail::to_upper does
+    const __m128i chars=_mm_loadu_si128((const __m128i*)(idString+i));
+    const __m128i isLower=_mm_and_si128(_mm_cmpgt_epi8(chars,lowerA),_mm_cmplt_epi8(chars,lowerZ));
+    const __m128i upper=_mm_sub_epi8(chars,_mm_and_si128(isLower,caseBit));
+    const __m128i stored=_mm_loadu_si128((const __m128i*)(folded+i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(upper,stored))!=0xffff)
     {
-      newIdStringTable[i]=0;
+      return false;
     }
+  }
 
-    // Reinsert all the existing strings into the new table
-    for (int i=0; i<idStringTableSlots_; i++)
+  // And the last few characters one at a time
+  for (; i<length; i++)
+  {
+    if (string_id_detail::to_upper(idString[i])!=folded[i])
     {
-      // If slot is in use
-      if (idStringTable_[i])
-      {				
-        // Get hash for string (stored as first four bytes of the string)
-        unsigned int existinghash=(*((unsigned int*)idStringTable_[i]));
+      return false;
+    }
+  }
 
-        // Calculate the slot
-        int newslot=existinghash&(newidStringTableSlots-1);
+  return true;
+}
 
-        // Find the nearest unused slot
-        while (newIdStringTable[newslot])
-        {
-          newslot=(newslot+1)&(newidStringTableSlots-1);
-        }
 
-        // Store the string in the new table
-        newIdStringTable[newslot]=idStringTable_[i];
-      }
+//*** LookupSnapshot ***
+
+const char* StringIdTable::LookupSnapshot(unsigned int hash, int length, const char* idString) const
+{
+  const SnapshotHeader* snapshot=snapshot_;
+  if (!snapshot)
+  {
+    return NULL;
+  }
+
+  // The slots follow right after the header, and hold offsets from the start of the snapshot, with 0 for unused
+  const char* base=(const char*)snapshot;
+  const unsigned int* slots=(const unsigned int*)(snapshot+1);
+  const unsigned int mask=snapshot->slots-1;
+  unsigned int slot=hash&mask;
+
+  // Same linear probing as in the live tables
+  while (slots[slot])
+  {
+    const char* entry=base+slots[slot];
+    if (EntryMatches(entry, hash, length, idString))
+    {
+      return entry+sizeof(EntryHeader); // Skip the header, the string follows right after it
     }
+    slot=(slot+1)&mask;
+  }
+
+  return NULL;
+}
 
-    // Free memory used by the old table
-    free(idStringTable_);
 
-    // And replace the old table with the new one
-    idStringTableSlots_=newidStringTableSlots;
-    idStringTable_=newIdStringTable;
+//*** LookupShard ***
 
-    // Calculate the new slot for the string we're currently inserting
-    slot=hash&(idStringTableSlots_-1);
+const char* StringIdTable::LookupIdString(const Shard& shard, unsigned int hash, int length, const char* idString)
+{
+  for (;;)
+  {
+    const LONG generation=shard.generation;
+    const SlotTable* table=shard.table;
+    const SlotTable* migrating=shard.migratingTable;
+
+    // Strings inserted since the last resize are only in the current table, so check that first. While
+    // a resize is in progress the previous table still holds every string that hasn't been moved yet
+    const char* existing=LookupIdString(table, hash, length, idString);
+    if (!existing && migrating)
+    {
+      existing=LookupIdString(migrating, hash, length, idString);
+    }
+    if (existing)
+    {
+      return existing;
+    }
 
-    // And find the nearest empty slot
-    while (idStringTable_[slot])
+    // A migration that finished while we were probing could have moved the string into the current
+    // table behind us, so only trust a miss if the tables are still the ones we looked at
+    if (generation==shard.generation && table==shard.table && migrating==shard.migratingTable)
     {
-      slot=(slot+1)&(idStringTableSlots_-1);
+      return NULL;
     }
   }
+}
+
+
+//*** FindExistingIdString ***
+
+const char* StringIdTable::FindExistingIdString(unsigned int hash, int length, const char* idString)
+{
+  // Strings from the snapshot never change, so they can always be looked up without locking
+  const char* existing=LookupSnapshot(hash, length, idString);
+  if (existing)
+  {
+    return existing;
+  }
+
+  Shard& shard=shards_[hash&(shardCount_-1)];
+
+#ifdef STRING_ID_TABLE_COUNTERS
+  InterlockedIncrement(&shard.lookupCount);
+#endif
+
+  return LookupIdString(shard, hash, length, idString);
+}
+
+
+//*** FindIdString ***
+
+const char* StringIdTable::FindIdString(unsigned int hash, int length, const char* idString)
+{
+  // Most lookups are for strings that are already in the table, so first try without taking the lock
+  const char* existing=FindExistingIdString(hash, length, idString);
+  if (existing)
+  {
+    return existing;
+  }
+
+  return InsertIdString(shards_[hash&(shardCount_-1)], hash, length, idString);
+}
+
+
+//*** InsertIdString ***
+
+const char* StringIdTable::InsertIdString(Shard& shard, unsigned int hash, int length, const char* idString)
+{
+  // Another thread might have added the same string, or resized the table, since we looked, so look
+  // again now that we own the shard
+  SCOPED_CS(&shard.lock);
+  const char* existing=LookupIdString(shard, hash, length, idString);
+  if (existing)
+  {
+    return existing;
+  }
+
+  // Move a few more slots over from the previous table if a resize is in progress. This spreads the
+  // cost of a resize over the inserts that follow it, instead of paying for it all in one call
+  if (shard.migratingTable)
+  {
+    MigrateSlots(shard, migrateSlotsPerInsert_);
+  }
+
+  // If the table is more than two-thirds full, start moving the strings over to a table twice the size
+  if (shard.itemCount>=(shard.table->slots-(shard.table->slots/3)))
+  {
+    ResizeShard(shard, shard.table->slots*2, true);
+  }
 
   // Create a duplicate of the string
-  char* newEntry=StoreString(hash, idString); 
+  char* newEntry=StoreString(shard, hash, length, idString);
 
-  // And store it in the table
-  idStringTable_[slot]=newEntry;
+  // And store it in the current table. Publishing it is a full barrier, so lock free readers never
+  // see the entry before the string has been written
+  InsertEntry(shard.table, newEntry);
 
   // Increase the total number of items stored
-  idStringTableItemCount_++;
+  shard.itemCount++;
+#ifdef STRING_ID_TABLE_COUNTERS
+  InterlockedIncrement(&shard.insertCount);
+#endif
 
   // Return the shared id string
-  return newEntry+4;	// Skip the first four bytes, as that's the hash number
+  return newEntry+sizeof(EntryHeader);	// Skip the header, the string follows right after it
 }
 
 
-//*** StoreString ***
+//*** reserve ***
 
-char* StringIdTable::StoreString(unsigned int hash, const char* string)
+void StringIdTable::reserve(int count)
 {
-  // Get the length of the string
-  int length=(int)strlen(string);
+  // Strings are spread evenly over the shards, so each one needs room for its share, with a little
+  // extra as the spread is never perfect
+  const int shardCount=count/shardCount_+count/(shardCount_*8)+1;
 
-  // Calculate space needed to store the string
-  int spaceNeeded=length+1+4; // Add space for terminator (1) and for storing hash number (4)
+  for (int i=0; i<shardCount_; i++)
+  {
+    Shard& shard=shards_[i];
+    SCOPED_CS(&shard.lock);
+
+    // Find the smallest table that holds the strings while staying below two-thirds full
+    int slots=shard.table->slots;
+    while (shardCount>=(slots-(slots/3)))
+    {
+      slots*=2;
+    }
+
+    if (slots>shard.table->slots)
+    {
+      // The whole point of reserving is to pay for the resize up front, so don't spread this one out
+      ResizeShard(shard, slots, false);
+    }
+  }
+}
+
+
+//*** intern_batch ***
+
+void StringIdTable::intern_batch(const char** strs, size_t n, StringId* out)
+{
+  unsigned int hashes[internBatchSize_];
+  int lengths[internBatchSize_];
+
+  // Work through the strings a group at a time, so everything we gather about a group stays on the stack
+  for (size_t start=0; start<n; start+=internBatchSize_)
+  {
+    const int count=(int)min(n-start, (size_t)internBatchSize_);
+    const char** groupStrs=strs+start;
+    StringId* groupOut=out+start;
+
+    // First hash every string. This only touches the strings themselves, which the caller has most likely
+    // just written, so it runs at full speed
+    for (int i=0; i<count; i++)
+    {
+      const char* idString=groupStrs[i];
+      lengths[i]=0;
+      hashes[i]=(idString && idString[0]) ? CalculateHash(idString, &lengths[i]) : 0;
+    }
+
+    // Then request the slot each string maps to, in the snapshot and in its shard. The slot tables can be
+    // swapped by other threads at any time, but a prefetch is only a hint, so a stale address does no harm
+    const SnapshotHeader* snapshot=snapshot_;
+    for (int i=0; i<count; i++)
+    {
+      if (!lengths[i])
+      {
+        continue;
+      }
+      const unsigned int hash=hashes[i];
+      if (snapshot)
+      {
+        const unsigned int* slots=(const unsigned int*)(snapshot+1);
+        _mm_prefetch((const char*)&slots[hash&(snapshot->slots-1)], _MM_HINT_T0);
+      }
+      const SlotTable* table=shards_[hash&(shardCount_-1)].table;
+      _mm_prefetch((const char*)&table->entries[(hash>>shardBits_)&(table->slots-1)], _MM_HINT_T0);
+    }
+
+    // By now the first slots have arrived, so follow them and request the entries they point to, which is
+    // where the lookups compare the hash and length. Only the shard tables are followed, as a string that
+    // is in the snapshot is found without ever looking at the shards
+    for (int i=0; i<count; i++)
+    {
+      if (!lengths[i])
+      {
+        continue;
+      }
+      const unsigned int hash=hashes[i];
+      const SlotTable* table=shards_[hash&(shardCount_-1)].table;
+      const char* entry=table->entries[(hash>>shardBits_)&(table->slots-1)];
+      if (entry)
+      {
+        _mm_prefetch(entry, _MM_HINT_T0);
+      }
+    }
+
+    // And finally do the actual lookups, which should now mostly hit the cache
+    for (int i=0; i<count; i++)
+    {
+      groupOut[i].idString_=lengths[i] ? FindIdString(hashes[i], lengths[i], groupStrs[i]) : NULL;
+    }
+  }
+}
+
+
+//*** save_snapshot ***
+
+bool StringIdTable::save_snapshot(const char* filename)
+{
+  // Gather all the stored entries. The entries themselves never move, so it's enough to hold each shard
+  // lock while going through its table
+  std::vector<const char*> entries;
+  if (const SnapshotHeader* snapshot=snapshot_)
+  {
+    const unsigned int* slots=(const unsigned int*)(snapshot+1);
+    for (unsigned int i=0; i<snapshot->slots; i++)
+    {
+      if (slots[i])
+      {
+        entries.push_back((const char*)snapshot+slots[i]);
+      }
+    }
+  }
+
+  for (int i=0; i<shardCount_; i++)
+  {
+    Shard& shard=shards_[i];
+    SCOPED_CS(&shard.lock);
+
+    // Finish any resize in progress, so the current table holds every string of the shard
+    if (shard.migratingTable)
+    {
+      MigrateSlots(shard, shard.migratingTable->slots);
+    }
+
+    const SlotTable* table=shard.table;
+    for (int j=0; j<table->slots; j++)
+    {
+      const char* entry=table->entries[j];
+      if (entry)
+      {
+        entries.push_back(entry);
+      }
+    }
+  }
+
+  // Keep the snapshot table below two-thirds full, just like the live tables
+  unsigned int slots=initialShardSlots_;
+  while (entries.size()>=(slots-(slots/3)))
+  {
+    slots*=2;
+  }
+
+  // Work out how much space the strings need. Each entry is kept four byte aligned, so the header
+  // in front of it can be read directly from the mapped file
+  size_t stringsSize=0;
+  for (size_t i=0; i<entries.size(); i++)
+  {
+    stringsSize+=(EntrySize(((const EntryHeader*)entries[i])->length)+3)&~3;
+  }
+
+  const size_t stringsOffset=sizeof(SnapshotHeader)+slots*sizeof(unsigned int);
+  const size_t totalSize=stringsOffset+stringsSize;
+  std::vector<uint8_t> buf(totalSize, 0);
+
+  SnapshotHeader* header=(SnapshotHeader*)&buf[0];
+  header->id=SnapshotHeader::kHeaderId;
+  header->version=SnapshotHeader::kVersion;
+  header->slots=slots;
+  header->itemCount=(unsigned int)entries.size();
+  header->stringsOffset=(unsigned int)stringsOffset;
+  header->stringsSize=(unsigned int)stringsSize;
+
+  // Copy the entries, and store their offsets in the slots. Offsets rather than pointers keep the
+  // snapshot valid wherever it ends up being mapped
+  unsigned int* slotOffsets=(unsigned int*)(header+1);
+  size_t ofs=stringsOffset;
+  for (size_t i=0; i<entries.size(); i++)
+  {
+    const char* entry=entries[i];
+    const EntryHeader* entryHeader=(const EntryHeader*)entry;
+    const size_t entrySize=EntrySize(entryHeader->length);
+    memcpy(&buf[ofs], entry, entrySize);
+
+    unsigned int slot=entryHeader->hash&(slots-1);
+    while (slotOffsets[slot])
+    {
+      slot=(slot+1)&(slots-1);
+    }
+    slotOffsets[slot]=(unsigned int)ofs;
+
+    ofs+=(entrySize+3)&~3;
+  }
+
+  return write_file(&buf[0], (uint32_t)totalSize, filename);
+}
+
+
+//*** load_snapshot ***
+
+bool StringIdTable::load_snapshot(const char* filename)
+{
+  // Strings already handed out from the live tables would get a second, different shared pointer if
+  // they are also in the snapshot, so a snapshot can only be adopted by an empty table
+  if (snapshot_)
+  {
+    LOG_WARNING_LN("StringIdTable snapshot already loaded");
+    return false;
+  }
+  for (int i=0; i<shardCount_; i++)
+  {
+    if (shards_[i].itemCount)
+    {
+      LOG_WARNING_LN("StringIdTable snapshot must be loaded before any StringIds are created");
+      return false;
+    }
+  }
+
+  // Map the whole file
+  MemoryMappedFile* file=new MemoryMappedFile();
+  void* data=NULL;
+  uint64_t dataLen=0;
+  if (!file->open(filename, &data, &dataLen, 0))
+  {
+    delete file;
+    return false;
+  }
+
+  // Make sure the file is a snapshot we understand, and that everything it points to is within the file
+  const SnapshotHeader* header=(const SnapshotHeader*)data;
+  const unsigned int* slots=(const unsigned int*)(header+1);
+  bool valid=dataLen>=sizeof(SnapshotHeader) &&
+    header->id==SnapshotHeader::kHeaderId &&
+    header->version==SnapshotHeader::kVersion &&
+    header->slots && (header->slots&(header->slots-1))==0 &&
+    header->itemCount<header->slots-(header->slots/3) &&
+    header->stringsOffset==sizeof(SnapshotHeader)+(uint64_t)header->slots*sizeof(unsigned int) &&
+    (uint64_t)header->stringsOffset+header->stringsSize<=dataLen;
+
+  // The lengths come from the file, so the sizes are worked out in 64 bits where they can't overflow,
+  // and both copies of every string have to be terminated where the length says they end
+  const uint64_t stringsEnd=valid ? (uint64_t)header->stringsOffset+header->stringsSize : 0;
+  unsigned int usedSlots=0;
+  for (unsigned int i=0; valid && i<header->slots; i++)
+  {
+    if (!slots[i])
+    {
+      continue;
+    }
+    usedSlots++;
+    const uint64_t offset=slots[i];
+    valid=offset>=header->stringsOffset && (offset&3)==0 && offset+sizeof(EntryHeader)<=stringsEnd;
+    if (valid)
+    {
+      const char* entry=(const char*)header+offset;
+      const uint64_t length=((const EntryHeader*)entry)->length;
+      const char* chars=entry+sizeof(EntryHeader);
+      valid=offset+sizeof(EntryHeader)+2*(length+1)<=stringsEnd && chars[length]==0 && chars[length+1+length]==0;
+    }
+  }
+
+  // Lookups probe until they hit an empty slot, so a table with no empty slots would never end a miss
+  valid=valid && usedSlots==header->itemCount && usedSlots<header->slots;
+
+  if (!valid)
+  {
+    LOG_WARNING_LN("Invalid StringIdTable snapshot: %s", filename);
+    delete file;
+    return false;
+  }
+
+  snapshotFile_=file;
+  InterlockedExchangePointer((PVOID volatile*)&snapshot_, (PVOID)header);
+  return true;
+}
+
+
+//*** ForEachEntry ***
+
+template<typename Fn>
+void StringIdTable::ForEachEntry(const Shard& shard, Fn fn)
+{
+  // The current table, and the slots of a resize in progress that haven't been moved over yet
+  const SlotTable* tables[2]={ shard.table, shard.migratingTable };
+  const int firstSlots[2]={ 0, shard.migratedSlots };
+
+  for (int t=0; t<2 && tables[t]; t++)
+  {
+    const SlotTable* table=tables[t];
+    const unsigned int mask=table->slots-1;
+    for (int i=firstSlots[t]; i<table->slots; i++)
+    {
+      const char* entry=table->entries[i];
+      if (entry)
+      {
+        // The probe length is the distance from the slot the hash points at, plus the slot itself
+        const unsigned int home=(((const EntryHeader*)entry)->hash>>shardBits_)&mask;
+        fn(entry, i, (int)((i-home)&mask)+1);
+      }
+    }
+  }
+}
+
+
+//*** get_stats ***
+
+void StringIdTable::get_stats(Stats* stats)
+{
+  memset(stats, 0, sizeof(Stats));
+
+  if (const SnapshotHeader* snapshot=snapshot_)
+  {
+    stats->snapshotItemCount=snapshot->itemCount;
+  }
+
+  int shardItemCount=0;
+  double probeLengthSum=0;
+  for (int i=0; i<shardCount_; i++)
+  {
+    Shard& shard=shards_[i];
+    SCOPED_CS(&shard.lock);
+
+    shardItemCount+=shard.itemCount;
+    stats->slotCount+=shard.table->slots;
+    stats->slotBytes+=sizeof(SlotTable)+sizeof(char*)*(shard.table->slots-1);
+    if (shard.migratingTable)
+    {
+      stats->slotBytes+=sizeof(SlotTable)+sizeof(char*)*(shard.migratingTable->slots-1);
+    }
+    stats->rehashCount+=shard.rehashCount;
+
+    ForEachEntry(shard, [&](const char*, int, int probeLength) {
+      probeLengthSum+=probeLength;
+      stats->maxProbeLength=max(stats->maxProbeLength, probeLength);
+      stats->probeHistogram[min(probeLength, (int)Stats::kProbeHistogramSize)-1]++;
+    });
+
+    // Storage blocks are a fixed size, except for the ones holding a single oversized string
+    stats->storageBlockCount+=shard.stringStorageBlockCount;
+    for (int j=0; j<shard.stringStorageBlockCount; j++)
+    {
+      const size_t used=shard.stringStorageBlocks[j].tail-shard.stringStorageBlocks[j].head;
+      stats->storageBytesUsed+=used;
+      stats->storageBytesAllocated+=max(used, (size_t)stringStorageBlockSize_);
+    }
+  }
+
+  stats->itemCount=stats->snapshotItemCount+shardItemCount;
+  stats->loadFactor=stats->slotCount ? shardItemCount/(float)stats->slotCount : 0;
+  stats->meanProbeLength=shardItemCount ? (float)(probeLengthSum/shardItemCount) : 0;
+
+#ifdef STRING_ID_TABLE_COUNTERS
+  // Turn the counts into rates since the previous call, and start counting again
+  LARGE_INTEGER now, frequency;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&frequency);
+  const double elapsed=(now.QuadPart-countersResetTime_.QuadPart)/(double)frequency.QuadPart;
+  countersResetTime_=now;
+
+  LONG lookups=0, inserts=0;
+  for (int i=0; i<shardCount_; i++)
+  {
+    lookups+=InterlockedExchange(&shards_[i].lookupCount, 0);
+    inserts+=InterlockedExchange(&shards_[i].insertCount, 0);
+  }
+  stats->lookupsPerSecond=elapsed>0 ? lookups/elapsed : 0;
+  stats->insertsPerSecond=elapsed>0 ? inserts/elapsed : 0;
+#endif
+}
+
+
+//*** dump ***
+
+bool StringIdTable::dump(const char* filename)
+{
+#pragma warning(suppress: 4996)
+  FILE* file=fopen(filename, "wt");
+  if (file==NULL)
+  {
+    return false;
+  }
+
+  fprintf(file, "hash\tshard\tslot\tprobe\tstring\n");
+
+  // Snapshot strings are listed with a shard of -1
+  if (const SnapshotHeader* snapshot=snapshot_)
+  {
+    const unsigned int* slots=(const unsigned int*)(snapshot+1);
+    const unsigned int mask=snapshot->slots-1;
+    for (unsigned int i=0; i<snapshot->slots; i++)
+    {
+      if (slots[i])
+      {
+        const EntryHeader* entry=(const EntryHeader*)((const char*)snapshot+slots[i]);
+        fprintf(file, "%08x\t-1\t%u\t%u\t%s\n", entry->hash, i, ((i-(entry->hash&mask))&mask)+1, (const char*)(entry+1));
+      }
+    }
+  }
+
+  for (int i=0; i<shardCount_; i++)
+  {
+    Shard& shard=shards_[i];
+    SCOPED_CS(&shard.lock);
+
+    ForEachEntry(shard, [&](const char* entry, int slot, int probeLength) {
+      fprintf(file, "%08x\t%d\t%d\t%d\t%s\n", ((const EntryHeader*)entry)->hash, i, slot, probeLength, entry+sizeof(EntryHeader));
+    });
+  }
+
+  return fclose(file)==0;
+}
+
+
+//*** InsertEntry ***
+
+void StringIdTable::InsertEntry(SlotTable* table, char* entry)
+{
+  // Get hash for string (stored in the entry header)
+  const unsigned int hash=((const EntryHeader*)entry)->hash;
+
+  // Find the nearest empty slot. Only the lock holder writes to the table, so it stays empty
+  const unsigned int mask=table->slots-1;
+  unsigned int slot=(hash>>shardBits_)&mask;
+  while (table->entries[slot])
+  {
+    slot=(slot+1)&mask;
+  }
+
+  // Store the string in the table
+  InterlockedExchangePointer((PVOID volatile*)&table->entries[slot], entry);
+}
+
+
+//*** ResizeShard ***
+
+void StringIdTable::ResizeShard(Shard& shard, int slots, bool incremental)
+{
+  // Only one resize can be in progress at a time, so finish off any previous one
+  if (shard.migratingTable)
+  {
+    MigrateSlots(shard, shard.migratingTable->slots);
+  }
+
+  // Keep the old table around for lookups while its strings are moved to the new one. The old table
+  // is published as migrating before the new one becomes current, so lock free readers always find
+  // existing strings in one of the two
+  SlotTable* newTable=CreateSlotTable(slots);
+  shard.migratedSlots=0;
+  shard.rehashCount++;
+  InterlockedIncrement(&shard.generation);
+  InterlockedExchangePointer((PVOID volatile*)&shard.migratingTable, shard.table);
+  InterlockedExchangePointer((PVOID volatile*)&shard.table, newTable);
+
+  if (!incremental)
+  {
+    MigrateSlots(shard, shard.migratingTable->slots);
+  }
+}
+
+
+//*** MigrateSlots ***
+
+void StringIdTable::MigrateSlots(Shard& shard, int count)
+{
+  SlotTable* oldTable=shard.migratingTable;
+
+  // Copy the entries of the next few slots over to the current table. The old table is left untouched,
+  // so readers probing it keep finding everything that was in it
+  const int end=shard.migratedSlots+count<oldTable->slots ? shard.migratedSlots+count : oldTable->slots;
+  for (int i=shard.migratedSlots; i<end; i++)
+  {
+    // If slot is in use
+    char* entry=oldTable->entries[i];
+    if (entry)
+    {
+      InsertEntry(shard.table, entry);
+    }
+  }
+  shard.migratedSlots=end;
+
+  if (shard.migratedSlots==oldTable->slots)
+  {
+    // Everything has been moved, so lookups no longer need the old table. Readers that already picked
+    // it up can keep probing it, so we only retire it rather than free it. The generation goes up first,
+    // so a reader that sees the old table gone also sees that it has to look again
+    InterlockedIncrement(&shard.generation);
+    InterlockedExchangePointer((PVOID volatile*)&shard.migratingTable, NULL);
+    oldTable->retired=shard.retiredTables;
+    shard.retiredTables=oldTable;
+  }
+}
+
+
+//*** StoreString ***
+
+char* StringIdTable::StoreString(Shard& shard, unsigned int hash, int length, const char* string)
+{
+  // Calculate space needed to store the string, rounded up so the next entry header is aligned
+  int spaceNeeded=(EntrySize(length)+3)&~3;
 
   // Check if there's space in the current string storage block
-  StringStorageBlock* block=&stringStorageBlocks_[stringStorageBlockCount_-1]; // Current block is always the last one
-  if ((stringStorageBlockSize_-(block->tail-block->head))<spaceNeeded)
+  StringStorageBlock* block=shard.stringStorageBlockCount ? &shard.stringStorageBlocks[shard.stringStorageBlockCount-1] : NULL; // Current block is always the last one
+  if (!block || (stringStorageBlockSize_-(block->tail-block->head))<spaceNeeded)
   {
     // No more room - make a new storage block
-    if (stringStorageBlockCount_==stringStorageBlockMaxCount_)
+    if (shard.stringStorageBlockCount==shard.stringStorageBlockMaxCount)
     {
       // Need a bigger array for string storage blocks
-      stringStorageBlockMaxCount_*=2; // Go with twice the current size
+      shard.stringStorageBlockMaxCount*=2; // Go with twice the current size
 
-      // Use realloc to get a bigger array while preserving the values it already holds
-      stringStorageBlocks_=(StringStorageBlock*)realloc(stringStorageBlocks_,stringStorageBlockMaxCount_*sizeof(StringStorageBlock));
+      // Use realloc to get a bigger array while preserving the values it already holds. Only the block
+      // info moves, the blocks themselves stay put, so readers of stored strings are not affected
+      shard.stringStorageBlocks=(StringStorageBlock*)realloc(shard.stringStorageBlocks,shard.stringStorageBlockMaxCount*sizeof(StringStorageBlock));
     }
 
-    // Allocate the new string storage block
-    stringStorageBlocks_[stringStorageBlockCount_].head=(char*)malloc(stringStorageBlockSize_);
-    stringStorageBlocks_[stringStorageBlockCount_].tail=stringStorageBlocks_[stringStorageBlockCount_].head; // Empty, so first free byte is at start
+    // Allocate the new string storage block. A string that doesn't fit in a regular block gets a block of its own
+    const int blockSize=spaceNeeded>stringStorageBlockSize_ ? spaceNeeded : stringStorageBlockSize_;
+    shard.stringStorageBlocks[shard.stringStorageBlockCount].head=(char*)malloc(blockSize);
+    shard.stringStorageBlocks[shard.stringStorageBlockCount].tail=shard.stringStorageBlocks[shard.stringStorageBlockCount].head; // Empty, so first free byte is at start
 
     // Update the current string storage block
-    block=&stringStorageBlocks_[stringStorageBlockCount_];
-    stringStorageBlockCount_++;
+    block=&shard.stringStorageBlocks[shard.stringStorageBlockCount];
+    shard.stringStorageBlockCount++;
   }
 
   // Get the next piece of free memory from the current block
   char* strdest=block->tail;
 
-  // Write hash number
-  *((unsigned int*)strdest)=hash;
+  // Write the header
+  EntryHeader* header=(EntryHeader*)strdest;
+  header->length=length;
+  header->hash=hash;
 
-  // Copy the string to the block
-#pragma warning(suppress: 4996)
-  strcpy(strdest+4,string); // Offset by four to account for hash number
+  // Copy the string to the block, followed by the upper case copy used for comparisons
+  char* chars=strdest+sizeof(EntryHeader);
+  char* folded=chars+length+1;
+  for (int i=0; i<length; i++)
+  {
+    chars[i]=string[i];
+    folded[i]=(char)string_id_detail::to_upper(string[i]);
+  }
+  chars[length]=0;
+  folded[length]=0;
 
   // Mark space as used
   block->tail+=spaceNeeded; 
@@ -235,3 +938,34 @@ char* StringIdTable::StoreString(unsigned int hash, const char* string)
 }
 
 
+//*** StringIdScope ***
+
+StringIdScope::StringIdScope()
+{
+  StringIdTable::InitShard(shard_);
+}
+
+StringIdScope::~StringIdScope()
+{
+  StringIdTable::FreeShard(shard_);
+}
+
+StringId StringIdScope::intern(const char* idString)
+{
+  StringId id;
+  if (idString && idString[0])
+  {
+    StringIdTable& table=StringIdTable::instance();
+    int length=0;
+    const unsigned int hash=table.CalculateHash(idString, &length);
+
+    // Strings that are already shared keep their shared id, so they compare equal to ids made elsewhere. Only
+    // strings the shared table has never seen go into our own storage
+    id.idString_=table.FindExistingIdString(hash, length, idString);
+    if (!id.idString_)
+    {
+      id.idString_=StringIdTable::InsertIdString(shard_, hash, length, idString);
+    }
+  }
+  return id;
+}
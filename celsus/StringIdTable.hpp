@@ -1,19 +1,32 @@
 /**
 * \class	StringIdTable
-* 
+*
 * \ingroup	core
 * \brief	
 * \author	Mattias Gustavsson	
-* 
+*
 * Efficient way of storing string id's
+*
+* The table is safe to use from multiple threads. It is split into a number of
+* shards, selected by the low bits of the hash value, and each shard is an
+* independent open-addressing table with its own lock and string storage. Looking
+* up a string that is already in the table takes no locks at all; only inserting a
+* new string locks the shard it belongs to.
 */
 
 #ifndef __StringIdTable_H__
 #define __StringIdTable_H__
 
 // Includes
+#include <windows.h>
+
+// Uncomment to count lookups and inserts, and report their rates in StringIdTable::Stats. Every
+// lookup then does an interlocked increment, so this is meant for profiling builds only
+//#define STRING_ID_TABLE_COUNTERS
 
 // External classes
+class MemoryMappedFile;
+class StringId;
 
 // StringIdTable
 class StringIdTable
@@ -25,19 +38,112 @@ public:
   * created when the table is first used, and destroyed when the
   * application shuts down. This method will return the internally
   * stored instance of the StringIdTable, or create it if it does
-  * not already exist
+  * not already exist. It is safe to call this from several threads
+  * at once.
   *
   * \returns The StringIdTable instance
   */
   static StringIdTable& instance();
   static void close();
 
+  /// Snapshot of the state of the table, for checking how well the hash and the probing work on the
+  /// strings actually used
+  struct Stats
+  {
+    static const int kProbeHistogramSize=16; ///< Number of buckets in the probe length histogram
+
+    int itemCount; ///< Number of strings in the table, including the ones in a loaded snapshot
+    int snapshotItemCount; ///< Number of strings in the loaded snapshot
+    int slotCount; ///< Total number of slots over all the shards
+    float loadFactor; ///< itemCount in the shards divided by slotCount
+    int maxProbeLength; ///< Longest number of slots probed to find a string
+    float meanProbeLength; ///< Average number of slots probed to find a string
+    int probeHistogram[kProbeHistogramSize]; ///< Number of strings found after probing 1, 2, ... slots. The last bucket holds everything longer
+    int storageBlockCount; ///< Number of allocated string storage blocks
+    size_t storageBytesAllocated; ///< Bytes allocated for string storage blocks
+    size_t storageBytesUsed; ///< Bytes of the string storage blocks holding strings
+    size_t slotBytes; ///< Bytes allocated for the slot tables currently in use
+    int rehashCount; ///< Number of times a shard has been resized
+
+#ifdef STRING_ID_TABLE_COUNTERS
+    double lookupsPerSecond; ///< Lookups per second since the previous call to get_stats
+    double insertsPerSecond; ///< Inserts per second since the previous call to get_stats
+#endif
+  };
+
+  /**
+  * Gathers statistics about the table. Locks one shard at a time while
+  * going through it, so it can be called while other threads use the table.
+  */
+  void get_stats(
+    Stats* stats	///< Receives the statistics
+    );
+
+  /**
+  * Writes every string in the table to a text file, one per line, along with
+  * its hash number, shard, slot and probe length, for offline analysis.
+  *
+  * \returns	True if the file was written
+  */
+  bool dump(
+    const char* filename	///< File to write to
+    );
+
+  /**
+  * Makes room for the specified number of strings, so they can be added
+  * without the table having to be resized along the way. Loaders that know
+  * how many ids they are about to create can call this up front, to pay
+  * for growing the table once instead of in the middle of loading.
+  */
+  void reserve(
+    int count	///< Total number of strings the table should have room for
+    );
+
+  /**
+  * Looks up, or inserts, a whole array of strings at once. All the strings
+  * are hashed first, and the slots they map to are prefetched before any of
+  * them are resolved, so the cache misses of the lookups overlap instead of
+  * being paid one after the other. Gives the same ids as constructing a
+  * StringId from each string, so it is meant for loaders that create a lot
+  * of ids in one go.
+  */
+  void intern_batch(
+    const char** strs,	///< The strings to intern. Null and empty strings give the empty id
+    size_t n,	///< Number of strings
+    StringId* out	///< Receives the n ids
+    );
+
+  /**
+  * Writes all the strings in the table to a snapshot file, which can be
+  * loaded with load_snapshot on a later run. The snapshot holds the strings
+  * in the same [length][hash][chars][CHARS] form as the table, along with a slot table of
+  * offsets, so it can be used straight from a memory mapped file.
+  *
+  * \returns	True if the file was written
+  */
+  bool save_snapshot(
+    const char* filename	///< File to write the snapshot to
+    );
+
+  /**
+  * Memory maps a snapshot written by save_snapshot, and uses it as the base
+  * of the table. Strings in the snapshot are found without storing a copy,
+  * and strings that aren't in it are added to the table as usual. Must be
+  * called before any StringIds are created, so at startup.
+  *
+  * \returns	True if the snapshot was loaded
+  */
+  bool load_snapshot(
+    const char* filename	///< Snapshot file to map
+    );
+
 private:
 
-  static StringIdTable* instance_;
+  static StringIdTable* volatile instance_;
 
   // The StringIdTable is only used internally by the StringId class
   friend class StringId;
+  friend class StringIdScope;
 
 
   /**
@@ -60,7 +166,8 @@ private:
   * \returns	The hash value for the specified string
   */
   unsigned int CalculateHash(
-    const char* idString	///< String to calculate hash value for
+    const char* idString,	///< String to calculate hash value for
+    int* length=0	///< If non-zero, receives the length of the string
     ) const;
 
 
@@ -74,20 +181,240 @@ private:
   */
   const char* FindIdString(
     unsigned int hash,	///< The hash-value for the specified idString, as calculated by the CalculateHash method
+    int length,	///< The length of the idString, not counting the terminator
     const char* idString	///< The idString to find in or insert into the string table
     );
 
+  /**
+  * Looks up the specified string in the snapshot and the shared string table,
+  * without inserting it if it isn't there. Takes no locks.
+  *
+  * \returns	The shared pointer for the specified id-string, or 0 if it is not in the table
+  */
+  const char* FindExistingIdString(
+    unsigned int hash,	///< The hash-value for the specified idString, as calculated by the CalculateHash method
+    int length,	///< The length of the idString, not counting the terminator
+    const char* idString	///< The idString to find in the string table
+    );
+
 private:
+  static const int shardBits_=4; ///< Number of hash bits used to select a shard
+  static const int shardCount_=1<<shardBits_; ///< Number of independently locked shards
+  static const int initialShardSlots_=64; ///< Number of slots each shard starts out with
+  static const int migrateSlotsPerInsert_=32; ///< Number of slots moved to the new table on each insert while a resize is in progress
+  static const int internBatchSize_=64; ///< Number of strings intern_batch hashes and prefetches ahead of resolving them
+
+  /// The hash slots of a shard. The slot count and the slots are allocated together, so
+  /// a reader that loads the pointer to a slot table always sees a consistent pair
+  struct SlotTable
+  {
+    int slots; ///< The total number of slots in the table, always a power of two
+    SlotTable* retired; ///< Next table in the shard's list of replaced tables
+    char* volatile entries[1]; ///< The slots, each either 0 or a pointer to a stored [length][hash][chars][CHARS] entry
+  };
+
+  /// Every stored string starts with this header. The shared string pointer handed out to StringIds points
+  /// right after it, so the hash number is always found in the four bytes preceding the string. The string
+  /// is followed by an upper case copy of itself, so comparisons only need to fold the string being looked up
+  struct EntryHeader
+  {
+    unsigned int length; ///< Length of the string, not counting the terminator
+    unsigned int hash; ///< Hash number of the string, so it doesn't need recalculating when the table is resized
+  };
+
+  /// Number of bytes used by an entry for a string of the specified length, including both terminators
+  static int EntrySize(int length) { return sizeof(EntryHeader)+2*(length+1); }
+
+  static const int stringStorageBlockSize_=16*1024; ///< Strings are stored in pre-allocated blocks, and this specifies the size, in bytes, of each block. Whenever a block is full, a new block is allocated off the heap
+
+  /// Each pre-allocated string block keeps track of two pointers
+  struct StringStorageBlock
+  {
+    char* head; ///< Pointer to the originally allocated block of memory
+    char* tail; ///< Pointer to the first free space of the block
+  };
+
+  /// One independently locked part of the table. Strings are never moved once stored, so
+  /// readers can hold on to entries while writers add storage blocks or grow the slots
+  struct Shard
+  {
+    CRITICAL_SECTION lock; ///< Held while inserting into the shard
+    SlotTable* volatile table; ///< The current slot table, read without holding the lock. New strings are always inserted here
+    SlotTable* volatile migratingTable; ///< The previous slot table while a resize is in progress, otherwise 0. Lookups check both tables
+    int migratedSlots; ///< Number of slots of migratingTable that have been moved to the current table so far
+    volatile LONG generation; ///< Bumped when a resize starts and when it completes, so lock free readers can tell the tables changed under them
+    SlotTable* retiredTables; ///< Slot tables replaced by a bigger one. Lock free readers may still be probing them, so they are only freed on destruction
+    int itemCount; ///< The number of strings stored in the shard
+    int rehashCount; ///< The number of times the shard has been resized
+#ifdef STRING_ID_TABLE_COUNTERS
+    volatile LONG lookupCount; ///< Number of lookups since the counters were last reset
+    volatile LONG insertCount; ///< Number of inserts since the counters were last reset
+#endif
+
+    StringStorageBlock* stringStorageBlocks; ///< Array for storing the currently allocated string storage blocks
+    int stringStorageBlockMaxCount;	///< The maximum number of entries that can be stored in stringStorageBlocks
+    int stringStorageBlockCount; ///< The current number of entries stored in stringStorageBlocks
+  };
+
+  /// Header of a snapshot file. It is followed by the slot table, an array of offsets from the
+  /// start of the file to the [length][hash][chars][CHARS] entries (0 for unused), and then the entries themselves
+  struct SnapshotHeader
+  {
+    static const unsigned int kHeaderId = 'SIDS';
+    static const unsigned int kVersion = 2;
+
+    unsigned int id;
+    unsigned int version;
+    unsigned int slots; ///< Number of slots, always a power of two. Entries are placed by hash&(slots-1)
+    unsigned int itemCount; ///< Number of strings in the snapshot
+    unsigned int stringsOffset; ///< Offset from the start of the file to the first entry
+    unsigned int stringsSize; ///< Size of all the entries, in bytes
+  };
+
+  /**
+  * Checks if a stored [length][hash][chars][CHARS] entry is the specified string
+  *
+  * \returns	True if the entry matches
+  */
+  static bool EntryMatches(
+    const char* entry,	///< Stored entry to check
+    unsigned int hash,	///< Pre-calculated hash number for the string
+    int length,	///< Length of the string, not counting the terminator
+    const char* idString	///< The idString to compare against
+    );
+
+  /**
+  * Probes the snapshot, if one is loaded, for the specified string. The
+  * snapshot is never modified, so no locks are needed.
+  *
+  * \returns	The shared pointer for the string, or 0 if it is not in the snapshot
+  */
+  const char* LookupSnapshot(
+    unsigned int hash,	///< Pre-calculated hash number for the string
+    int length,	///< Length of the string, not counting the terminator
+    const char* idString	///< The idString to look for
+    ) const;
+
+  /**
+  * Calls fn with every entry of the shard, along with the slot it is in and
+  * the number of slots probed to find it. Entries of a resize in progress are
+  * only visited once. Must be called with the shard lock held.
+  */
+  template<typename Fn>
+  static void ForEachEntry(
+    const Shard& shard,	///< Shard whose entries to visit
+    Fn fn	///< Called as fn(entry, slot, probeLength)
+    );
+
+  /**
+  * Sets up an empty shard, with the initial number of slots
+  */
+  static void InitShard(
+    Shard& shard	///< Shard to set up
+    );
+
+  /**
+  * Frees the slot tables and string storage of a shard. Any shared strings
+  * handed out by the shard are invalid afterwards.
+  */
+  static void FreeShard(
+    Shard& shard	///< Shard to free
+    );
+
+  /**
+  * Inserts the specified string into a shard, unless another thread got there
+  * first. Locks the shard while doing so.
+  *
+  * \returns	The shared pointer for the specified id-string
+  */
+  static const char* InsertIdString(
+    Shard& shard,	///< Shard to insert into
+    unsigned int hash,	///< Pre-calculated hash number for the string
+    int length,	///< Length of the string, not counting the terminator
+    const char* idString	///< The idString to insert
+    );
+
+  /**
+  * Allocates a slot table with all slots marked as unused
+  *
+  * \returns	The new slot table
+  */
+  static SlotTable* CreateSlotTable(
+    int slots	///< Number of slots, must be a power of two
+    );
+
+  /**
+  * Probes a single slot table for the specified string. Takes no locks, and can
+  * be called while another thread is inserting into the same table.
+  *
+  * \returns	The shared pointer for the string, or 0 if it is not in the table
+  */
+  static const char* LookupIdString(
+    const SlotTable* table,	///< Slot table to probe
+    unsigned int hash,	///< Pre-calculated hash number for the string
+    int length,	///< Length of the string, not counting the terminator
+    const char* idString	///< The idString to look for
+    );
+
+  /**
+  * Probes the slot tables of a shard for the specified string. Checks both the
+  * current table and, if a resize is in progress, the previous one. Takes no locks, and
+  * probes again if a resize starts or finishes while it's looking.
+  *
+  * \returns	The shared pointer for the string, or 0 if it is not in the shard
+  */
+  static const char* LookupIdString(
+    const Shard& shard,	///< Shard to probe
+    unsigned int hash,	///< Pre-calculated hash number for the string
+    int length,	///< Length of the string, not counting the terminator
+    const char* idString	///< The idString to look for
+    );
+
+  /**
+  * Stores an entry in the nearest free slot for its hash. Must be called with
+  * the shard lock held.
+  */
+  static void InsertEntry(
+    SlotTable* table,	///< Slot table to store the entry in
+    char* entry	///< Stored [length][hash][chars][CHARS] entry
+    );
+
+  /**
+  * Replaces the slot table of the shard with one of the specified size. The
+  * old table is kept for lookups until all of its entries have been moved,
+  * which happens a few slots at a time on the following inserts, or at once
+  * if incremental is false. Must be called with the shard lock held.
+  */
+  static void ResizeShard(
+    Shard& shard,	///< Shard to resize
+    int slots,	///< Number of slots in the new table, must be a power of two
+    bool incremental	///< Whether the entries should be moved over gradually
+    );
+
+  /**
+  * Moves the entries of the next few slots of the previous table to the
+  * current one, and retires the previous table once it has all been moved.
+  * Must be called with the shard lock held, while a resize is in progress.
+  */
+  static void MigrateSlots(
+    Shard& shard,	///< Shard whose resize to continue
+    int count	///< Maximum number of slots to move
+    );
+
   /**
   * Stores a copy of the specified string in the pre-allocated string storage
-  * block. Will allocate an additional block if the current block is full.
-  * The hash number of the string will be pre-appended to the string, so we
-  * don't have to recalculate it when the table needs re-hashing.
+  * block of the shard. Will allocate an additional block if the current block
+  * is full. The length and hash number of the string will be pre-appended to
+  * the string, so we don't have to recalculate the hash when the table needs
+  * re-hashing, and an upper case copy is appended for fast comparisons. Must
+  * be called with the shard lock held.
   *
   * \returns	A pointer to the copy
   */
-  char* StringIdTable::StoreString(
+  static char* StoreString(
+    Shard& shard, ///< Shard whose storage blocks should hold the copy
     unsigned int hash, ///< Pre-calculated hash number for the string
+    int length, ///< Length of the string, not counting the terminator
     const char* string	///< String to store a copy of
     );
 
@@ -97,23 +424,59 @@ private:
 
 
 private:
-  int idStringTableSlots_; ///< The total number of slots in the table
-  int idStringTableItemCount_; ///< The number of strings stored in the table
-  char** idStringTable_;	///< Table for storing all the idStrings
+  Shard shards_[shardCount_]; ///< The shards, selected by the low shardBits_ bits of the hash
 
+  const SnapshotHeader* volatile snapshot_; ///< Start of the loaded snapshot, checked before the shards, or 0 if none is loaded
+  MemoryMappedFile* snapshotFile_; ///< The mapping backing snapshot_
 
-  static const int stringStorageBlockSize_=16*1024; ///< Strings are stored in pre-allocated blocks, and this specifies the size, in bytes, of each block. Whenever a block is full, a new block is allocated off the heap
+#ifdef STRING_ID_TABLE_COUNTERS
+  LARGE_INTEGER countersResetTime_; ///< When the lookup and insert counters were last reset
+#endif
+};
 
-  /// Each pre-allocated string block keeps track of two pointers
-  struct StringStorageBlock
-  {
-    char* head; ///< Pointer to the originally allocated block of memory
-    char* tail; ///< Pointer to the first free space of the block
-  };
 
-  StringStorageBlock* stringStorageBlocks_; ///< Array for storing the currently allocated string storage blocks
-  int stringStorageBlockMaxCount_;	///< The maximum number of entries that can be stored in stringStorageBlocks_
-  int stringStorageBlockCount_; ///< The current number of entries  stored in stringStorageBlocks_
+
+/**
+* \class	StringIdScope
+*
+* \ingroup	core
+* \brief	Transient interning of strings that shouldn't stay in the shared table
+*
+* Creating a StringId adds its string to the shared table for the rest of the
+* run, which is wasteful for strings that are only needed for a moment, like
+* console input or file names coming from the file watcher. A StringIdScope is
+* a small child table for such strings. Strings that are already in the shared
+* table give their usual shared id, while new strings are stored in the scope,
+* and freed along with it.
+*
+* Ids from a scope work like any other StringId while the scope is alive, but
+* must not be used after it is destroyed. As the shared table doesn't know
+* about them, a string interned in a scope and later added to the shared table
+* gets two different ids, so ids from a scope shouldn't be kept around to be
+* compared with ones created later.
+*/
+class StringIdScope
+{
+public:
+  StringIdScope();
+  ~StringIdScope();
+
+  /**
+  * Gets the id for the specified string, adding the string to the scope if it
+  * isn't already in the shared table. Null and empty strings give the empty id.
+  * Safe to call from several threads at once.
+  *
+  * \returns	The id for the string, valid until the scope is destroyed
+  */
+  StringId intern(
+    const char* idString	///< String to get an id for
+    );
+
+private:
+  StringIdTable::Shard shard_; ///< Slots and string storage for the strings that aren't in the shared table
+
+  StringIdScope(const StringIdScope&);
+  const StringIdScope& operator=(const StringIdScope&);
 };
 
 #endif /* __StringIdTable_H__ */
@@ -0,0 +1,176 @@
+#include "stdafx.h"
+#include "crc32c.hpp"
+#include <intrin.h>
+#include <nmmintrin.h>
+
+namespace
+{
+  // reversed Castagnoli polynomial
+  const uint32_t kPoly = 0x82f63b78;
+
+  // the sse4.2 version runs three crcs side by side, over blocks of these sizes, and then shifts
+  // them into place. Both have to be powers of two
+  const size_t kLongBlock = 8192;
+  const size_t kShortBlock = 256;
+
+  uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec)
+  {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, ++mat) {
+      if (vec & 1) {
+        sum ^= *mat;
+      }
+    }
+    return sum;
+  }
+
+  void gf2_matrix_square(uint32_t* square, const uint32_t* mat)
+  {
+    for (int n = 0; n < 32; ++n) {
+      square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+  }
+
+  // Builds the tables that take a crc to what it would be after len more zero bytes
+  void crc32c_zeros(uint32_t zeros[4][256], size_t len)
+  {
+    // the operator for a single zero bit, squared until it covers len bytes
+    uint32_t odd[32];
+    uint32_t even[32];
+    odd[0] = kPoly;
+    for (int n = 1; n < 32; ++n) {
+      odd[n] = 1u << (n - 1);
+    }
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+    const uint32_t* op = odd;
+    for (;;) {
+      gf2_matrix_square(even, odd);
+      op = even;
+      len >>= 1;
+      if (len == 0) {
+        break;
+      }
+      gf2_matrix_square(odd, even);
+      op = odd;
+      len >>= 1;
+      if (len == 0) {
+        break;
+      }
+    }
+
+    for (uint32_t n = 0; n < 256; ++n) {
+      zeros[0][n] = gf2_matrix_times(op, n);
+      zeros[1][n] = gf2_matrix_times(op, n << 8);
+      zeros[2][n] = gf2_matrix_times(op, n << 16);
+      zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+  }
+
+  uint32_t crc32c_shift(const uint32_t zeros[4][256], const uint32_t crc)
+  {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+  }
+
+  struct Crc32cTables
+  {
+    Crc32cTables()
+    {
+      int info[4];
+      __cpuid(info, 1);
+      has_sse42 = (info[2] & (1 << 20)) != 0;
+
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; ++j) {
+          crc = crc & 1 ? (crc >> 1) ^ kPoly : crc >> 1;
+        }
+        table[0][i] = crc;
+      }
+      // table[k][i] is the crc of i followed by k zero bytes
+      for (uint32_t i = 0; i < 256; ++i) {
+        for (int k = 1; k < 8; ++k) {
+          table[k][i] = (table[k-1][i] >> 8) ^ table[0][table[k-1][i] & 0xff];
+        }
+      }
+      crc32c_zeros(long_shift, kLongBlock);
+      crc32c_zeros(short_shift, kShortBlock);
+    }
+
+    bool has_sse42;
+    uint32_t table[8][256];
+    uint32_t long_shift[4][256];
+    uint32_t short_shift[4][256];
+  };
+
+  const Crc32cTables g_tables;
+
+#ifdef _M_X64
+  typedef uint64_t CrcWord;
+  inline uint32_t crc32c_word(const uint32_t crc, const uint8_t* p) { return (uint32_t)_mm_crc32_u64(crc, *(const uint64_t*)p); }
+#else
+  typedef uint32_t CrcWord;
+  inline uint32_t crc32c_word(const uint32_t crc, const uint8_t* p) { return _mm_crc32_u32(crc, *(const uint32_t*)p); }
+#endif
+
+  // The crc32 instruction takes 3 cycles, but a new one can start every cycle, so three
+  // independent crcs over consecutive blocks go about three times as fast as one
+  uint32_t crc32c_sse42_blocks(uint32_t crc, const uint8_t*& p, size_t& len, const size_t block_len, const uint32_t shift[4][256])
+  {
+    while (len >= 3 * block_len) {
+      uint32_t crc1 = 0;
+      uint32_t crc2 = 0;
+      const uint8_t* end = p + block_len;
+      for (; p < end; p += sizeof(CrcWord)) {
+        crc = crc32c_word(crc, p);
+        crc1 = crc32c_word(crc1, p + block_len);
+        crc2 = crc32c_word(crc2, p + 2 * block_len);
+      }
+      crc = crc32c_shift(shift, crc) ^ crc1;
+      crc = crc32c_shift(shift, crc) ^ crc2;
+      p += 2 * block_len;
+      len -= 3 * block_len;
+    }
+    return crc;
+  }
+
+  uint32_t crc32c_sse42(uint32_t crc, const uint8_t* p, size_t len)
+  {
+    for (; len > 0 && ((uintptr_t)p & (sizeof(CrcWord) - 1)) != 0; --len) {
+      crc = _mm_crc32_u8(crc, *p++);
+    }
+    crc = crc32c_sse42_blocks(crc, p, len, kLongBlock, g_tables.long_shift);
+    crc = crc32c_sse42_blocks(crc, p, len, kShortBlock, g_tables.short_shift);
+    for (; len >= sizeof(CrcWord); len -= sizeof(CrcWord), p += sizeof(CrcWord)) {
+      crc = crc32c_word(crc, p);
+    }
+    for (; len > 0; --len) {
+      crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+  }
+
+  uint32_t crc32c_sliced(uint32_t crc, const uint8_t* p, size_t len)
+  {
+    const uint32_t (*t)[256] = g_tables.table;
+    for (; len > 0 && ((uintptr_t)p & 3) != 0; --len) {
+      crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+      const uint32_t lo = *(const uint32_t*)p ^ crc;
+      const uint32_t hi = *(const uint32_t*)(p + 4);
+      crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+        t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    }
+    for (; len > 0; --len) {
+      crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+    return crc;
+  }
+}
+
+uint32_t crc32c(const void* data, const size_t len, const uint32_t crc)
+{
+  const uint8_t* p = (const uint8_t*)data;
+  return g_tables.has_sse42 ? ~crc32c_sse42(~crc, p, len) : ~crc32c_sliced(~crc, p, len);
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-32C (Castagnoli), using the SSE4.2 crc32 instruction when the cpu has it, and slicing by
+// 8 tables otherwise. Pass the previous result as crc to checksum data in pieces
+uint32_t crc32c(const void* data, const size_t len, const uint32_t crc = 0);
@@ -5,6 +5,7 @@
 #include "error2.hpp"
 #include "string_utils.hpp"
 #include "DX11Utils.hpp"
+#include "StringIdMap.hpp"
 
 #include <hash_map>
 #include <D3D11Shader.h>
@@ -74,9 +75,8 @@ private:
 	};
 
 	typedef string2 BufferName;
-	typedef string2 VariableName;
 	typedef std::map< BufferName, ConstantBuffer* > ConstantBuffers;
-	typedef std::map< VariableName, BufferVariable* > BufferVariables;
+	typedef StringIdMap< BufferVariable* > BufferVariables;
 	typedef std::map< string2, D3D11_SHADER_INPUT_BIND_DESC > BoundTextures;
 	typedef std::map< string2, D3D11_SHADER_INPUT_BIND_DESC > BoundSamplers;
 
@@ -89,7 +89,9 @@ private:
 	{
 		~Shader()
 		{
-			map_delete(_buffer_variables);
+			for (BufferVariables::iterator i = _buffer_variables.begin(), e = _buffer_variables.end(); i != e; ++i)
+				delete i.value();
+			_buffer_variables.clear();
 			map_delete(_constant_buffers);
 		}
 
@@ -126,10 +128,15 @@ private:
 				for (UINT j = 0; j < d.Variables; ++j) {
 					ID3D11ShaderReflectionVariable* v = rcb->GetVariableByIndex(j);
 					v->GetDesc(&vd);
-					if (_buffer_variables.find(vd.Name) == _buffer_variables.end()) {
+					// the map folds case, but HLSL names don't, so names that only differ in case are rejected
+					const StringId var_name(vd.Name);
+					if (BufferVariable** existing = _buffer_variables.find(var_name)) {
+						if ((*existing)->_name != vd.Name)
+							LOG_WARNING_LN("Variable name collides with %s, ignoring it: %s", (*existing)->_name.c_str(), vd.Name);
+					} else {
 						ID3D11ShaderReflectionType* t = v->GetType();
 						t->GetDesc(&td);
-						_buffer_variables.insert(std::make_pair(vd.Name, new BufferVariable(vd.Name, cur_cb, vd, td)));
+						_buffer_variables.insert(var_name, new BufferVariable(vd.Name, cur_cb, vd, td));
 					}
 				}
 			}
@@ -155,13 +162,13 @@ private:
 		template<typename U> BufferVariable *set_variable(const string2& name, const U& value)
 		{
 			// find variable
-			BufferVariables::iterator it = _buffer_variables.find(name);
-			if (it == _buffer_variables.end()) {
+			BufferVariable** it = _buffer_variables.find(StringId::find(name.c_str()));
+			if (!it || (*it)->_name != name) {
 				LOG_WARNING_LN_ONESHOT("Variable not found: %s", name);
 				return nullptr;
 			}
 
-			BufferVariable* var = it->second;
+			BufferVariable* var = *it;
 			// check the size
 			if (var->_var_desc.Size != sizeof(U)) {
 				LOG_WARNING_LN_ONESHOT("Variable size doesn't match: %s", name);
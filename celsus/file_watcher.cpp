@@ -10,7 +10,7 @@ enum {
   COMPLETION_KEY_IO           =   2
 };
 
-FileWatcher *FileWatcher::_instance = nullptr;
+FileWatcher * volatile FileWatcher::_instance = nullptr;
 
 FileWatcher::FileWatcher()
   : _watcher_thread(INVALID_HANDLE_VALUE)
@@ -18,13 +18,25 @@ FileWatcher::FileWatcher()
   , _watcher_completion_port(INVALID_HANDLE_VALUE)
   , _thread_id(0xffffffff)
 {
+  // created up front, as callbacks can be added before init
+  InitializeCriticalSection(&_cs_deferred_files);
 }
 
 FileWatcher& FileWatcher::instance()
 {
-  if (!_instance)
-    _instance = new FileWatcher();
-  return *_instance;
+  FileWatcher* watcher = _instance;
+  if (watcher)
+    return *watcher;
+
+  // callbacks can be added from any thread, so several threads can race to create the instance
+  FileWatcher* new_watcher = new FileWatcher();
+  watcher = (FileWatcher*)InterlockedCompareExchangePointer((PVOID volatile*)&_instance, new_watcher, NULL);
+  if (watcher) {
+    DeleteCriticalSection(&new_watcher->_cs_deferred_files);
+    delete new_watcher;
+    return *watcher;
+  }
+  return *new_watcher;
 }
 
 void FileWatcher::tick()
@@ -36,9 +48,11 @@ void FileWatcher::tick()
     for (DeferredFiles::iterator i = _deferred_files.begin(), e = _deferred_files.end(); i != e; ++i) {
       const string2& filename = *i;
       // check if the changed file has any registered callbacks
-      FileChangedCallbacks::iterator it = _file_changed_callbacks.find(filename);
-      if (it != _file_changed_callbacks.end()) {
-        for (std::vector<fnFileChanged>::iterator i = it->second.begin(), e = it->second.end(); i != e; ++i) {
+      std::vector<fnFileChanged>* found = _file_changed_callbacks.find(StringId::find(filename.c_str()));
+      if (found) {
+        // a copy, as the callbacks can add new callbacks
+        const std::vector<fnFileChanged> callbacks(*found);
+        for (std::vector<fnFileChanged>::const_iterator i = callbacks.begin(), e = callbacks.end(); i != e; ++i) {
           (*i)(filename);
         }
       }
@@ -50,24 +64,29 @@ void FileWatcher::tick()
 
 bool FileWatcher::init()
 {
-  InitializeCriticalSection(&_cs_deferred_files);
   _watcher_thread = CreateThread(0, 0, WatcherThread, (void *)this, 0, &_thread_id);
   return _watcher_thread != INVALID_HANDLE_VALUE;
 }
 
 bool FileWatcher::close()
 {
-  _file_changed_callbacks.clear();
+  {
+    SCOPED_CS(&_cs_deferred_files);
+    _file_changed_callbacks.clear();
+  }
   PostQueuedCompletionStatus(_watcher_completion_port, 0, COMPLETION_KEY_SHUTDOWN, 0);
   WaitForSingleObject(_watcher_thread, INFINITE);
-  DeleteCriticalSection(&_cs_deferred_files);
   return true;
 }
 
 bool FileWatcher::add_file_changed(const string2& filename, const fnFileChanged& fn, const bool initial_load)
 {
   auto f = Path::make_canonical(Path::get_full_path_name(filename));
-  _file_changed_callbacks[f].push_back(fn);
+  {
+    // tick() walks the callbacks on the main thread, but they can be added from any thread
+    SCOPED_CS(&_cs_deferred_files);
+    _file_changed_callbacks[StringId(f.c_str())].push_back(fn);
+  }
 
   // if initial_load is set, we fake a "file changed" event, and call the callback at once
   bool res = true;
@@ -107,7 +126,8 @@ DWORD WINAPI FileWatcher::WatcherThread(void* param)
 
     OVERLAPPED overlapped;
     ZeroMemory(&overlapped, sizeof(overlapped));
-    if (!ReadDirectoryChangesW(obj->_dir_handle, info, sizeof(info), TRUE, FILE_NOTIFY_CHANGE_LAST_WRITE, NULL, &overlapped, NULL))
+    // file name changes too, as editors often save by renaming a new file over the old one
+    if (!ReadDirectoryChangesW(obj->_dir_handle, info, sizeof(info), TRUE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME, NULL, &overlapped, NULL))
       return 1;
 
     DWORD bytes;
@@ -130,14 +150,26 @@ DWORD WINAPI FileWatcher::WatcherThread(void* param)
 
     if (done) {
       break;
-    } else {
-      info[0].FileName[info[0].FileNameLength/2+0] = 0;
-      info[0].FileName[info[0].FileNameLength/2+1] = 0;
-
-      char tmp[MAX_PATH];
-      UnicodeToAnsiToBuffer(info[0].FileName, tmp, MAX_PATH);
-      const std::string filename(Path::make_canonical(Path::get_full_path_name(tmp)));
-      obj->file_changed_internal(filename);
+    } else if (bytes > 0) {
+      // a save can come as several changes, so report every file in the buffer. The names aren't
+      // terminated, and terminating them in place would clobber the next entry
+      const uint8_t* ptr = (const uint8_t*)info;
+      for (;;) {
+        const FILE_NOTIFY_INFORMATION* cur = (const FILE_NOTIFY_INFORMATION*)ptr;
+        WCHAR name[MAX_PATH];
+        const DWORD len = min(cur->FileNameLength / sizeof(WCHAR), (DWORD)MAX_PATH - 1);
+        memcpy(name, cur->FileName, len * sizeof(WCHAR));
+        name[len] = 0;
+
+        char tmp[MAX_PATH];
+        UnicodeToAnsiToBuffer(name, tmp, MAX_PATH);
+        const std::string filename(Path::make_canonical(Path::get_full_path_name(tmp)));
+        obj->file_changed_internal(filename);
+
+        if (cur->NextEntryOffset == 0)
+          break;
+        ptr += cur->NextEntryOffset;
+      }
     }
   }
   return 0;
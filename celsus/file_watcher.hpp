@@ -3,6 +3,7 @@
 #include <set>
 #include <map>
 #include "string_utils.hpp"
+#include "StringIdMap.hpp"
 
 class FileWatcher
 {
@@ -16,12 +17,12 @@ public:
   bool close();
 private:
   FileWatcher();
-  static FileWatcher *_instance;
+  static FileWatcher * volatile _instance;
 
   void file_changed_internal(const string2& filename);
   static DWORD WINAPI WatcherThread(void* param);
 
-  typedef std::map< string2, std::vector<fnFileChanged> > FileChangedCallbacks;
+  typedef StringIdMap< std::vector<fnFileChanged> > FileChangedCallbacks;
   typedef std::set< string2 > DeferredFiles;
 
   CRITICAL_SECTION _cs_deferred_files;
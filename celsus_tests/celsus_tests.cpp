@@ -9,6 +9,18 @@
 #include <celsus/Logger.hpp>
 #include <celsus/CelsusExtra.hpp>
 #include <celsus/string_utils.hpp>
+#include <celsus/StringId.hpp>
+#include <celsus/StringIdTable.hpp>
+#include <celsus/StringIdMap.hpp>
+#include <celsus/Timer.hpp>
+#include <celsus/ChunkIO.hpp>
+#include <celsus/ChunkStruct.hpp>
+#include <celsus/crc32c.hpp>
+#include <celsus/file_utils.hpp>
+#include <celsus/MappedWindowReader.hpp>
+#include <celsus/MappedFileWriter.hpp>
+#include <celsus/MappedFileCache.hpp>
+#include <celsus/Profiler.hpp>
 
 struct TestBase
 {
@@ -152,8 +164,749 @@ TEST(string)
 	CHECK_TRUE(s.find("magnus") != s.end());
 }
 
+TEST(string_id)
+{
+	StringId a("Apples");
+	StringId b("APPLES");
+	StringId c("Oranges");
+	CHECK_TRUE(a == b);
+	CHECK_TRUE(a != c);
+	CHECK_TRUE(StringId("") == StringId());
+
+	// compile time hashes must match the ones calculated by the string table
+	CHECK_TRUE(a.hash() == StringIdLiteral("apples").hash());
+	CHECK_TRUE(a == StringIdLiteral("APPLES"));
+	CHECK_TRUE(StringId(StringIdLiteral("Oranges")) == c);
+	CHECK_TRUE(a == "apples" && a != "oranges");
+	CHECK_TRUE(StringId() == StringIdLiteral("") && StringId("") == StringIdLiteral(""));
+	CHECK_TRUE(a != StringIdLiteral("") && StringId() != StringIdLiteral("apples"));
+
+	// only ASCII is folded, by the table and the literal compare alike
+	StringId d("\xe4pple");
+	CHECK_TRUE(d == StringIdLiteral("\xe4PPLE"));
+	CHECK_TRUE(d != StringIdLiteral("\xc4pple"));
+	CHECK_TRUE(d != StringId("\xc4pple"));
+
+	int matched = 0;
+	strSwitch(c)
+	{
+		strCase(Apples)
+			matched = 1;
+		strCase(Oranges)
+			matched = 2;
+	}
+	CHECK_TRUE(matched == 2);
+
+	// batched interning must give the same ids as one at a time
+	const char *batch[] = { "apples", "", "Bananas", NULL, "ORANGES" };
+	StringId batch_ids[5];
+	StringIdTable::instance().intern_batch(batch, 5, batch_ids);
+	CHECK_TRUE(batch_ids[0] == a && batch_ids[4] == c);
+	CHECK_TRUE(batch_ids[1] == StringId() && batch_ids[3] == StringId());
+	CHECK_TRUE(batch_ids[2] == StringId("bananas"));
+
+	// lookups only find strings that are already in the table, and don't add them
+	CHECK_TRUE(StringId::find("ORANGES") == c);
+	CHECK_TRUE(StringId::find("never_interned_string") == StringId());
+	CHECK_TRUE(StringId::find("never_interned_string") == StringId());
+	{
+		StringIdScope scope;
+		StringId t1 = scope.intern("transient_string");
+		CHECK_TRUE(t1 == scope.intern("TRANSIENT_STRING"));
+		CHECK_TRUE(strcmp(t1.get_string(), "transient_string") == 0);
+		CHECK_TRUE(t1.hash() == StringIdLiteral("transient_string").hash());
+		CHECK_TRUE(scope.intern("apples") == a);
+		CHECK_TRUE(StringId::find("transient_string") == StringId());
+	}
+
+	// interning from several threads must hand out the same shared string
+	struct Worker
+	{
+		static DWORD WINAPI run(void *param)
+		{
+			const char **out = (const char **)param;
+			for (int i = 0; i < 1000; ++i)
+				out[i] = StringId(string2::fmt("worker_id_%d", i)).get_string();
+			return 0;
+		}
+	};
+	StringIdTable::instance().reserve(2000);
+	const int num_threads = 4;
+	std::vector<const char *> results(num_threads * 1000);
+	HANDLE threads[num_threads];
+	for (int i = 0; i < num_threads; ++i)
+		threads[i] = CreateThread(NULL, 0, Worker::run, &results[i * 1000], 0, NULL);
+	WaitForMultipleObjects(num_threads, threads, TRUE, INFINITE);
+	for (int i = 0; i < num_threads; ++i)
+		CloseHandle(threads[i]);
+
+	bool same = true;
+	for (int i = 1; i < num_threads; ++i)
+		for (int j = 0; j < 1000; ++j)
+			same &= results[i * 1000 + j] == results[j];
+	CHECK_TRUE(same);
+}
+
+TEST(string_id_map)
+{
+	StringIdMap<int> m;
+	for (int i = 0; i < 100; ++i)
+		m[StringId(string2::fmt("key_%d", i))] = i;
+	CHECK_TRUE(m.size() == 100);
+	CHECK_TRUE(*m.find(StringId("KEY_42")) == 42);
+	CHECK_TRUE(!m.insert(StringId("key_42"), 0));
+
+	// erase every other key, and make sure the rest are still reachable
+	for (int i = 0; i < 100; i += 2)
+		CHECK_TRUE(m.erase(StringId(string2::fmt("key_%d", i))));
+	CHECK_TRUE(m.size() == 50);
+	CHECK_TRUE(m.find(StringId("key_42")) == nullptr);
+
+	int sum = 0, count = 0;
+	for (StringIdMap<int>::const_iterator i = m.begin(), e = m.end(); i != e; ++i) {
+		CHECK_TRUE(i.value() % 2 == 1);
+		sum += i.value();
+		++count;
+	}
+	CHECK_TRUE(count == 50 && sum == 2500);
+}
+
+TEST(chunk_io)
+{
+	const ChunkIo::MainHeader::Version versions[] = { ChunkIo::MainHeader::Uncompressed, ChunkIo::MainHeader::CompressedZLib, ChunkIo::MainHeader::CompressedBZLib,
+#ifdef CHUNK_SUPPORTS_LZ4
+		ChunkIo::MainHeader::CompressedLZ4,
+#endif
+#ifdef CHUNK_SUPPORTS_ZSTD
+		ChunkIo::MainHeader::CompressedZstd,
+#endif
+		ChunkIo::MainHeader::CompressedBlocks };
+	for (size_t v = 0; v < ELEMS_IN_ARRAY(versions); ++v) {
+		// every other version is streamed straight to the file
+		const char *filename = "chunk_io_test.dat";
+		const bool to_file = v % 2 == 0;
+		ChunkIo writer;
+		writer.set_write_directory(true);
+		writer.set_write_checksums(true);
+		if (to_file)
+			CHECK_TRUE(writer.set_output_file(filename));
+		CHECK_TRUE(writer.init_writer(versions[v], 1));
+		{
+			SCOPED_CHUNK(writer, ChunkHeader::Info);
+			writer.write_generic<uint32_t>(42);
+			writer.write_string("hello");
+			const float verts[] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+			CHECK_TRUE(writer.write_array(verts, ELEMS_IN_ARRAY(verts), 16));
+		}
+		{
+			SCOPED_CHUNK(writer, ChunkHeader::Camera);
+			writer.write_generic<float>(1.5f);
+			SCOPED_CHUNK(writer, ChunkHeader::Transform);
+			writer.write_generic<uint32_t>(7);
+		}
+		writer.end_of_data();
+
+		if (!to_file) {
+			uint8_t *buf;
+			uint32_t len;
+			writer.get_buffer(buf, len);
+			CHECK_TRUE(write_file(buf, len, filename));
+		}
+
+		ChunkIo reader;
+		CHECK_TRUE(reader.init_mapped_reader(filename));
+		CHECK_TRUE(reader.cur_header().id_ == ChunkHeader::Info);
+		CHECK_TRUE(reader.read_uint() == 42);
+		CHECK_TRUE(reader.read_string() == "hello");
+		const ChunkSpan<float> verts = reader.read_array<float>();
+		CHECK_TRUE(verts.count_ == 8 && verts[7] == 8);
+		CHECK_TRUE((uintptr_t)verts.data_ % 16 == 0);
+		CHECK_TRUE(reader.is_end_of_chunk());
+		CHECK_TRUE(reader.next());
+		CHECK_TRUE(reader.cur_header().id_ == ChunkHeader::Camera);
+		CHECK_TRUE(reader.read_generic<float>() == 1.5f);
+		reader.next();
+		CHECK_TRUE(reader.is_eof());
+
+		CHECK_TRUE(reader.has_directory());
+		const int camera = reader.find(ChunkHeader::Camera);
+		CHECK_TRUE(camera == 1);
+		const int transform = reader.first_child(camera);
+		CHECK_TRUE(transform == 2);
+		CHECK_TRUE(reader.next_sibling(transform) == -1);
+		CHECK_TRUE(reader.seek(transform));
+		CHECK_TRUE(reader.read_uint() == 7);
+		CHECK_TRUE(reader.seek(reader.find(ChunkHeader::Info)));
+		CHECK_TRUE(reader.read_uint() == 42);
+		CHECK_TRUE(reader.find(ChunkHeader::Light) == -1);
+		DeleteFileA(filename);
+	}
+}
+
+TEST(chunk_io_checksums)
+{
+	CHECK_TRUE(crc32c("123456789", 9) == 0xe3069283);
+	CHECK_TRUE(crc32c("6789", 4, crc32c("12345", 5)) == 0xe3069283);
+
+	const ChunkIo::MainHeader::Version versions[] = { ChunkIo::MainHeader::Uncompressed, ChunkIo::MainHeader::CompressedBlocks };
+	for (size_t v = 0; v < ELEMS_IN_ARRAY(versions); ++v) {
+		ChunkIo writer;
+		writer.set_write_checksums(true);
+		CHECK_TRUE(writer.init_writer(versions[v], 1));
+		for (uint32_t i = 0; i < 2; ++i) {
+			SCOPED_CHUNK(writer, ChunkHeader::Mesh);
+			for (uint32_t j = 0; j < 1000; ++j)
+				writer.write_generic<uint32_t>(i * j);
+		}
+		writer.end_of_data();
+
+		uint8_t *buf;
+		uint32_t len;
+		writer.get_buffer(buf, len);
+		for (int corrupt = 0; corrupt < 2; ++corrupt) {
+			uint8_t *data = new uint8_t[len];
+			memcpy(data, buf, len);
+			ChunkIo reader;
+			if (versions[v] == ChunkIo::MainHeader::Uncompressed) {
+				// flip a bit in the second chunk, which isn't checked until it's reached
+				if (corrupt)
+					data[sizeof(ChunkIo::MainHeader) + 2 * sizeof(ChunkHeader) + 1500 * sizeof(uint32_t)] ^= 1;
+				CHECK_TRUE(reader.init_reader(data, len));
+				CHECK_TRUE(reader.next() == !corrupt);
+			} else {
+				// both chunks are in the first block
+				if (corrupt)
+					data[sizeof(ChunkIo::MainHeader) + sizeof(ChunkIo::BlockHeader)] ^= 1;
+				CHECK_TRUE(reader.init_reader(data, len) == !corrupt);
+			}
+		}
+	}
+}
+
+TEST(chunk_io_append)
+{
+	const char *filename = "chunk_io_append.dat";
+	const char *compacted = "chunk_io_compacted.dat";
+	{
+		ChunkIo writer;
+		writer.set_write_directory(true);
+		writer.set_write_checksums(true);
+		CHECK_TRUE(writer.set_output_file(filename));
+		CHECK_TRUE(writer.init_writer(ChunkIo::MainHeader::Uncompressed));
+		for (uint32_t i = 0; i < 3; ++i) {
+			SCOPED_CHUNK(writer, ChunkHeader::Camera);
+			writer.write_generic<uint32_t>(i);
+			SCOPED_CHUNK(writer, ChunkHeader::Transform);
+			writer.write_generic<float>(1.0f);
+		}
+		writer.end_of_data();
+	}
+
+	// replace the second camera
+	{
+		ChunkIo appender;
+		CHECK_TRUE(appender.init_appender(filename));
+		CHECK_TRUE(appender.remove_chunk(ChunkHeader::Camera, 1));
+		CHECK_TRUE(!appender.remove_chunk(ChunkHeader::Camera, 2));
+		{
+			SCOPED_CHUNK(appender, ChunkHeader::Camera);
+			appender.write_generic<uint32_t>(10);
+			SCOPED_CHUNK(appender, ChunkHeader::Transform);
+			appender.write_generic<float>(2.0f);
+		}
+		appender.end_of_data();
+	}
+	CHECK_TRUE(ChunkIo::compact(filename, compacted));
+
+	const char *files[] = { filename, compacted };
+	for (size_t f = 0; f < ELEMS_IN_ARRAY(files); ++f) {
+		ChunkIo reader;
+		CHECK_TRUE(reader.init_mapped_reader(files[f]));
+		CHECK_TRUE(reader.read_uint() == 0);
+		CHECK_TRUE(reader.next());
+		CHECK_TRUE(reader.read_uint() == 2);
+		CHECK_TRUE(reader.next());
+		CHECK_TRUE(reader.read_uint() == 10);
+		reader.next();
+		CHECK_TRUE(reader.is_eof());
+		CHECK_TRUE(reader.directory_size() == 6);
+		CHECK_TRUE(reader.seek(reader.first_child(reader.find(ChunkHeader::Camera, 2))));
+		CHECK_TRUE(reader.read_generic<float>() == 2.0f);
+	}
+
+	// an append that stops before the header is updated leaves the file as it was
+	uint32_t old_len = 0;
+	uint8_t *old_data = load_file(compacted, &old_len);
+	{
+		ChunkIo appender;
+		CHECK_TRUE(appender.init_appender(compacted));
+		CHECK_TRUE(appender.remove_chunk(ChunkHeader::Camera, 0));
+		{
+			SCOPED_CHUNK(appender, ChunkHeader::Camera);
+			appender.write_generic<uint32_t>(20);
+		}
+		appender.end_of_data();
+	}
+	uint32_t new_len = 0;
+	uint8_t *new_data = load_file(compacted, &new_len);
+	CHECK_TRUE(old_data != NULL && new_data != NULL && new_len > old_len);
+	if (old_data && new_data) {
+		memcpy(new_data, old_data, sizeof(ChunkIo::MainHeader));
+		CHECK_TRUE(write_file(new_data, new_len, compacted));
+		ChunkIo reader;
+		CHECK_TRUE(reader.init_mapped_reader(compacted));
+		CHECK_TRUE(reader.read_uint() == 0);
+		CHECK_TRUE(reader.directory_size() == 6);
+	}
+	delete [] old_data;
+	delete [] new_data;
+
+	DeleteFileA(filename);
+	DeleteFileA(compacted);
+}
+
+struct StructVertex
+{
+	float pos[3];
+	float uv[2];
+};
+#define STRUCT_VERTEX_FIELDS(FIELD) FIELD(pos) FIELD(uv)
+CHUNK_STRUCT(StructVertex, STRUCT_VERTEX_FIELDS)
+
+struct StructNodeV1
+{
+	uint32_t id;
+	float pos[3];
+	std::string name;
+	uint16_t flags;
+};
+#define STRUCT_NODE_V1_FIELDS(FIELD) FIELD(id) FIELD(pos) FIELD(name) FIELD(flags)
+CHUNK_STRUCT(StructNodeV1, STRUCT_NODE_V1_FIELDS)
+
+// a later version, with the fields moved around, one of them wider, and a new one
+struct StructNodeV2
+{
+	StructNodeV2() : weight(0.5) {}
+	double weight;
+	std::string name;
+	uint32_t id;
+	float pos[3];
+	int32_t flags;
+};
+#define STRUCT_NODE_V2_FIELDS(FIELD) FIELD(weight) FIELD(name) FIELD(id) FIELD(pos) FIELD(flags)
+CHUNK_STRUCT(StructNodeV2, STRUCT_NODE_V2_FIELDS)
+
+TEST(chunk_io_structs)
+{
+	const StructVertex verts[] = { { { 1, 2, 3 }, { 4, 5 } }, { { 6, 7, 8 }, { 9, 10 } } };
+	StructNodeV1 nodes[2];
+	for (uint32_t i = 0; i < 2; ++i) {
+		nodes[i].id = i + 1;
+		nodes[i].pos[0] = nodes[i].pos[1] = nodes[i].pos[2] = (float)i;
+		nodes[i].name = i ? "child" : "root";
+		nodes[i].flags = 0x8000;
+	}
+
+	ChunkIo writer;
+	CHECK_TRUE(writer.init_writer(ChunkIo::MainHeader::Uncompressed));
+	{
+		SCOPED_CHUNK(writer, ChunkHeader::Mesh);
+		CHECK_TRUE(write_structs(writer, verts, ELEMS_IN_ARRAY(verts)));
+		CHECK_TRUE(write_structs(writer, nodes, ELEMS_IN_ARRAY(nodes)));
+		CHECK_TRUE(write_structs(writer, nodes, ELEMS_IN_ARRAY(nodes)));
+		CHECK_TRUE(write_struct(writer, nodes[1]));
+	}
+	writer.end_of_data();
+
+	uint8_t *buf;
+	uint32_t len;
+	writer.get_buffer(buf, len);
+	uint8_t *data = new uint8_t[len];
+	memcpy(data, buf, len);
+
+	ChunkIo reader;
+	CHECK_TRUE(reader.init_reader(data, len));
+	std::vector<StructVertex> read_verts;
+	CHECK_TRUE(read_structs(reader, &read_verts));
+	CHECK_TRUE(read_verts.size() == 2 && memcmp(&read_verts[0], verts, sizeof(verts)) == 0);
+
+	std::vector<StructNodeV1> v1;
+	CHECK_TRUE(read_structs(reader, &v1));
+	CHECK_TRUE(v1.size() == 2 && v1[1].id == 2 && v1[1].pos[2] == 1 && v1[1].name == "child" && v1[1].flags == 0x8000);
+
+	std::vector<StructNodeV2> v2;
+	CHECK_TRUE(read_structs(reader, &v2));
+	CHECK_TRUE(v2.size() == 2 && v2[0].id == 1 && v2[0].name == "root" && v2[1].pos[0] == 1);
+	CHECK_TRUE(v2[1].flags == 0x8000 && v2[1].weight == 0.5);
+
+	StructNodeV2 single;
+	CHECK_TRUE(read_struct(reader, &single));
+	CHECK_TRUE(single.id == 2 && single.name == "child");
+	CHECK_TRUE(reader.is_end_of_chunk());
+
+	// structs that run past the end of their chunk, and formats that can't fit in it, are rejected
+	ChunkIo good_writer;
+	CHECK_TRUE(good_writer.init_writer(ChunkIo::MainHeader::Uncompressed));
+	{
+		SCOPED_CHUNK(good_writer, ChunkHeader::Mesh);
+		CHECK_TRUE(write_structs(good_writer, nodes, ELEMS_IN_ARRAY(nodes)));
+	}
+	good_writer.end_of_data();
+	good_writer.get_buffer(buf, len);
+	const uint8_t *structs = buf + sizeof(ChunkIo::MainHeader) + sizeof(ChunkHeader);
+	const uint32_t structs_len = len - sizeof(ChunkIo::MainHeader) - sizeof(ChunkHeader);
+
+	ChunkIo bad_writer;
+	CHECK_TRUE(bad_writer.init_writer(ChunkIo::MainHeader::Uncompressed));
+	{
+		SCOPED_CHUNK(bad_writer, ChunkHeader::Mesh);
+		CHECK_TRUE(bad_writer.write_raw_data(structs, structs_len - 1));
+	}
+	{
+		SCOPED_CHUNK(bad_writer, ChunkHeader::Mesh);
+		bad_writer.write_generic(ChunkStruct<StructVertex>::kFormatHash);
+		bad_writer.write_generic(0x80000000u);
+		bad_writer.write_generic(1u);
+	}
+	bad_writer.end_of_data();
+	bad_writer.get_buffer(buf, len);
+	data = new uint8_t[len];
+	memcpy(data, buf, len);
+
+	ChunkIo bad_reader;
+	CHECK_TRUE(bad_reader.init_reader(data, len));
+	std::vector<StructNodeV1> bad_nodes;
+	CHECK_TRUE(!read_structs(bad_reader, &bad_nodes) && bad_nodes.empty());
+	CHECK_TRUE(bad_reader.next());
+	std::vector<StructVertex> bad_verts;
+	CHECK_TRUE(!read_structs(bad_reader, &bad_verts));
+}
+
+struct InPlaceNode
+{
+	uint32_t id;
+	uint32_t child_count;
+	ChunkPtr<InPlaceNode> children;
+};
+
+TEST(chunk_io_in_place)
+{
+	ChunkIo writer;
+	CHECK_TRUE(writer.init_writer(ChunkIo::MainHeader::CompressedZLib, 1));
+	{
+		SCOPED_CHUNK(writer, ChunkHeader::Hierarchy);
+		InPlaceNode root = { 1, 2 };
+		const uint32_t root_pos = writer.write_in_place(&root);
+		InPlaceNode children[] = { { 2, 0 }, { 3, 0 } };
+		const uint32_t children_pos = writer.write_in_place(children, ELEMS_IN_ARRAY(children));
+		CHECK_TRUE(writer.link(root_pos + offsetof(InPlaceNode, children), children_pos));
+	}
+	writer.end_of_data();
+
+	uint8_t *buf;
+	uint32_t len;
+	writer.get_buffer(buf, len);
+	uint8_t *data = new uint8_t[len];
+	memcpy(data, buf, len);
+
+	ChunkIo reader;
+	CHECK_TRUE(reader.init_reader(data, len));
+	const InPlaceNode *root = reader.read_in_place<InPlaceNode>();
+	CHECK_TRUE(root->id == 1 && root->child_count == 2);
+	CHECK_TRUE(root->children[0].id == 2 && root->children[1].id == 3);
+	CHECK_TRUE(root->children[1].children.get() == NULL);
+}
+
+TEST(memory_mapped_file)
+{
+	const char *filename = "memory_mapped_file.dat";
+	const size_t granularity = MemoryMappedFile::granularity();
+	std::vector<uint32_t> values(granularity);
+	for (size_t i = 0; i < values.size(); ++i)
+		values[i] = (uint32_t)i;
+	CHECK_TRUE(write_file((const uint8_t*)&values[0], (uint32_t)(values.size() * sizeof(uint32_t)), filename));
+
+	{
+		MemoryMappedFile file;
+		void *data = NULL;
+		uint64_t len = 0;
+		CHECK_TRUE(file.open(filename, &data, &len, 0));
+		CHECK_TRUE(len == values.size() * sizeof(uint32_t) && data == file.view());
+		CHECK_TRUE(memcmp(data, &values[0], (size_t)len) == 0);
+
+		const MemoryMappedFile::Access access[] = { MemoryMappedFile::kNormal, MemoryMappedFile::kSequential,
+			MemoryMappedFile::kRandom, MemoryMappedFile::kWillNeed, MemoryMappedFile::kDontNeed };
+		for (size_t i = 0; i < ELEMS_IN_ARRAY(access); ++i)
+			CHECK_TRUE(file.advise(access[i]));
+
+		// views further in start at a multiple of the granularity
+		CHECK_TRUE(file.lock(granularity, granularity));
+		CHECK_TRUE(*(const uint32_t*)file.view() == granularity / sizeof(uint32_t));
+	}
+
+	MemoryMappedFile missing;
+	void *data = NULL;
+	uint64_t len = 0;
+	CHECK_TRUE(!missing.open("memory_mapped_file_missing.dat", &data, &len, 0));
+	DeleteFileA(filename);
+}
+
+TEST(mapped_window_reader)
+{
+	// small windows, so the file spans a few of them
+	const char *filename = "mapped_window_reader.dat";
+	const size_t window_size = MemoryMappedFile::granularity();
+	std::vector<uint32_t> values(window_size + 123);
+	for (size_t i = 0; i < values.size(); ++i)
+		values[i] = (uint32_t)i;
+	CHECK_TRUE(write_file((const uint8_t*)&values[0], (uint32_t)(values.size() * sizeof(uint32_t)), filename));
+
+	MappedWindowReader reader;
+	CHECK_TRUE(reader.open(filename, window_size, 64));
+	CHECK_TRUE(reader.size() == values.size() * sizeof(uint32_t));
+
+	// values that straddle windows still come out whole
+	bool ok = true;
+	for (size_t i = 0, step = 1; !reader.eof(); i += step, step = step % 7 + 1) {
+		ok &= reader.available() >= min(64, reader.size() - reader.pos());
+		ok &= *(const uint32_t*)reader.data() == i;
+		if (!reader.advance(min(step * sizeof(uint32_t), reader.available())))
+			break;
+	}
+	CHECK_TRUE(ok);
+	CHECK_TRUE(reader.pos() == reader.size());
+	CHECK_TRUE(!reader.advance(1));
+
+	CHECK_TRUE(reader.seek(0));
+	CHECK_TRUE(*(const uint32_t*)reader.data() == 0);
+	CHECK_TRUE(reader.seek(window_size * 3 - 4));
+	CHECK_TRUE(*(const uint32_t*)reader.data() == window_size * 3 / 4 - 1);
+	CHECK_TRUE(reader.available() >= 64);
+	CHECK_TRUE(!reader.seek(reader.size() + 1));
+
+	// an empty file is at eof right away
+	CHECK_TRUE(write_file((const uint8_t*)"", 0, filename));
+	CHECK_TRUE(reader.open(filename, window_size, 64));
+	CHECK_TRUE(reader.eof() && reader.size() == 0 && reader.available() == 0 && reader.pos() == 0);
+	CHECK_TRUE(reader.seek(0) && !reader.advance(1));
+	reader.close();
+	DeleteFileA(filename);
+}
+
+TEST(mapped_file_writer)
+{
+	const char *filename = "mapped_file_writer.dat";
+	{
+		// grows a few times on the way
+		MappedFileWriter writer;
+		CHECK_TRUE(writer.open(filename, 100, 1000));
+		CHECK_TRUE(writer.capacity() == 100 && writer.size() == 0);
+		for (uint32_t i = 0; i < 1000; ++i)
+			CHECK_TRUE(writer.write(&i, sizeof(i)));
+		uint32_t *block = (uint32_t *)writer.append(100 * sizeof(uint32_t));
+		CHECK_TRUE(block != NULL);
+		for (uint32_t i = 0; i < 100; ++i)
+			block[i] = 1000 + i;
+		CHECK_TRUE(writer.size() == 1100 * sizeof(uint32_t) && writer.capacity() >= writer.size());
+		CHECK_TRUE(writer.flush(0, (size_t)writer.size()));
+		CHECK_TRUE(writer.close());
+	}
+
+	uint32_t len = 0;
+	uint32_t *data = (uint32_t *)load_file(filename, &len);
+	CHECK_TRUE(data != NULL && len == 1100 * sizeof(uint32_t));
+	bool ok = true;
+	for (uint32_t i = 0; data && i < len / sizeof(uint32_t); ++i)
+		ok &= data[i] == i;
+	CHECK_TRUE(ok);
+	delete [] data;
+}
+
+TEST(mapped_file_cache)
+{
+	const char *filename = "mapped_file_cache.dat";
+	CHECK_TRUE(write_file((const uint8_t*)"first", 5, filename));
+
+	// the same file, with a different path, gets the same view
+	MappedFileCache& cache = MappedFileCache::instance();
+	MappedFileView *a = cache.get(filename);
+	MappedFileView *b = cache.get(string2::fmt("./%s", filename));
+	CHECK_TRUE(a != NULL && a == b);
+	CHECK_TRUE(a->size() == 5 && memcmp(a->data(), "first", 5) == 0);
+	CHECK_TRUE(!a->is_stale());
+	b->release();
+
+	// invalidated views stay readable, but aren't handed out anymore
+	cache.invalidate(filename);
+	CHECK_TRUE(a->is_stale());
+	CHECK_TRUE(memcmp(a->data(), "first", 5) == 0);
+	a->release();
+
+	CHECK_TRUE(write_file((const uint8_t*)"second", 6, filename));
+	MappedFileView *c = cache.get(filename);
+	CHECK_TRUE(c != NULL && !c->is_stale());
+	CHECK_TRUE(c->size() == 6 && memcmp(c->data(), "second", 6) == 0);
+	c->release();
+
+	// the file can be replaced by renaming a new one over it while a view is held, like editors
+	// save. The view keeps the old contents, until FileWatcher reports the change, like here
+	MappedFileView *d = cache.get(filename);
+	CHECK_TRUE(d != NULL);
+	CHECK_TRUE(write_file((const uint8_t*)"third", 5, "mapped_file_cache.tmp"));
+	CHECK_TRUE(!!MoveFileExA("mapped_file_cache.tmp", filename, MOVEFILE_REPLACE_EXISTING));
+	CHECK_TRUE(d->size() == 6 && memcmp(d->data(), "second", 6) == 0);
+	cache.invalidate(filename);
+	CHECK_TRUE(d->is_stale());
+	MappedFileView *e = cache.get(filename);
+	CHECK_TRUE(e != NULL && e != d && e->size() == 5 && memcmp(e->data(), "third", 5) == 0);
+	CHECK_TRUE(memcmp(d->data(), "second", 6) == 0);
+	d->release();
+	e->release();
+
+	CHECK_TRUE(cache.get("mapped_file_cache_missing.dat") == NULL);
+}
+
+TEST(profiler)
+{
+	// each case records on a thread of its own, so it starts out with an empty buffer
+	struct Worker
+	{
+		static DWORD WINAPI round_trip(void *)
+		{
+			SCOPED_PROFILE("outer");
+			SCOPED_PROFILE("inner");
+			return 0;
+		}
+
+		static DWORD WINAPI wrap_around(void *)
+		{
+			static const char *names[] = { "0", "1", "2", "3", "4", "5", "6", "7", "8", "9" };
+			for (int i = 0; i < 10; ++i) {
+				SCOPED_PROFILE(names[i]);
+			}
+			return 0;
+		}
+
+		static DWORD WINAPI keep_recording(void *param)
+		{
+			SCOPED_PROFILE("first");
+			InterlockedExchange((volatile LONG *)param, 1);
+			for (int i = 0; i < 200000; ++i) {
+				SCOPED_PROFILE("busy");
+			}
+			return 0;
+		}
+
+		static void run(LPTHREAD_START_ROUTINE fn, std::list<Profiler::Scope*> *top_level)
+		{
+			DWORD id;
+			HANDLE thread = CreateThread(NULL, 0, fn, NULL, 0, &id);
+			WaitForSingleObject(thread, INFINITE);
+			CloseHandle(thread);
+			Profiler::instance().thread_scopes(id, top_level);
+		}
+	};
+
+	std::list<Profiler::Scope*> top_level;
+	Worker::run(Worker::round_trip, &top_level);
+	CHECK_TRUE(top_level.size() == 1);
+	if (top_level.size() == 1) {
+		const Profiler::Scope *outer = top_level.front();
+		CHECK_TRUE(outer->name_ == "outer" && outer->children_.size() == 1);
+		const Profiler::Scope *inner = outer->children_.front();
+		CHECK_TRUE(inner->name_ == "inner" && inner->children_.empty());
+		CHECK_TRUE(outer->enter_.QuadPart <= inner->enter_.QuadPart && inner->enter_.QuadPart <= inner->leave_.QuadPart);
+		CHECK_TRUE(inner->leave_.QuadPart <= outer->leave_.QuadPart);
+	}
+	container_delete(top_level);
+
+	// that thread has exited and its events have been collected, so the next one takes its buffer
+	// over, and only sees its own events
+	Worker::run(Worker::round_trip, &top_level);
+	CHECK_TRUE(top_level.size() == 1 && top_level.front()->name_ == "outer");
+	container_delete(top_level);
+
+	// 20 events go through a buffer of 8, which keeps the last 7, as the oldest slot is the one
+	// being written. That's the leave of scope 6 and all of scopes 7 to 9
+	Profiler::set_event_count(8);
+	Worker::run(Worker::wrap_around, &top_level);
+	Profiler::set_event_count(Profiler::kDefaultEventCount);
+	CHECK_TRUE(top_level.size() == 3);
+	const char *expected[] = { "7", "8", "9" };
+	int idx = 0;
+	for (std::list<Profiler::Scope*>::const_iterator it = top_level.begin(); it != top_level.end() && idx < 3; ++it, ++idx)
+		CHECK_TRUE((*it)->name_ == expected[idx] && (*it)->children_.empty());
+	container_delete(top_level);
+
+	// a thread that's still recording, but hasn't filled its buffer, doesn't lose any events
+	volatile LONG started = 0;
+	Profiler::set_event_count(512 * 1024);
+	DWORD id;
+	HANDLE thread = CreateThread(NULL, 0, Worker::keep_recording, (void *)&started, 0, &id);
+	while (!started)
+		Sleep(0);
+	bool kept_first = true;
+	while (WaitForSingleObject(thread, 0) == WAIT_TIMEOUT) {
+		Profiler::instance().thread_scopes(id, &top_level);
+		kept_first = kept_first && !top_level.empty() && top_level.front()->name_ == "first";
+		container_delete(top_level);
+	}
+	CloseHandle(thread);
+	Profiler::set_event_count(Profiler::kDefaultEventCount);
+	CHECK_TRUE(kept_first);
+}
+
+// Microbenchmark for StringId lookups, run with "-bench". The names mimic asset paths, with long
+// shared prefixes and similar lengths, which is the worst case for the string compares
+void bench_string_id()
+{
+	static const char *roots[] = { "data/textures/", "data/meshes/", "data/materials/", "data/shaders/", "data/sounds/" };
+	static const char *groups[] = { "environment/forest/", "environment/desert/", "characters/hero/", "characters/npc/", "props/", "fx/" };
+	static const char *suffixes[] = { "_diffuse.dds", "_normal.dds", "_specular.dds", ".mesh", ".mat", ".fx" };
+
+	std::vector<string2> names;
+	for (int i = 0; i < 20000; ++i)
+		names.push_back(string2::fmt("%s%sasset_%05d%s", roots[i % 5], groups[(i / 5) % 6], i / 30, suffixes[i % 6]));
+
+	Timer timer;
+	timer.start();
+	for (size_t i = 0; i < names.size(); ++i)
+		StringId id(names[i]);
+	timer.stop();
+	printf("StringId insert: %.1f ns\n", timer.duration() * 1e9 / names.size());
+
+	// take the best of a number of runs, as we're interested in the cost of the lookup, not in noise
+	double best = 1e9;
+	for (int run = 0; run < 50; ++run) {
+		timer.start();
+		for (size_t i = 0; i < names.size(); ++i)
+			StringId id(names[i]);
+		timer.stop();
+		best = min(best, timer.duration() * 1e9 / names.size());
+	}
+	printf("StringId lookup: %.1f ns\n", best);
+
+	std::vector<const char *> strs(names.size());
+	std::vector<StringId> ids(names.size());
+	for (size_t i = 0; i < names.size(); ++i)
+		strs[i] = names[i];
+	best = 1e9;
+	for (int run = 0; run < 50; ++run) {
+		timer.start();
+		StringIdTable::instance().intern_batch(&strs[0], strs.size(), &ids[0]);
+		timer.stop();
+		best = min(best, timer.duration() * 1e9 / names.size());
+	}
+	printf("StringId batch lookup: %.1f ns\n", best);
+}
+
 int _tmain(int argc, _TCHAR* argv[])
 {
+	if (argc > 1 && _tcscmp(argv[1], _T("-bench")) == 0) {
+		bench_string_id();
+		return 0;
+	}
+
 	TestManager::instance().run_tests();
 	return 0;
 }